@@ -14,8 +14,14 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/uio.h>
 #include <endian.h>
 #include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -28,6 +34,34 @@
 #define GZIP_ENCODING		16
 #define OS_CODE			0x03
 #define ORIG_NAME		0x08
+#define GZIP_BLOCK_SIZE		0x20000
+#define GZIP_DICT_SIZE		0x8000
+#define GZIP_MAX_THREADS	8
+
+// A block of a gzip stream and its deflated data
+struct _gzip_block {
+	const unsigned char	*data;
+	size_t			 size;
+	const unsigned char	*dict;
+	size_t			 dictlen;
+	bool			 last;
+	uLong			 crc;
+	struct buffer_list	*out;
+};
+
+struct _gzip_job {
+	pthread_mutex_t		 lock;
+	struct _gzip_block	*blocks;
+	size_t			 nblocks;
+	size_t			 next;
+};
+
+static void	 _gzip_block_deflate(struct _gzip_block *);
+static void	*_gzip_worker(void *);
+static void	 _buffer_gzip_header(struct buffer_gzip *,
+		struct buffer_list *);
+static void	 _buffer_gzip_deflate(struct buffer_gzip *, bool,
+		struct buffer_list *);
 
 struct buffer *
 buffer_new(const char *_data)
@@ -37,6 +71,7 @@ buffer_new(const char *_data)
 	if (buf == NULL)
 		err(1, NULL);
 	buf->size = data_len;
+	buf->data = buf->store;
 	memcpy(buf->data, _data, data_len);
 	return buf;
 }
@@ -49,6 +84,7 @@ buffer_bin_new(const void *_data, size_t _size)
 	if (buf == NULL)
 		err(1, NULL);
 	buf->size = _size;
+	buf->data = buf->store;
 	memcpy(buf->data, _data, _size);
 	return buf;
 }
@@ -61,6 +97,23 @@ buffer_empty_new(size_t _size)
 	if (buf == NULL)
 		err(1, NULL);
 	buf->size = _size;
+	buf->data = buf->store;
+	return buf;
+}
+
+
+/*
+ * Returns a buffer for _data without copying it, the data has to stay
+ * valid until the buffer is freed.
+ */
+struct buffer *
+buffer_ref_new(const void *_data, size_t _size)
+{
+	struct buffer *buf = malloc(sizeof(struct buffer));
+	if (buf == NULL)
+		err(1, NULL);
+	buf->size = _size;
+	buf->data = (char *)(uintptr_t)_data;
 	return buf;
 }
 
@@ -105,6 +158,60 @@ buffer_write(struct buffer *_buf, int _fd)
 }
 
 
+/*
+ * Writes _buf and the buffers following it in its list without copying
+ * them, up to IOV_MAX with each writev(2). Returns the number of bytes
+ * written or -1.
+ */
+ssize_t
+buffer_writev(struct buffer *_buf, int _fd)
+{
+	struct iovec iov[IOV_MAX];
+	struct buffer *b = _buf;
+	size_t off = 0;		// written bytes of b
+	size_t total = 0;
+
+	while (b) {
+		int cnt = 0;
+		for (struct buffer *n = b; n && cnt < IOV_MAX;
+				n = TAILQ_NEXT(n, entries)) {
+			size_t skip = (n == b) ? off : 0;
+			if (n->size == skip)
+				continue;
+			iov[cnt].iov_base = n->data + skip;
+			iov[cnt].iov_len = n->size - skip;
+			cnt++;
+		}
+		if (cnt == 0)
+			break;
+		ssize_t nw = writev(_fd, iov, cnt);
+		if (nw == -1 && errno == EINTR)
+			continue;
+		if (nw == 0 || nw == -1) {
+			warn("writev");
+			return -1;
+		}
+		total += nw;
+		// Skip what went out, a short write continues within b
+		size_t left = nw;
+		while (b && left >= b->size - off) {
+			left -= b->size - off;
+			off = 0;
+			b = TAILQ_NEXT(b, entries);
+		}
+		off += left;
+	}
+	return total;
+}
+
+
+ssize_t
+buffer_list_writev(struct buffer_list *_bl, int _fd)
+{
+	return buffer_writev(TAILQ_FIRST(&_bl->buffers), _fd);
+}
+
+
 char *
 buffer_list_concat_string(struct buffer_list *_bl)
 {
@@ -187,6 +294,25 @@ buffer_list_add_list(struct buffer_list *_bl, struct buffer_list *_add)
 }
 
 
+void
+buffer_list_add_ref(struct buffer_list *_bl, const void *_data, size_t _size)
+{
+	buffer_list_add_buffer(_bl, buffer_ref_new(_data, _size));
+}
+
+
+/*
+ * Appends references to the buffers of _add, which keeps them.
+ */
+void
+buffer_list_add_list_ref(struct buffer_list *_bl, struct buffer_list *_add)
+{
+	struct buffer *b;
+	TAILQ_FOREACH(b, &_add->buffers, entries)
+		buffer_list_add_ref(_bl, b->data, b->size);
+}
+
+
 struct buffer *
 buffer_list_rem_head(struct buffer_list *_bl)
 {
@@ -227,78 +353,234 @@ buffer_list_rem(struct buffer_list *_bl, struct buffer *_buf)
 }
 
 
-struct buffer_list *
-buffer_list_gzip(struct buffer_list *_in, const char *_name, uint32_t _mtime)
+/*
+ * Deflates one block as part of a gzip stream. All but the last block end
+ * on a byte boundary without the final bit, so the blocks can be joined.
+ * The end of the previous block primes the window, the output does not
+ * depend on the order in which the blocks are compressed.
+ */
+void
+_gzip_block_deflate(struct _gzip_block *_blk)
 {
 	z_stream strm = { 0 };
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
-
-	u_int32_t crc = crc32(0L, Z_NULL, 0);
-
 	int rc;
+
 	if ((rc = deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED,
 				-MAX_WBITS, 9,
 				Z_DEFAULT_STRATEGY)) != Z_OK)
 		errx(1, "deflateInit2: %s", zError(rc));
+	if (_blk->dictlen && (rc = deflateSetDictionary(&strm,
+				(Bytef *)(uintptr_t)_blk->dict,
+				_blk->dictlen)) != Z_OK)
+		errx(1, "deflateSetDictionary: %s", zError(rc));
+
+	_blk->out = buffer_list_new();
+	_blk->crc = crc32(crc32(0L, Z_NULL, 0), _blk->data, _blk->size);
+
+	struct buffer *output = buffer_empty_new(DEFLATE_BUF_SIZE);
+	strm.next_in = (Bytef *)(uintptr_t)_blk->data;
+	strm.avail_in = _blk->size;
+	for (;;) {
+		strm.next_out = (Bytef *)output->data;
+		strm.avail_out = DEFLATE_BUF_SIZE;
+		rc = deflate(&strm, (_blk->last) ? Z_FINISH : Z_SYNC_FLUSH);
+		if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR)
+			errx(1, "deflate: %s", zError(rc));
+		if (strm.avail_out != 0)
+			break;
+		buffer_list_add_buffer(_blk->out, output);
+		output = buffer_empty_new(DEFLATE_BUF_SIZE);
+	}
+	buffer_list_add(_blk->out, output->data,
+			DEFLATE_BUF_SIZE - strm.avail_out);
+	free(output);
+
+	if ((rc = deflateEnd(&strm)) != Z_OK && rc != Z_DATA_ERROR)
+		errx(1, "deflateEnd: %s", zError(rc));
+}
 
-	struct buffer *input, *output;
-	struct buffer_list *out = buffer_list_new();
 
+void *
+_gzip_worker(void *_arg)
+{
+	struct _gzip_job *job = _arg;
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		size_t i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if (i >= job->nblocks)
+			break;
+		_gzip_block_deflate(&job->blocks[i]);
+	}
+	return NULL;
+}
+
+
+/*
+ * Returns a gzip stream whose header names the file _filename, which has
+ * to stay valid until the first output, and its time _mtime. The input is
+ * split into blocks of GZIP_BLOCK_SIZE, as many blocks as there are CPUs
+ * but at most GZIP_MAX_THREADS + 1 are deflated at once. The output does
+ * not depend on the number of threads.
+ */
+struct buffer_gzip *
+buffer_gzip_new(const char *_filename, uint32_t _mtime)
+{
+	struct buffer_gzip *gz = calloc(1, sizeof(struct buffer_gzip));
+	if (gz == NULL)
+		err(1, NULL);
+
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	gz->nblocks = (ncpu > 1) ? ncpu : 1;
+	if (gz->nblocks > GZIP_MAX_THREADS + 1)
+		gz->nblocks = GZIP_MAX_THREADS + 1;
+	gz->data = malloc(GZIP_DICT_SIZE + gz->nblocks * GZIP_BLOCK_SIZE);
+	if (gz->data == NULL)
+		err(1, NULL);
+	gz->crc = crc32(0L, Z_NULL, 0);
+	gz->name = _filename;
+	gz->mtime = _mtime;
+	return gz;
+}
+
+
+void
+buffer_gzip_free(struct buffer_gzip *_gz)
+{
+	if (_gz) {
+		free(_gz->data);
+		free(_gz);
+	}
+}
+
+
+void
+_buffer_gzip_header(struct buffer_gzip *_gz, struct buffer_list *_out)
+{
 	unsigned char gzip_header[10];
 	gzip_header[0] = 0x1f;
 	gzip_header[1] = 0x8b;
 	gzip_header[2] = Z_DEFLATED;
-	gzip_header[3] = (_name) ? ORIG_NAME : 0;
-	gzip_header[4] = _mtime & 0xff;
-	gzip_header[5] = _mtime >> 8;
-	gzip_header[6] = _mtime >> 16;
-	gzip_header[7] = _mtime >> 24;
+	gzip_header[3] = (_gz->name) ? ORIG_NAME : 0;
+	gzip_header[4] = _gz->mtime & 0xff;
+	gzip_header[5] = _gz->mtime >> 8;
+	gzip_header[6] = _gz->mtime >> 16;
+	gzip_header[7] = _gz->mtime >> 24;
 	gzip_header[8] = 2;
 	gzip_header[9] = OS_CODE;
-	buffer_list_add(out, gzip_header, sizeof(gzip_header));
-
-	if (_name)
-		buffer_list_add(out, _name, strlen(_name) + 1);
-
-	output = buffer_empty_new(DEFLATE_BUF_SIZE);
-	strm.total_in = _in->size;
-	strm.next_out = output->data;
-	strm.avail_out = DEFLATE_BUF_SIZE;
-
-	TAILQ_FOREACH(input, &_in->buffers, entries) {
-		strm.avail_in = input->size;
-		strm.next_in = input->data;
-
-		while (strm.avail_in) {
-			if ((rc = deflate(&strm, Z_NO_FLUSH)) != Z_OK)
-				errx(1, "deflate: %s", zError(rc));
-			if (strm.avail_out == 0) {
-				buffer_list_add_buffer(out, output);
-				output = buffer_empty_new(DEFLATE_BUF_SIZE);
-				strm.next_out = output->data;
-				strm.avail_out = DEFLATE_BUF_SIZE;
-			}
-		}
-		crc = crc32(crc, input->data, input->size);
+	buffer_list_add(_out, gzip_header, sizeof(gzip_header));
+
+	if (_gz->name)
+		buffer_list_add(_out, _gz->name, strlen(_gz->name) + 1);
+}
+
+
+/*
+ * Deflates the pending input in parallel blocks and appends them to _out,
+ * with _last the final block ends the stream.
+ */
+void
+_buffer_gzip_deflate(struct buffer_gzip *_gz, bool _last,
+		struct buffer_list *_out)
+{
+	pthread_t threads[GZIP_MAX_THREADS];
+	struct _gzip_job job;
+	unsigned char *data = _gz->data + _gz->dictlen;
+
+	if (! _gz->started) {
+		_buffer_gzip_header(_gz, _out);
+		_gz->started = true;
 	}
-	if ((rc = deflate(&strm, Z_FINISH)) != Z_STREAM_END)
-		errx(1, "deflate: %s", zError(rc));
 
-	if ((rc = deflateEnd(&strm)) != Z_OK)
-		errx(1, "deflateEnd: %s", zError(rc));
+	// The window of a block reaches back into the previous one
+	job.nblocks = (_gz->used) ? (_gz->used - 1) / GZIP_BLOCK_SIZE + 1 : 1;
+	job.next = 0;
+	job.blocks = calloc(job.nblocks, sizeof(struct _gzip_block));
+	if (job.blocks == NULL)
+		err(1, NULL);
+	for (size_t i = 0; i < job.nblocks; i++) {
+		struct _gzip_block *blk = &job.blocks[i];
+		size_t off = i * GZIP_BLOCK_SIZE;
+		blk->data = data + off;
+		blk->size = (i + 1 < job.nblocks) ? GZIP_BLOCK_SIZE
+			: _gz->used - off;
+		blk->dictlen = (_gz->dictlen + off < GZIP_DICT_SIZE)
+			? _gz->dictlen + off : GZIP_DICT_SIZE;
+		blk->dict = blk->data - blk->dictlen;
+		blk->last = _last && (i + 1 == job.nblocks);
+	}
+	if (pthread_mutex_init(&job.lock, NULL) != 0)
+		errx(1, "pthread_mutex_init");
+
+	// The calling thread compresses as well, a failed thread is no error
+	size_t nthreads = job.nblocks - 1;
+	size_t started = 0;
+	for (; started < nthreads; started++) {
+		if (pthread_create(&threads[started], NULL, _gzip_worker,
+					&job) != 0)
+			break;
+	}
+	_gzip_worker(&job);
+	for (size_t i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&job.lock);
+
+	for (size_t i = 0; i < job.nblocks; i++) {
+		struct _gzip_block *blk = &job.blocks[i];
+		_gz->crc = crc32_combine(_gz->crc, blk->crc, blk->size);
+		buffer_list_add_list(_out, blk->out);
+		free(blk->out);
+	}
+	free(job.blocks);
+
+	// The end of the input primes the window of the next block
+	size_t total = _gz->dictlen + _gz->used;
+	size_t keep = (total < GZIP_DICT_SIZE) ? total : GZIP_DICT_SIZE;
+	memmove(_gz->data, _gz->data + total - keep, keep);
+	_gz->dictlen = keep;
+	_gz->size += _gz->used;
+	_gz->used = 0;
+}
 
-	size_t last_buf_size = DEFLATE_BUF_SIZE - strm.avail_out;
-	if (last_buf_size != 0) {
-		buffer_list_add(out, output->data, last_buf_size);
-		u_int32_t y = htole32(crc);
-		buffer_list_add(out, &y, sizeof(u_int32_t));
-		u_int32_t s = htole32(_in->size & 0xffffffff);
-		buffer_list_add(out, &s, sizeof(u_int32_t));
+
+/*
+ * Adds _size bytes at _data to the stream. The compressed data is
+ * appended to _out whenever the pending blocks are full.
+ */
+void
+buffer_gzip_add(struct buffer_gzip *_gz, const void *_data, size_t _size,
+		struct buffer_list *_out)
+{
+	const unsigned char *p = _data;
+	size_t room = _gz->nblocks * GZIP_BLOCK_SIZE;
+
+	while (_size) {
+		// Deflated only once more input follows, so the last block
+		// does not depend on the number of blocks deflated at once
+		if (_gz->used == room)
+			_buffer_gzip_deflate(_gz, false, _out);
+		size_t n = room - _gz->used;
+		if (n > _size)
+			n = _size;
+		memcpy(_gz->data + _gz->dictlen + _gz->used, p, n);
+		_gz->used += n;
+		p += n;
+		_size -= n;
 	}
+}
 
-	free(output);
 
-	return out;
+/*
+ * Ends the stream with the pending input and the trailer.
+ */
+void
+buffer_gzip_finish(struct buffer_gzip *_gz, struct buffer_list *_out)
+{
+	_buffer_gzip_deflate(_gz, true, _out);
+
+	uint32_t y = htole32(_gz->crc);
+	buffer_list_add(_out, &y, sizeof(uint32_t));
+	uint32_t s = htole32(_gz->size & 0xffffffff);
+	buffer_list_add(_out, &s, sizeof(uint32_t));
 }
@@ -18,12 +18,15 @@
 #define __BUFFER_H__
 
 #include <sys/queue.h>
+#include <stdbool.h>
 #include <stdint.h>
 
+// data points to store unless the buffer refers to data it does not own
 struct buffer {
 	TAILQ_ENTRY(buffer)	entries;
 	size_t			size;
-	char			data[1];
+	char			*data;
+	char			store[1];
 };
 
 struct buffer_list {
@@ -31,10 +34,26 @@ struct buffer_list {
 	size_t					size;
 };
 
+// A gzip stream deflated in parallel blocks
+struct buffer_gzip {
+	unsigned char	*data;		// window followed by pending input
+	size_t		 dictlen;
+	size_t		 used;
+	size_t		 nblocks;
+	uint32_t	 crc;
+	uint64_t	 size;
+	const char	*name;
+	uint32_t	 mtime;
+	bool		 started;
+};
+
 struct buffer		*buffer_new(const char *_data);
 struct buffer		*buffer_bin_new(const void *, size_t);
 struct buffer		*buffer_empty_new(size_t);
+struct buffer		*buffer_ref_new(const void *, size_t);
 ssize_t			 buffer_write(struct buffer *, int);
+ssize_t			 buffer_writev(struct buffer *, int);
+ssize_t			 buffer_list_writev(struct buffer_list *, int);
 char			*buffer_list_concat_string(struct buffer_list *);
 char			*buffer_list_concat(struct buffer_list *);
 struct buffer_list	*buffer_list_new(void);
@@ -49,11 +68,19 @@ void			 buffer_list_add_buffer(struct buffer_list *,
 		struct buffer *);
 void			buffer_list_add_list(struct buffer_list *,
 		struct buffer_list *);
+void			 buffer_list_add_ref(struct buffer_list *,
+		const void *, size_t);
+void			 buffer_list_add_list_ref(struct buffer_list *,
+		struct buffer_list *);
 struct buffer		*buffer_list_rem_head(struct buffer_list *);
 struct buffer		*buffer_list_rem_tail(struct buffer_list *);
 struct buffer		*buffer_list_rem(struct buffer_list *, struct buffer *);
-struct buffer_list	*buffer_list_gzip(struct buffer_list *,
-		const char *_filename, uint32_t _mtime);
+struct buffer_gzip	*buffer_gzip_new(const char *, uint32_t);
+void			 buffer_gzip_free(struct buffer_gzip *);
+void			 buffer_gzip_add(struct buffer_gzip *, const void *,
+		size_t, struct buffer_list *);
+void			 buffer_gzip_finish(struct buffer_gzip *,
+		struct buffer_list *);
 
 
 
@@ -0,0 +1,666 @@
+/*
+ * Copyright (c) 2018 Markus Hennecke <markus-hennecke@markus-hennecke.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Render cache shared between all cms processes.
+ *
+ * The cache file is mapped shared and consists of a header, an array of
+ * nslots slot descriptors and nslots data areas of slot_size bytes each.
+ * A key hashes to a home slot and may live in any of the CACHE_PROBES
+ * slots following it. Each data area holds the key string followed by
+ * the cached body, the slot descriptor keeps the validator, modification
+ * time and content type the body is sent with.
+ *
+ * Readers never lock: a slot is protected by a sequence counter which is
+ * odd while a writer updates it. A reader copies the data out and retries
+ * or misses if the counter changed meanwhile. Writers claim a slot by
+ * moving the counter from even to odd, a writer losing that race simply
+ * does not store its result.
+ *
+ * Eviction uses the CLOCK algorithm over the probe window of a key.
+ * Entries are not removed when their validator changes, so a stale copy
+ * can still be served while a new one is rendered.
+ *
+ * Data larger than a slot can be stored in chunks under the keys
+ * "key/0", "key/1" and so on. The first chunk starts with the total size,
+ * the data is only returned if all chunks are present with the same
+ * validator. Chunks are counted in their own statistics.
+ *
+ * A cache file of another version or geometry is not truncated, a new
+ * one is created and renamed over it. Processes still mapping the old
+ * file keep using it until they exit.
+ *
+ * Keys known not to exist are kept in a separate table of CACHE_NEGATIVE
+ * 64 bit tags, each one a hash over the key and its validator. Tags are
+ * written with a single atomic store and need no sequence counter.
+ *
+ * Concurrent misses for the same key are coalesced: the first process
+ * takes a fcntl(2) lock on the byte at the key hash and renders the page,
+ * the others poll for that lock and read the stored result. The lock
+ * byte lies far beyond the end of the file, so unrelated keys do not
+ * share it. A waiter gives up after CACHE_FILL_WAIT milliseconds and
+ * renders the page itself. The kernel drops the lock if the rendering
+ * process dies.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "helper.h"
+
+#define CACHE_READ_RETRIES	3
+#define CACHE_INIT_LOCK		0
+#define CACHE_INIT_RETRIES	3
+#define CACHE_POLL_MS		10
+
+static size_t			 _cache_size(uint32_t, uint32_t);
+static int			 _cache_create(const char *, uint32_t, uint32_t);
+static bool			 _cache_init(struct cache *, const char *, uint32_t,
+		uint32_t);
+static struct cache_slot	*_cache_probe(struct cache *, uint64_t,
+		uint32_t);
+static char			*_cache_slot_data(struct cache *,
+		struct cache_slot *);
+static struct buffer		*_cache_find(struct cache *, const char *,
+		uint64_t, bool, struct cache_meta *);
+static char			*_cache_chunk_key(const char *, uint32_t);
+static uint64_t			 _cache_negative_tag(const char *, uint64_t);
+static int			 _cache_lock(struct cache *, off_t, int, int);
+static int			 _cache_fill_lock(struct cache *, const char *,
+		int, int);
+
+
+size_t
+_cache_size(uint32_t _nslots, uint32_t _slot_size)
+{
+	return sizeof(struct cache_header)
+		+ CACHE_NEGATIVE * sizeof(uint64_t)
+		+ (size_t)_nslots * sizeof(struct cache_slot)
+		+ (size_t)_nslots * _slot_size;
+}
+
+
+/*
+ * Creates an empty cache file with the geometry under a temporary name
+ * and renames it to _filename. Returns its descriptor.
+ */
+int
+_cache_create(const char *_filename, uint32_t _nslots, uint32_t _slot_size)
+{
+	struct cache_header hdr;
+	char *tmp;
+
+	if (asprintf(&tmp, "%s.XXXXXXXXXX", _filename) == -1)
+		err(1, NULL);
+	int fd = mkostemp(tmp, O_CLOEXEC);
+	if (fd == -1) {
+		warn("%s", tmp);
+		free(tmp);
+		return -1;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CACHE_MAGIC;
+	hdr.version = CACHE_VERSION;
+	hdr.nslots = _nslots;
+	hdr.slot_size = _slot_size;
+	if (ftruncate(fd, _cache_size(_nslots, _slot_size)) == -1) {
+		warn("ftruncate");
+		goto fail;
+	}
+	if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		warn("pwrite");
+		goto fail;
+	}
+	if (rename(tmp, _filename) == -1) {
+		warn("rename(%s)", tmp);
+		goto fail;
+	}
+	free(tmp);
+	return fd;
+fail:
+	unlink(tmp);
+	close(fd);
+	free(tmp);
+	return -1;
+}
+
+
+bool
+_cache_init(struct cache *_c, const char *_filename, uint32_t _nslots,
+		uint32_t _slot_size)
+{
+	struct stat sb, path_sb;
+	struct cache_header hdr;
+	size_t size = _cache_size(_nslots, _slot_size);
+
+	for (int retry = 0; ; retry++) {
+		if (_cache_lock(_c, CACHE_INIT_LOCK, F_SETLKW, F_WRLCK) == -1) {
+			warn("fcntl");
+			return false;
+		}
+		if (fstat(_c->fd, &sb) == -1) {
+			warn("fstat");
+			goto fail;
+		}
+		// Another process may have replaced the file meanwhile
+		if (stat(_filename, &path_sb) == 0
+				&& path_sb.st_dev == sb.st_dev
+				&& path_sb.st_ino == sb.st_ino)
+			break;
+		if (retry == CACHE_INIT_RETRIES) {
+			warnx("%s: replaced too often", _filename);
+			goto fail;
+		}
+		_cache_lock(_c, CACHE_INIT_LOCK, F_SETLK, F_UNLCK);
+		close(_c->fd);
+		_c->fd = open(_filename, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+		if (_c->fd == -1) {
+			warn("%s", _filename);
+			return false;
+		}
+	}
+	if ((size_t)sb.st_size == size
+			&& pread(_c->fd, &hdr, sizeof(hdr), 0) == sizeof(hdr)
+			&& hdr.magic == CACHE_MAGIC
+			&& hdr.version == CACHE_VERSION
+			&& hdr.nslots == _nslots
+			&& hdr.slot_size == _slot_size) {
+		_cache_lock(_c, CACHE_INIT_LOCK, F_SETLK, F_UNLCK);
+		return true;
+	}
+
+	// Other processes may still map the file and read it without a
+	// lock, truncating it would kill them with SIGBUS
+	int fd = _cache_create(_filename, _nslots, _slot_size);
+	if (fd == -1)
+		goto fail;
+	_cache_lock(_c, CACHE_INIT_LOCK, F_SETLK, F_UNLCK);
+	close(_c->fd);
+	_c->fd = fd;
+	return true;
+fail:
+	_cache_lock(_c, CACHE_INIT_LOCK, F_SETLK, F_UNLCK);
+	return false;
+}
+
+
+struct cache *
+cache_open(const char *_filename, uint32_t _nslots, uint32_t _slot_size)
+{
+	if (_nslots == 0 || _slot_size == 0)
+		return NULL;
+
+	struct cache *c = calloc(1, sizeof(struct cache));
+	if (c == NULL)
+		err(1, NULL);
+	c->fd = open(_filename, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (c->fd == -1) {
+		warn("%s", _filename);
+		goto bailout;
+	}
+	if (! _cache_init(c, _filename, _nslots, _slot_size))
+		goto bailout;
+
+	c->mapsize = _cache_size(_nslots, _slot_size);
+	c->map = mmap(NULL, c->mapsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+			c->fd, 0);
+	if (c->map == MAP_FAILED) {
+		warn("mmap(%s)", _filename);
+		c->map = NULL;
+		goto bailout;
+	}
+	c->header = c->map;
+	c->negative = (uint64_t *)(c->header + 1);
+	c->slots = (struct cache_slot *)(c->negative + CACHE_NEGATIVE);
+	c->data = (char *)(c->slots + _nslots);
+	return c;
+
+bailout:
+	cache_close(c);
+	return NULL;
+}
+
+
+void
+cache_close(struct cache *_c)
+{
+	if (_c) {
+		if (_c->map)
+			munmap(_c->map, _c->mapsize);
+		if (_c->fd != -1)
+			close(_c->fd);
+		free(_c);
+	}
+}
+
+
+struct cache_slot *
+_cache_probe(struct cache *_c, uint64_t _hash, uint32_t _n)
+{
+	return &_c->slots[(_hash + _n) % _c->header->nslots];
+}
+
+
+char *
+_cache_slot_data(struct cache *_c, struct cache_slot *_slot)
+{
+	return _c->data + (size_t)(_slot - _c->slots) * _c->header->slot_size;
+}
+
+
+struct buffer *
+_cache_find(struct cache *_c, const char *_key, uint64_t _validator,
+		bool _stale, struct cache_meta *_meta)
+{
+	struct cache_meta meta;
+	size_t keylen = strlen(_key);
+	uint64_t hash = hash_fnv1a(HASH_FNV1A_INIT, _key, keylen);
+
+	for (uint32_t n = 0; n < CACHE_PROBES; n++) {
+		struct cache_slot *slot = _cache_probe(_c, hash, n);
+		const char *data = _cache_slot_data(_c, slot);
+
+		for (int retry = 0; retry < CACHE_READ_RETRIES; retry++) {
+			uint32_t seq = __atomic_load_n(&slot->seq,
+					__ATOMIC_ACQUIRE);
+			if (seq & 1)
+				continue;
+			if (slot->hash != hash || slot->keylen != keylen
+					|| (slot->meta.validator != _validator
+						&& ! _stale))
+				break;
+			size_t size = slot->size;
+			if (keylen + size > _c->header->slot_size)
+				break;
+			struct buffer *b = buffer_empty_new(size);
+			int keycmp = memcmp(data, _key, keylen);
+			memcpy(b->data, data + keylen, size);
+			memcpy(&meta, &slot->meta, sizeof(meta));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED)
+					!= seq) {
+				free(b);
+				continue;
+			}
+			if (keycmp != 0) {
+				free(b);
+				break;
+			}
+			if (slot->ref == 0)
+				__atomic_store_n(&slot->ref, 1,
+						__ATOMIC_RELAXED);
+			if (_meta) {
+				*_meta = meta;
+				_meta->type[CACHE_TYPE_LEN - 1] = '\0';
+			}
+			return b;
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * Returns the entry stored for the key with the validator. Its meta data
+ * is copied to _meta unless that is NULL.
+ */
+struct buffer *
+cache_lookup(struct cache *_c, const char *_key, uint64_t _validator,
+		struct cache_meta *_meta)
+{
+	struct buffer *b = _cache_find(_c, _key, _validator, false, _meta);
+	__atomic_fetch_add(b ? &_c->header->hits : &_c->header->misses, 1,
+			__ATOMIC_RELAXED);
+	return b;
+}
+
+
+/*
+ * Returns the entry stored for the key regardless of its validator. An
+ * entry stored with other access control inputs than _access is never
+ * returned.
+ */
+struct buffer *
+cache_lookup_stale(struct cache *_c, const char *_key, uint64_t _access,
+		struct cache_meta *_meta)
+{
+	struct cache_meta meta;
+
+	struct buffer *b = _cache_find(_c, _key, 0, true, &meta);
+	if (b && meta.access != _access) {
+		free(b);
+		return NULL;
+	}
+	if (b) {
+		__atomic_fetch_add(&_c->header->stale, 1, __ATOMIC_RELAXED);
+		if (_meta)
+			*_meta = meta;
+	}
+	return b;
+}
+
+
+int
+_cache_lock(struct cache *_c, off_t _offset, int _cmd, int _type)
+{
+	struct flock fl = { 0 };
+
+	fl.l_type = _type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = _offset;
+	fl.l_len = 1;
+	return fcntl(_c->fd, _cmd, &fl);
+}
+
+
+int
+_cache_fill_lock(struct cache *_c, const char *_key, int _cmd, int _type)
+{
+	uint64_t hash = hash_fnv1a(HASH_FNV1A_INIT, _key, strlen(_key));
+	// Keep clear of the init lock and inside the range of off_t
+	return _cache_lock(_c, 1 + (off_t)(hash >> 2), _cmd, _type);
+}
+
+
+/*
+ * Returns true if the caller is the only process filling the entry for
+ * the key and has to call cache_fill_end() after storing it.
+ */
+bool
+cache_fill_begin(struct cache *_c, const char *_key)
+{
+	return (_cache_fill_lock(_c, _key, F_SETLK, F_WRLCK) != -1);
+}
+
+
+/*
+ * Like cache_fill_begin(), but waits up to CACHE_FILL_WAIT ms for another
+ * process to release the lock.
+ */
+bool
+cache_fill_take(struct cache *_c, const char *_key)
+{
+	const struct timespec poll = { 0, CACHE_POLL_MS * 1000000L };
+
+	for (int ms = 0; ms < CACHE_FILL_WAIT; ms += CACHE_POLL_MS) {
+		if (_cache_fill_lock(_c, _key, F_SETLK, F_WRLCK) != -1)
+			return true;
+		if (errno != EACCES && errno != EAGAIN) {
+			warn("fcntl");
+			return false;
+		}
+		nanosleep(&poll, NULL);
+	}
+	return false;
+}
+
+
+/*
+ * Waits for the process filling the entry for the key and returns its
+ * result. Returns NULL if there is none after CACHE_FILL_WAIT ms, the
+ * caller renders the entry itself then.
+ */
+struct buffer *
+cache_fill_wait(struct cache *_c, const char *_key, uint64_t _validator,
+		struct cache_meta *_meta)
+{
+	const struct timespec poll = { 0, CACHE_POLL_MS * 1000000L };
+	struct buffer *b = NULL;
+
+	for (int ms = 0; ms < CACHE_FILL_WAIT && b == NULL;
+			ms += CACHE_POLL_MS) {
+		if (_cache_fill_lock(_c, _key, F_SETLK, F_RDLCK) != -1) {
+			_cache_fill_lock(_c, _key, F_SETLK, F_UNLCK);
+			b = _cache_find(_c, _key, _validator, false, _meta);
+			break;
+		}
+		if (errno != EACCES && errno != EAGAIN) {
+			warn("fcntl");
+			return NULL;
+		}
+		// The entry may be stored before the lock is released
+		if ((b = _cache_find(_c, _key, _validator, false, _meta)))
+			break;
+		nanosleep(&poll, NULL);
+	}
+	if (b)
+		__atomic_fetch_add(&_c->header->coalesced, 1,
+				__ATOMIC_RELAXED);
+	return b;
+}
+
+
+void
+cache_fill_end(struct cache *_c, const char *_key)
+{
+	_cache_fill_lock(_c, _key, F_SETLK, F_UNLCK);
+}
+
+
+bool
+cache_store(struct cache *_c, const char *_key, const struct cache_meta *_meta,
+		struct buffer_list *_bl)
+{
+	size_t keylen = strlen(_key);
+	uint64_t hash = hash_fnv1a(HASH_FNV1A_INIT, _key, keylen);
+	struct cache_slot *victim = NULL;
+	uint32_t n;
+
+	if (keylen + _bl->size > _c->header->slot_size)
+		return false;
+
+	// Reuse the slot already holding the key or a free one
+	for (n = 0; n < CACHE_PROBES && victim == NULL; n++) {
+		struct cache_slot *slot = _cache_probe(_c, hash, n);
+		if (slot->hash == hash && slot->keylen == keylen
+				&& memcmp(_cache_slot_data(_c, slot), _key,
+					keylen) == 0)
+			victim = slot;
+	}
+	for (n = 0; n < CACHE_PROBES && victim == NULL; n++) {
+		struct cache_slot *slot = _cache_probe(_c, hash, n);
+		if (slot->keylen == 0)
+			victim = slot;
+	}
+	if (victim == NULL) {
+		// CLOCK: give referenced slots a second chance
+		uint32_t hand = __atomic_fetch_add(&_c->header->hand, 1,
+				__ATOMIC_RELAXED);
+		for (n = 0; n < 2 * CACHE_PROBES && victim == NULL; n++) {
+			struct cache_slot *slot = _cache_probe(_c, hash,
+					(hand + n) % CACHE_PROBES);
+			if (__atomic_exchange_n(&slot->ref, 0,
+						__ATOMIC_RELAXED) == 0)
+				victim = slot;
+		}
+		if (victim == NULL)
+			return false;
+	}
+
+	uint32_t seq = __atomic_load_n(&victim->seq, __ATOMIC_RELAXED);
+	if ((seq & 1) || ! __atomic_compare_exchange_n(&victim->seq, &seq,
+				seq + 1, false, __ATOMIC_ACQUIRE,
+				__ATOMIC_RELAXED))
+		return false;
+
+	char *data = _cache_slot_data(_c, victim);
+	memcpy(data, _key, keylen);
+	data += keylen;
+
+	struct buffer *b;
+	TAILQ_FOREACH(b, &_bl->buffers, entries) {
+		memcpy(data, b->data, b->size);
+		data += b->size;
+	}
+	victim->hash = hash;
+	victim->keylen = keylen;
+	victim->meta = *_meta;
+	victim->size = _bl->size;
+	victim->stored = time(NULL);
+	victim->ref = 1;
+
+	__atomic_store_n(&victim->seq, seq + 2, __ATOMIC_RELEASE);
+	return true;
+}
+
+
+char *
+_cache_chunk_key(const char *_key, uint32_t _n)
+{
+	char *key;
+	if (asprintf(&key, "%s/%u", _key, _n) == -1)
+		err(1, NULL);
+	return key;
+}
+
+
+/*
+ * Returns the data stored with cache_store_chunks() for the key and the
+ * validator. A missing chunk misses the whole entry.
+ */
+struct buffer *
+cache_lookup_chunks(struct cache *_c, const char *_key, uint64_t _validator)
+{
+	struct buffer *out = NULL;
+	struct buffer *b;
+	uint64_t total;
+	size_t off;
+
+	char *key = _cache_chunk_key(_key, 0);
+	b = _cache_find(_c, key, _validator, false, NULL);
+	free(key);
+	if (b == NULL || b->size < sizeof(total))
+		goto miss;
+	memcpy(&total, b->data, sizeof(total));
+	if (total > (uint64_t)_c->header->nslots * _c->header->slot_size
+			|| b->size - sizeof(total) > total)
+		goto miss;
+	out = buffer_empty_new(total);
+	off = b->size - sizeof(total);
+	memcpy(out->data, b->data + sizeof(total), off);
+	for (uint32_t n = 1; off < total; n++) {
+		free(b);
+		key = _cache_chunk_key(_key, n);
+		b = _cache_find(_c, key, _validator, false, NULL);
+		free(key);
+		if (b == NULL || b->size == 0 || b->size > total - off)
+			goto miss;
+		memcpy(out->data + off, b->data, b->size);
+		off += b->size;
+	}
+	free(b);
+	__atomic_fetch_add(&_c->header->chunk_hits, 1, __ATOMIC_RELAXED);
+	return out;
+miss:
+	free(b);
+	free(out);
+	__atomic_fetch_add(&_c->header->chunk_misses, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+
+/*
+ * Stores _bl in as many slots as it needs.
+ */
+bool
+cache_store_chunks(struct cache *_c, const char *_key,
+		const struct cache_meta *_meta, struct buffer_list *_bl)
+{
+	uint64_t total = _bl->size;
+	char *data = (total) ? buffer_list_concat(_bl) : NULL;
+	size_t off = 0;
+	bool stored = true;
+
+	for (uint32_t n = 0; stored && (n == 0 || off < total); n++) {
+		char *key = _cache_chunk_key(_key, n);
+		size_t head = (n == 0) ? sizeof(total) : 0;
+		size_t room = _c->header->slot_size;
+		if (room <= strlen(key) + head) {
+			free(key);
+			stored = false;
+			break;
+		}
+		room -= strlen(key) + head;
+		size_t len = (total - off < room) ? total - off : room;
+
+		struct buffer_list *chunk = buffer_list_new();
+		if (head)
+			buffer_list_add_ref(chunk, &total, sizeof(total));
+		if (len)
+			buffer_list_add_ref(chunk, data + off, len);
+		stored = cache_store(_c, key, _meta, chunk);
+		off += len;
+		buffer_list_free(chunk);
+		free(chunk);
+		free(key);
+	}
+	free(data);
+	return stored;
+}
+
+
+uint64_t
+_cache_negative_tag(const char *_key, uint64_t _validator)
+{
+	uint64_t tag = hash_fnv1a(HASH_FNV1A_INIT, _key, strlen(_key));
+	tag = hash_fnv1a(tag, &_validator, sizeof(_validator));
+	return (tag != 0) ? tag : 1;
+}
+
+
+bool
+cache_negative_lookup(struct cache *_c, const char *_key, uint64_t _validator)
+{
+	uint64_t tag = _cache_negative_tag(_key, _validator);
+
+	for (uint32_t n = 0; n < CACHE_PROBES; n++) {
+		uint64_t *t = &_c->negative[(tag + n) % CACHE_NEGATIVE];
+		if (__atomic_load_n(t, __ATOMIC_RELAXED) == tag)
+			return true;
+	}
+	return false;
+}
+
+
+void
+cache_negative_store(struct cache *_c, const char *_key, uint64_t _validator)
+{
+	uint64_t tag = _cache_negative_tag(_key, _validator);
+	uint32_t victim = __atomic_fetch_add(&_c->header->hand, 1,
+			__ATOMIC_RELAXED) % CACHE_PROBES;
+
+	for (uint32_t n = 0; n < CACHE_PROBES; n++) {
+		uint64_t *t = &_c->negative[(tag + n) % CACHE_NEGATIVE];
+		uint64_t cur = __atomic_load_n(t, __ATOMIC_RELAXED);
+		if (cur == tag)
+			return;
+		if (cur == 0) {
+			victim = n;
+			break;
+		}
+	}
+	__atomic_store_n(&_c->negative[(tag + victim) % CACHE_NEGATIVE], tag,
+			__ATOMIC_RELAXED);
+}
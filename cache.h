@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2018 Markus Hennecke <markus-hennecke@markus-hennecke.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "buffer.h"
+
+#define CACHE_MAGIC	0x434d5343	// "CMSC"
+#define CACHE_VERSION	7
+#define CACHE_PROBES	8
+#define CACHE_FILL_WAIT	2000	// ms to wait for another process
+#define CACHE_NEGATIVE	1024
+#define CACHE_TYPE_LEN	32
+
+struct cache_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	nslots;
+	uint32_t	slot_size;
+	uint32_t	hand;
+	uint32_t	reserved;
+	uint64_t	hits;
+	uint64_t	misses;
+	uint64_t	coalesced;
+	uint64_t	stale;
+	uint64_t	chunk_hits;
+	uint64_t	chunk_misses;
+};
+
+// Describes the response stored with an entry
+struct cache_meta {
+	uint64_t	validator;
+	uint64_t	access;		// access control inputs
+	int64_t		modified;
+	char		type[CACHE_TYPE_LEN];
+};
+
+struct cache_slot {
+	uint32_t		seq;
+	uint32_t		ref;
+	uint64_t		hash;
+	struct cache_meta	meta;
+	int64_t			stored;
+	uint32_t		keylen;
+	uint32_t		size;
+};
+
+struct cache {
+	int			 fd;
+	void			*map;
+	size_t			 mapsize;
+	struct cache_header	*header;
+	struct cache_slot	*slots;
+	char			*data;
+	uint64_t		*negative;
+};
+
+struct cache		*cache_open(const char *, uint32_t, uint32_t);
+void			 cache_close(struct cache *);
+struct buffer		*cache_lookup(struct cache *, const char *, uint64_t,
+		struct cache_meta *);
+struct buffer		*cache_lookup_stale(struct cache *, const char *,
+		uint64_t, struct cache_meta *);
+bool			 cache_fill_begin(struct cache *, const char *);
+bool			 cache_fill_take(struct cache *, const char *);
+struct buffer		*cache_fill_wait(struct cache *, const char *,
+		uint64_t, struct cache_meta *);
+void			 cache_fill_end(struct cache *, const char *);
+bool			 cache_store(struct cache *, const char *,
+		const struct cache_meta *, struct buffer_list *);
+struct buffer		*cache_lookup_chunks(struct cache *, const char *,
+		uint64_t);
+bool			 cache_store_chunks(struct cache *, const char *,
+		const struct cache_meta *, struct buffer_list *);
+bool			 cache_negative_lookup(struct cache *, const char *,
+		uint64_t);
+void			 cache_negative_store(struct cache *, const char *,
+		uint64_t);
+
+#endif // __CACHE_H__
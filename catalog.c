@@ -0,0 +1,810 @@
+/*
+ * Copyright (c) 2018 Markus Hennecke <markus-hennecke@markus-hennecke.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The content catalog is written by cms-index and holds everything the
+ * navigation needs in a single read only mapping:
+ *
+ *	struct catalog_header
+ *	struct catalog_lang	[nlangs]	sorted by name
+ *	struct catalog_page	[npages]	grouped by language,
+ *						sorted by SORT
+ *	struct catalog_string	[nnames]	page names, sorted
+ *	uint64_t		[nnames][CATALOG_WORDS(nlangs)]
+ *						languages of each name
+ *	string pool				NUL terminated strings
+ *
+ * The texts of a page are taken from the header of its content if it has
+ * one, see pageheader.h.
+ *
+ * Languages and the content directory carry the mtime of their directory
+ * at the time the catalog was written. A mismatch means pages have been
+ * added or removed and the caller falls back to reading the directories.
+ * Every page carries the hash of the stat data of its files, which the
+ * caller compares with the files of the requested page. Every language
+ * carries a hash of its page entries, which stands for the navigation in
+ * an entity tag. Changes to the files of the other pages require running
+ * cms-index again, unless cms-watch does that.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "catalog.h"
+#include "filehelper.h"
+#include "helper.h"
+#include "pageheader.h"
+
+struct _pool {
+	char		*data;
+	size_t		 len;
+	size_t		 size;
+};
+
+struct _page {
+	const char		*name;
+	char			*sort;
+	size_t			 sortlen;
+	struct catalog_page	 page;
+};
+
+struct _name {
+	const char		*str;
+	struct catalog_string	 name;
+	size_t			 lang;
+};
+
+struct _lang {
+	char			*name;
+	struct _page		*pages;
+	size_t			 npages;
+	struct stat		 sb;
+};
+
+static void	_pool_add(struct _pool *, struct catalog_string *,
+		const char *, size_t);
+static uint64_t	_hash_str(uint64_t, const struct _pool *,
+		const struct catalog_string *);
+static char	*_read_file_at(int, const char *, size_t *);
+static bool	_add_file(struct _pool *, struct catalog_string *, int,
+		const char *, bool);
+static int	_name_cmp(const void *, const void *);
+static int	_page_name_cmp(const void *, const void *);
+static int	_names_cmp(const void *, const void *);
+static int	_page_cmp(const void *, const void *);
+static void	_page_files(int, struct catalog_page *);
+static bool	_read_page(struct _pool *, int, const char *, struct _page *);
+static bool	_read_lang(struct _pool *, int, struct _lang *);
+static bool	_write_all(int, const void *, size_t);
+static bool	_check(struct catalog *);
+
+
+struct catalog *
+catalog_open(const char *_filename)
+{
+	struct catalog *c = calloc(1, sizeof(struct catalog));
+	if (c == NULL)
+		err(1, NULL);
+
+	int fd = open(_filename, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			warn("%s", _filename);
+		free(c);
+		return NULL;
+	}
+	if (fstat(fd, &c->sb) == -1) {
+		warn("%s", _filename);
+		goto fail;
+	}
+	if ((size_t)c->sb.st_size < sizeof(struct catalog_header))
+		goto invalid;
+	c->size = c->sb.st_size;
+	c->map = mmap(NULL, c->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (c->map == MAP_FAILED) {
+		c->map = NULL;
+		warn("%s", _filename);
+		goto fail;
+	}
+	c->mapped = true;
+	close(fd);
+	fd = -1;
+
+	if (! _check(c))
+		goto invalid;
+	return c;
+
+invalid:
+	warnx("%s: invalid catalog", _filename);
+fail:
+	if (fd != -1)
+		close(fd);
+	catalog_close(c);
+	return NULL;
+}
+
+
+/*
+ * Uses a catalog embedded in another file, _map stays owned by the caller
+ * and _sb describes the file it is read from.
+ */
+struct catalog *
+catalog_open_mem(void *_map, size_t _size, const struct stat *_sb)
+{
+	struct catalog *c = calloc(1, sizeof(struct catalog));
+	if (c == NULL)
+		err(1, NULL);
+	c->map = _map;
+	c->size = _size;
+	c->sb = *_sb;
+	if (_size < sizeof(struct catalog_header) || ! _check(c)) {
+		free(c);
+		return NULL;
+	}
+	return c;
+}
+
+
+bool
+_check(struct catalog *_c)
+{
+	_c->header = _c->map;
+	if (_c->header->magic != CATALOG_MAGIC
+			|| _c->header->version != CATALOG_VERSION
+			|| _c->header->size != _c->size
+			|| _c->header->strings > _c->size)
+		return false;
+	size_t tables = sizeof(struct catalog_header)
+		+ (size_t)_c->header->nlangs * sizeof(struct catalog_lang)
+		+ (size_t)_c->header->npages * sizeof(struct catalog_page)
+		+ (size_t)_c->header->nnames * (sizeof(struct catalog_string)
+			+ CATALOG_WORDS(_c->header->nlangs) * sizeof(uint64_t));
+	if (tables > _c->header->strings)
+		return false;
+	_c->langs = (struct catalog_lang *)(_c->header + 1);
+	_c->pages = (struct catalog_page *)(_c->langs + _c->header->nlangs);
+	_c->names = (struct catalog_string *)(_c->pages + _c->header->npages);
+	_c->matrix = (uint64_t *)(_c->names + _c->header->nnames);
+	_c->strings = (const char *)_c->map + _c->header->strings;
+	return true;
+}
+
+
+void
+catalog_close(struct catalog *_c)
+{
+	if (_c) {
+		if (_c->mapped)
+			munmap(_c->map, _c->size);
+		free(_c);
+	}
+}
+
+
+const char *
+catalog_str(struct catalog *_c, const struct catalog_string *_s)
+{
+	size_t pool = _c->size - _c->header->strings;
+	if ((size_t)_s->off + _s->len >= pool)
+		return "";
+	return _c->strings + _s->off;
+}
+
+
+/*
+ * Checks whether the set of languages is unchanged since the catalog was
+ * written, _fd is the content directory.
+ */
+bool
+catalog_fresh(struct catalog *_c, int _fd)
+{
+	struct stat sb;
+
+	if (_c == NULL || fstat(_fd, &sb) == -1)
+		return false;
+	return (sb.st_mtim.tv_sec == _c->header->mtime
+			&& sb.st_mtim.tv_nsec == _c->header->mtime_nsec);
+}
+
+
+/*
+ * Checks whether no language and no page has been added or removed since
+ * the catalog was written, _fd is the content directory.
+ */
+bool
+catalog_langs_fresh(struct catalog *_c, int _fd)
+{
+	struct stat sb;
+
+	if (! catalog_fresh(_c, _fd))
+		return false;
+	for (uint32_t i = 0; i < _c->header->nlangs; i++) {
+		struct catalog_lang *l = &_c->langs[i];
+		if (fstatat(_fd, catalog_str(_c, &l->name), &sb, 0) == -1
+				|| sb.st_mtim.tv_sec != l->mtime
+				|| sb.st_mtim.tv_nsec != l->mtime_nsec)
+			return false;
+	}
+	return true;
+}
+
+
+/*
+ * Returns the bitmap of the languages a page exists in, bit n stands for
+ * the language langs[n].
+ */
+const uint64_t *
+catalog_page_langs(struct catalog *_c, const char *_page)
+{
+	uint32_t lo = 0, hi = _c->header->nnames;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(_page, catalog_str(_c, &_c->names[mid]));
+		if (cmp == 0)
+			return &_c->matrix[(size_t)mid
+				* CATALOG_WORDS(_c->header->nlangs)];
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return NULL;
+}
+
+
+struct catalog_lang *
+catalog_find_lang(struct catalog *_c, const char *_lang)
+{
+	if (_c == NULL)
+		return NULL;
+	for (uint32_t i = 0; i < _c->header->nlangs; i++) {
+		struct catalog_lang *l = &_c->langs[i];
+		if (strcmp(catalog_str(_c, &l->name), _lang) != 0)
+			continue;
+		if ((uint64_t)l->first + l->npages > _c->header->npages)
+			return NULL;
+		return l;
+	}
+	return NULL;
+}
+
+
+struct catalog_page *
+catalog_lang_pages(struct catalog *_c, struct catalog_lang *_l)
+{
+	return &_c->pages[_l->first];
+}
+
+
+void
+_pool_add(struct _pool *_p, struct catalog_string *_s, const char *_data,
+		size_t _len)
+{
+	if (_p->len + _len + 1 > UINT32_MAX)
+		errx(1, "catalog string pool too large");
+	if (_p->len + _len + 1 > _p->size) {
+		size_t size = (_p->size) ? _p->size : 4096;
+		while (size < _p->len + _len + 1)
+			size *= 2;
+		char *data = realloc(_p->data, size);
+		if (data == NULL)
+			err(1, NULL);
+		_p->data = data;
+		_p->size = size;
+	}
+	memcpy(_p->data + _p->len, _data, _len);
+	_p->data[_p->len + _len] = '\0';
+	_s->off = _p->len;
+	_s->len = _len;
+	_p->len += _len + 1;
+}
+
+
+uint64_t
+_hash_str(uint64_t _hash, const struct _pool *_p,
+		const struct catalog_string *_s)
+{
+	_hash = hash_fnv1a(_hash, &_s->len, sizeof(_s->len));
+	return hash_fnv1a(_hash, _p->data + _s->off, _s->len);
+}
+
+
+char *
+_read_file_at(int _fd, const char *_name, size_t *_size)
+{
+	struct stat sb;
+	char *data = NULL;
+
+	int fd = openat(_fd, _name, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, &sb) == -1 || ! S_ISREG(sb.st_mode))
+		goto done;
+	if ((data = malloc(sb.st_size + 1)) == NULL)
+		err(1, NULL);
+	ssize_t n = 0;
+	size_t len = 0;
+	while (len < (size_t)sb.st_size
+			&& (n = read(fd, data + len, sb.st_size - len)) > 0)
+		len += n;
+	if (n == -1) {
+		warn("%s", _name);
+		free(data);
+		data = NULL;
+		goto done;
+	}
+	data[len] = '\0';
+	*_size = len;
+done:
+	close(fd);
+	return data;
+}
+
+
+bool
+_add_file(struct _pool *_p, struct catalog_string *_s, int _fd,
+		const char *_name, bool _chomp)
+{
+	size_t size;
+	char *data = _read_file_at(_fd, _name, &size);
+	if (data == NULL)
+		return false;
+	if (_chomp)
+		while (size > 0 && isspace((unsigned char)data[size - 1]))
+			size--;
+	_pool_add(_p, _s, data, size);
+	free(data);
+	return true;
+}
+
+
+int
+_name_cmp(const void *_a, const void *_b)
+{
+	const struct _lang *a = _a, *b = _b;
+	return strcmp(a->name, b->name);
+}
+
+
+int
+_page_name_cmp(const void *_a, const void *_b)
+{
+	const struct _page *a = _a, *b = _b;
+	return strcmp(a->name, b->name);
+}
+
+
+int
+_names_cmp(const void *_a, const void *_b)
+{
+	const struct _name *a = _a, *b = _b;
+	int result = strcmp(a->str, b->str);
+	if (result == 0)
+		result = (a->lang > b->lang) - (a->lang < b->lang);
+	return result;
+}
+
+
+/*
+ * Same order as the navigation built from the directories, entries with
+ * an equal SORT value are ordered by name.
+ */
+int
+_page_cmp(const void *_a, const void *_b)
+{
+	const struct _page *a = _a, *b = _b;
+	size_t alen = a->page.sort.len, blen = b->page.sort.len;
+	// A page without SORT has no string to compare
+	int result = (alen && blen)
+		? strncmp(a->sort, b->sort, (alen <= blen) ? alen : blen) : 0;
+	if (result == 0)
+		result = (alen > blen) - (alen < blen);
+	if (result == 0)
+		result = (int)a->page.reserved - (int)b->page.reserved;
+	return result;
+}
+
+
+bool
+_read_page(struct _pool *_p, int _fd, const char *_name, struct _page *_page)
+{
+	struct page_header h;
+	struct stat sb;
+	char buf[PAGE_HEADER_MAX];
+
+	int fd = openat(_fd, _name, O_DIRECTORY | O_RDONLY);
+	if (fd == -1) {
+		warn("%s", _name);
+		return false;
+	}
+	memset(_page, 0, sizeof(*_page));
+	struct catalog_page *cp = &_page->page;
+	_pool_add(_p, &cp->name, _name, strlen(_name));
+	// A page without LINK may have a header, its fields take the place
+	// of their files
+	memset(&h, 0, sizeof(h));
+	bool nav = _add_file(_p, &cp->link, fd, "LINK", true);
+	if (! nav && page_header_read_at(fd, &h, buf, sizeof(buf))
+			&& h.value[PAGE_HEADER_LINK]) {
+		_pool_add(_p, &cp->link, h.value[PAGE_HEADER_LINK],
+				h.len[PAGE_HEADER_LINK]);
+		nav = true;
+	}
+	if (h.value[PAGE_HEADER_TITLE])
+		_pool_add(_p, &cp->title, h.value[PAGE_HEADER_TITLE],
+				h.len[PAGE_HEADER_TITLE]);
+	else
+		_add_file(_p, &cp->title, fd, "TITLE", true);
+	if (h.value[PAGE_HEADER_SORT]) {
+		_page->sortlen = h.len[PAGE_HEADER_SORT];
+		if ((_page->sort = strndup(h.value[PAGE_HEADER_SORT],
+						_page->sortlen)) == NULL)
+			err(1, NULL);
+	} else
+		_page->sort = _read_file_at(fd, "SORT", &_page->sortlen);
+	if (_page->sort) {
+		size_t len = _page->sortlen;
+		while (len > 0 && isspace((unsigned char)_page->sort[len - 1]))
+			len--;
+		_pool_add(_p, &cp->sort, _page->sort, len);
+	} else
+		nav = false;
+	if (h.value[PAGE_HEADER_DESCR]) {
+		_pool_add(_p, &cp->descr, h.value[PAGE_HEADER_DESCR],
+				h.len[PAGE_HEADER_DESCR]);
+	} else if (fstatat(fd, "DESCR", &sb, 0) != -1) {
+		nav &= _add_file(_p, &cp->descr, fd, "DESCR", false);
+	} else if (fstatat(fd, "DESCR.md", &sb, 0) != -1) {
+		nav &= _add_file(_p, &cp->descr, fd, "DESCR.md", false);
+		cp->flags |= CATALOG_DESCR_MD;
+	} else
+		nav = false;
+	if (nav)
+		cp->flags |= CATALOG_NAV;
+	if ((h.flags & PAGE_HEADER_SUB) || (fstatat(fd, "SUB", &sb, 0) != -1
+				&& (sb.st_mode & S_IFREG)))
+		cp->flags |= CATALOG_SUB;
+	if ((h.flags & PAGE_HEADER_SSL) || (fstatat(fd, "SSL", &sb, 0) != -1
+				&& (sb.st_mode & S_IFREG)))
+		cp->flags |= CATALOG_SSL;
+	if (fstatat(fd, "LOGIN", &sb, 0) != -1)
+		cp->flags |= CATALOG_LOGIN;
+	_page_files(fd, cp);
+
+	close(fd);
+	return true;
+}
+
+
+/*
+ * Records the newest file of the page directory _fd and the hash of the
+ * stat data of all files, the same way the requested page is validated.
+ */
+void
+_page_files(int _fd, struct catalog_page *_cp)
+{
+	struct dirent *dirent;
+	struct stat sb;
+
+	int dfd = dir_reopen(_fd);
+	DIR *dir = (dfd == -1) ? NULL : fdopendir(dfd);
+	if (dir == NULL) {
+		if (dfd != -1)
+			close(dfd);
+		return;
+	}
+	while ((dirent = readdir(dir)) != NULL) {
+		if (dirent->d_name[0] == '.'
+				|| fstatat(_fd, dirent->d_name, &sb, 0) == -1)
+			continue;
+		_cp->files += hash_stat(dirent->d_name, &sb);
+		if (sb.st_mtim.tv_sec > _cp->mtime)
+			_cp->mtime = sb.st_mtim.tv_sec;
+	}
+	closedir(dir);
+}
+
+
+bool
+_read_lang(struct _pool *_p, int _fd, struct _lang *_lang)
+{
+	struct dirent *dirent;
+	struct stat sb;
+	size_t size = 0;
+
+	int fd = openat(_fd, _lang->name, O_DIRECTORY | O_RDONLY);
+	if (fd == -1) {
+		warn("%s", _lang->name);
+		return false;
+	}
+	if (fstat(fd, &_lang->sb) == -1)
+		err(1, "%s", _lang->name);
+	int dfd = dir_reopen(fd);
+	DIR *dir = (dfd == -1) ? NULL : fdopendir(dfd);
+	if (dir == NULL) {
+		warn("%s", _lang->name);
+		close(fd);
+		return false;
+	}
+	while ((dirent = readdir(dir)) != NULL) {
+		if (dirent->d_name[0] == '.')
+			continue;
+		if (fstatat(fd, dirent->d_name, &sb, 0) == -1
+				|| ! S_ISDIR(sb.st_mode))
+			continue;
+		if (_lang->npages == size) {
+			size = (size) ? size * 2 : 64;
+			struct _page *pages = reallocarray(_lang->pages, size,
+					sizeof(struct _page));
+			if (pages == NULL)
+				err(1, NULL);
+			_lang->pages = pages;
+		}
+		struct _page *page = &_lang->pages[_lang->npages];
+		if (_read_page(_p, fd, dirent->d_name, page))
+			_lang->npages++;
+	}
+	closedir(dir);
+	close(fd);
+
+	if (_lang->npages == 0)
+		return true;
+	// Rank the names for a stable order of equal SORT values
+	for (size_t i = 0; i < _lang->npages; i++)
+		_lang->pages[i].name = _p->data
+			+ _lang->pages[i].page.name.off;
+	qsort(_lang->pages, _lang->npages, sizeof(struct _page),
+			_page_name_cmp);
+	for (size_t i = 0; i < _lang->npages; i++)
+		_lang->pages[i].page.reserved = i;
+	qsort(_lang->pages, _lang->npages, sizeof(struct _page), _page_cmp);
+	return true;
+}
+
+
+bool
+_write_all(int _fd, const void *_data, size_t _size)
+{
+	const char *p = _data;
+	while (_size > 0) {
+		ssize_t n = write(_fd, p, _size);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += n;
+		_size -= n;
+	}
+	return true;
+}
+
+
+/*
+ * Reads the content directory and atomically replaces the catalog file.
+ */
+bool
+catalog_write(const char *_content_dir, const char *_filename)
+{
+	char tmpname[PATH_MAX];
+	bool result = false;
+
+	int cfd = open(_content_dir, O_DIRECTORY | O_RDONLY);
+	if (cfd == -1) {
+		warn("%s", _content_dir);
+		return false;
+	}
+	if ((size_t)snprintf(tmpname, sizeof(tmpname), "%s.XXXXXXXXXX",
+				_filename) >= sizeof(tmpname)) {
+		warnx("%s: name too long", _filename);
+		close(cfd);
+		return false;
+	}
+	int fd = mkstemp(tmpname);
+	if (fd == -1) {
+		warn("%s", tmpname);
+		close(cfd);
+		return false;
+	}
+	if (catalog_write_fd(cfd, fd)) {
+		if (fchmod(fd, 0644) == -1 || fsync(fd) == -1
+				|| rename(tmpname, _filename) == -1)
+			warn("%s", tmpname);
+		else
+			result = true;
+	}
+	if (! result)
+		unlink(tmpname);
+	close(fd);
+	close(cfd);
+	return result;
+}
+
+
+/*
+ * Writes the catalog of the content directory _cfd at the current offset
+ * of _fd, all offsets in the catalog are relative to its start.
+ */
+bool
+catalog_write_fd(int _cfd, int _fd)
+{
+	struct catalog_header header;
+	struct _pool pool = { NULL, 0, 0 };
+	struct _lang *langs = NULL;
+	struct _name *all = NULL;
+	struct catalog_string *names = NULL;
+	uint64_t *matrix = NULL;
+	struct dirent *dirent;
+	struct stat sb;
+	size_t nlangs = 0, size = 0, npages = 0, nnames = 0;
+	bool result = false;
+
+	if (fstat(_cfd, &sb) == -1) {
+		warn("fstat");
+		return false;
+	}
+	memset(&header, 0, sizeof(header));
+	header.magic = CATALOG_MAGIC;
+	header.version = CATALOG_VERSION;
+	header.mtime = sb.st_mtim.tv_sec;
+	header.mtime_nsec = sb.st_mtim.tv_nsec;
+
+	int dfd = dir_reopen(_cfd);
+	DIR *dir = (dfd == -1) ? NULL : fdopendir(dfd);
+	if (dir == NULL) {
+		warn("opendir");
+		if (dfd != -1)
+			close(dfd);
+		return false;
+	}
+	while ((dirent = readdir(dir)) != NULL) {
+		if (dirent->d_name[0] == '.')
+			continue;
+		if (fstatat(_cfd, dirent->d_name, &sb, 0) == -1
+				|| ! S_ISDIR(sb.st_mode))
+			continue;
+		if (nlangs == size) {
+			size = (size) ? size * 2 : 8;
+			struct _lang *l = reallocarray(langs, size,
+					sizeof(struct _lang));
+			if (l == NULL)
+				err(1, NULL);
+			langs = l;
+		}
+		memset(&langs[nlangs], 0, sizeof(struct _lang));
+		if ((langs[nlangs].name = strdup(dirent->d_name)) == NULL)
+			err(1, NULL);
+		nlangs++;
+	}
+	closedir(dir);
+	qsort(langs, nlangs, sizeof(struct _lang), _name_cmp);
+
+	struct catalog_lang *cl = calloc(nlangs, sizeof(struct catalog_lang));
+	if (nlangs && cl == NULL)
+		err(1, NULL);
+	for (size_t i = 0; i < nlangs; i++) {
+		if (! _read_lang(&pool, _cfd, &langs[i]))
+			goto done;
+		_pool_add(&pool, &cl[i].name, langs[i].name,
+				strlen(langs[i].name));
+		cl[i].first = npages;
+		cl[i].npages = langs[i].npages;
+		cl[i].mtime = langs[i].sb.st_mtim.tv_sec;
+		cl[i].mtime_nsec = langs[i].sb.st_mtim.tv_nsec;
+		npages += langs[i].npages;
+	}
+
+	// The pool does not move any more
+	header.langs = HASH_FNV1A_INIT;
+	for (size_t i = 0; i < nlangs; i++) {
+		header.langs = hash_fnv1a(header.langs, langs[i].name,
+				strlen(langs[i].name) + 1);
+		cl[i].nav = HASH_FNV1A_INIT;
+		for (size_t j = 0; j < langs[i].npages; j++) {
+			struct catalog_page *cp = &langs[i].pages[j].page;
+			cl[i].nav = _hash_str(cl[i].nav, &pool, &cp->name);
+			cl[i].nav = _hash_str(cl[i].nav, &pool, &cp->link);
+			cl[i].nav = _hash_str(cl[i].nav, &pool, &cp->sort);
+			cl[i].nav = _hash_str(cl[i].nav, &pool, &cp->title);
+			cl[i].nav = _hash_str(cl[i].nav, &pool, &cp->descr);
+			cl[i].nav = hash_fnv1a(cl[i].nav, &cp->flags,
+					sizeof(cp->flags));
+			if (cp->mtime > cl[i].changed)
+				cl[i].changed = cp->mtime;
+		}
+	}
+	size_t words = CATALOG_WORDS(nlangs);
+	all = calloc(npages ? npages : 1, sizeof(struct _name));
+	names = calloc(npages ? npages : 1, sizeof(struct catalog_string));
+	matrix = calloc(npages ? npages * words : 1, sizeof(uint64_t));
+	if (all == NULL || names == NULL || matrix == NULL)
+		err(1, NULL);
+	for (size_t i = 0, k = 0; i < nlangs; i++)
+		for (size_t j = 0; j < langs[i].npages; j++, k++) {
+			all[k].name = langs[i].pages[j].page.name;
+			all[k].str = pool.data + all[k].name.off;
+			all[k].lang = i;
+		}
+	qsort(all, npages, sizeof(struct _name), _names_cmp);
+	for (size_t k = 0; k < npages; k++) {
+		if (k == 0 || strcmp(all[k].str, all[k - 1].str) != 0)
+			names[nnames++] = all[k].name;
+		matrix[(nnames - 1) * words + all[k].lang / 64]
+			|= 1ULL << (all[k].lang % 64);
+	}
+
+	size_t strings = sizeof(header) + nlangs * sizeof(struct catalog_lang)
+		+ npages * sizeof(struct catalog_page)
+		+ nnames * (sizeof(struct catalog_string)
+			+ words * sizeof(uint64_t));
+	if (strings + pool.len > UINT32_MAX) {
+		warnx("catalog too large");
+		goto done;
+	}
+	header.nlangs = nlangs;
+	header.npages = npages;
+	header.nnames = nnames;
+	header.strings = strings;
+	header.size = strings + pool.len;
+
+	if (! _write_all(_fd, &header, sizeof(header))
+			|| ! _write_all(_fd, cl,
+				nlangs * sizeof(struct catalog_lang)))
+		goto write_error;
+	for (size_t i = 0; i < nlangs; i++)
+		for (size_t j = 0; j < langs[i].npages; j++) {
+			langs[i].pages[j].page.reserved = 0;
+			if (! _write_all(_fd, &langs[i].pages[j].page,
+						sizeof(struct catalog_page)))
+				goto write_error;
+		}
+	if (! _write_all(_fd, names, nnames * sizeof(struct catalog_string))
+			|| ! _write_all(_fd, matrix,
+				nnames * words * sizeof(uint64_t))
+			|| ! _write_all(_fd, pool.data, pool.len))
+		goto write_error;
+	result = true;
+	goto done;
+
+write_error:
+	warn("write");
+done:
+	for (size_t i = 0; i < nlangs; i++) {
+		for (size_t j = 0; j < langs[i].npages; j++)
+			free(langs[i].pages[j].sort);
+		free(langs[i].pages);
+		free(langs[i].name);
+	}
+	free(langs);
+	free(all);
+	free(names);
+	free(matrix);
+	free(cl);
+	free(pool.data);
+	return result;
+}
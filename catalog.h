@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2018 Markus Hennecke <markus-hennecke@markus-hennecke.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __CATALOG_H__
+#define __CATALOG_H__
+
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CATALOG_MAGIC		0x49534d43	// "CMSI"
+#define CATALOG_VERSION		3
+
+// Page flags
+#define CATALOG_NAV		0x01	// LINK, SORT and DESCR exist
+#define CATALOG_SUB		0x02
+#define CATALOG_SSL		0x04
+#define CATALOG_LOGIN		0x08
+#define CATALOG_DESCR_MD	0x10
+
+struct catalog_string {
+	uint32_t	off;
+	uint32_t	len;
+};
+
+struct catalog_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	size;
+	uint32_t	nlangs;
+	uint32_t	npages;
+	uint32_t	strings;
+	uint32_t	nnames;
+	uint32_t	reserved;
+	int64_t		mtime;
+	int64_t		mtime_nsec;
+	uint64_t	langs;		// hash of the language names
+};
+
+struct catalog_lang {
+	struct catalog_string	name;
+	uint32_t		first;
+	uint32_t		npages;
+	int64_t			mtime;
+	int64_t			mtime_nsec;
+	uint64_t		nav;		// hash of the page entries
+	int64_t			changed;	// newest page file
+};
+
+// Pages of a language are sorted by their SORT file
+struct catalog_page {
+	struct catalog_string	name;
+	struct catalog_string	link;
+	struct catalog_string	sort;
+	struct catalog_string	title;
+	struct catalog_string	descr;
+	uint32_t		flags;
+	uint32_t		reserved;
+	int64_t			mtime;		// newest file
+	uint64_t		files;		// sum of hash_stat() of the files
+};
+
+/*
+ * The page names of all languages are sorted and unique, for each one
+ * the matrix holds a bitmap of the languages it exists in.
+ */
+#define CATALOG_WORDS(nlangs)	(((nlangs) + 63) / 64)
+
+struct catalog {
+	void			*map;
+	bool			 mapped;
+	size_t			 size;
+	struct stat		 sb;
+	struct catalog_header	*header;
+	struct catalog_lang	*langs;
+	struct catalog_page	*pages;
+	struct catalog_string	*names;
+	uint64_t		*matrix;
+	const char		*strings;
+};
+
+struct catalog		*catalog_open(const char *);
+struct catalog		*catalog_open_mem(void *, size_t, const struct stat *);
+void			 catalog_close(struct catalog *);
+const char		*catalog_str(struct catalog *,
+		const struct catalog_string *);
+bool			 catalog_fresh(struct catalog *, int);
+bool			 catalog_langs_fresh(struct catalog *, int);
+struct catalog_lang	*catalog_find_lang(struct catalog *, const char *);
+struct catalog_page	*catalog_lang_pages(struct catalog *,
+		struct catalog_lang *);
+const uint64_t		*catalog_page_langs(struct catalog *, const char *);
+bool			 catalog_write(const char *, const char *);
+bool			 catalog_write_fd(int, int);
+
+#endif // __CATALOG_H__
@@ -17,13 +17,18 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "buffer.h"
+#include "cache.h"
+#include "encoding.h"
 #include "filehelper.h"
 #include "handler.h"
 #include "template.h"
@@ -37,44 +42,228 @@
 #ifndef CMS_SESSION_DIR
 #error "Need CMS_SESSION_Dir defined to compile"
 #endif
+#ifndef CMS_CACHE_FILE
+#error "Need CMS_CACHE_FILE defined to compile"
+#endif
+#ifndef CMS_CATALOG_FILE
+#error "Need CMS_CATALOG_FILE defined to compile"
+#endif
+#ifndef CMS_GENERATION_FILE
+#error "Need CMS_GENERATION_FILE defined to compile"
+#endif
+#ifndef CMS_MD_CACHE_DIR
+#error "Need CMS_MD_CACHE_DIR defined to compile"
+#endif
+#ifndef CMS_PACK_FILE
+#error "Need CMS_PACK_FILE defined to compile"
+#endif
+#ifndef CMS_CACHE_SLOTS
+#define CMS_CACHE_SLOTS		0
+#endif
+#ifndef CMS_CACHE_SLOT_SIZE
+#define CMS_CACHE_SLOT_SIZE	0
+#endif
+#ifndef CMS_CACHE_STALE
+#define CMS_CACHE_STALE		0
+#endif
+
+#define CMS_PAGE_TYPE		"application/xhtml+xml"
 
 char *cms_content_dir  = CMS_CONTENT_DIR;
 char *cms_template_dir = CMS_TEMPLATE_DIR;
 char *cms_session_db  = CMS_SESSION_DIR "/session.db";
 char *cms_session_htpasswd = CMS_SESSION_DIR "/htpasswd";
+char *cms_cache_file = CMS_CACHE_FILE;
+char *cms_catalog_file = CMS_CATALOG_FILE;
+char *cms_generation_file = CMS_GENERATION_FILE;
+char *cms_md_cache_dir = CMS_MD_CACHE_DIR;
+char *cms_pack_file = CMS_PACK_FILE;
 
 static __dead void	usage(void);
+static __dead void	cache_stats(void);
+static __dead void	not_found(struct cache *, const char *, uint64_t);
+static void		cache_output(struct request *, struct buffer_list *,
+		const struct cache_meta *);
+static struct buffer_list *cache_body(struct request *, struct cache *,
+		const char *, const struct cache_meta *, struct buffer *);
+static void		cache_revalidate(struct request *, struct cache *,
+		const char *, const struct cache_meta *);
 
 __dead void
 usage(void)
 {
 	extern char *__progname;
 
-	dprintf(STDERR_FILENO, "usage: %s URI\n", __progname);
+	dprintf(STDERR_FILENO, "usage: %s [-s] [URI]\n", __progname);
 	exit(1);
 }
 
 
+__dead void
+cache_stats(void)
+{
+	struct cache *cache = cache_open(cms_cache_file, CMS_CACHE_SLOTS,
+			CMS_CACHE_SLOT_SIZE);
+	if (cache == NULL)
+		errx(1, "render cache disabled or unavailable");
+
+	// Only the navigation rows are stored in chunks
+	dprintf(STDOUT_FILENO, "hits: %llu\nmisses: %llu\ncoalesced: %llu\n"
+			"stale: %llu\nnav hits: %llu\nnav misses: %llu\n",
+			(unsigned long long)cache->header->hits,
+			(unsigned long long)cache->header->misses,
+			(unsigned long long)cache->header->coalesced,
+			(unsigned long long)cache->header->stale,
+			(unsigned long long)cache->header->chunk_hits,
+			(unsigned long long)cache->header->chunk_misses);
+	cache_close(cache);
+	exit(0);
+}
+
+
+/*
+ * Answers with 404. Only a page that does not exist is remembered in the
+ * negative cache, any other error may be gone with the next request.
+ */
+__dead void
+not_found(struct cache *_cache, const char *_key, uint64_t _validator)
+{
+	if (_cache && (errno == ENOENT || errno == ENOTDIR))
+		cache_negative_store(_cache, _key, _validator);
+	_error("404 Not Found", NULL);
+}
+
+
+/*
+ * Sends a body in the coding of the request with the content type it was
+ * stored with.
+ */
+void
+cache_output(struct request *_r, struct buffer_list *_body,
+		const struct cache_meta *_meta)
+{
+	request_add_encoding_header(_r);
+	request_add_header(_r, "Content-type", _meta->type);
+	request_add_header(_r, "Status", "200 Ok");
+	request_output(_r, _body);
+	free(_body);
+}
+
+
+/*
+ * Returns the cached page _b as body in the coding of the request. The
+ * compressed variant is stored under _variant_key for the next hit, a
+ * NULL key does not store it.
+ */
+struct buffer_list *
+cache_body(struct request *_r, struct cache *_cache, const char *_variant_key,
+		const struct cache_meta *_meta, struct buffer *_b)
+{
+	struct buffer_list *body = buffer_list_new();
+	buffer_list_add_buffer(body, _b);
+	if (_r->encoding == ENCODING_IDENTITY)
+		return body;
+
+	struct buffer_list *encoded = encoder_list(_r->encoding, body);
+	buffer_list_free(body);
+	free(body);
+	if (_variant_key)
+		cache_store(_cache, _variant_key, _meta, encoded);
+	return encoded;
+}
+
+
+/*
+ * Renders the page in a detached child process and replaces the stale
+ * cache entry. Only one process revalidates a page at a time, no child
+ * is forked while another process fills the entry.
+ */
+void
+cache_revalidate(struct request *_r, struct cache *_cache, const char *_key,
+		const struct cache_meta *_meta)
+{
+	if (! cache_fill_begin(_cache, _key))
+		return;
+	pid_t pid = fork();
+	if (pid == -1)
+		warn("fork");
+	// fcntl(2) locks are not inherited, the child takes the lock over
+	if (pid != 0) {
+		cache_fill_end(_cache, _key);
+		return;
+	}
+
+	// The CGI server waits until our output descriptors are closed
+	close(STDIN_FILENO);
+	close(STDOUT_FILENO);
+	close(STDERR_FILENO);
+	setsid();
+	if (! cache_fill_take(_cache, _key))
+		_exit(0);
+
+	// The client's conditional headers must not end the revalidation
+	unsetenv("HTTP_IF_MODIFIED_SINCE");
+	struct page_info *page = request_fetch_page(_r);
+	if (page && ! page_info_has(page, PAGE_LOGIN)) {
+		request_init_tmpl_data(_r);
+		struct buffer_list *out = request_render_page(_r,
+				CMS_DEFAULT_TEMPLATE, false);
+		cache_store(_cache, _key, _meta, out);
+		buffer_list_free(out);
+	}
+	cache_fill_end(_cache, _key);
+	_exit(0);
+}
+
+
 int
 main(int argc, char **argv)
 {
-	char *result = "";
-	struct buffer_list *hb, *out;
+	struct buffer_list *out;
 	struct request *r;
+	struct cache *cache = NULL;
+	char *cache_key = NULL;
+	char *variant_key = NULL;
+	uint64_t negative = 0;
+	bool sflag = false;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "s")) != -1) {
+		switch (ch) {
+		case 's':
+			sflag = true;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
 
-	if (argc > 2)
+	if (argc > 1 || (sflag && argc > 0))
 		usage();
-	if (argc >= 2) {
+	if (argc >= 1 || sflag) {
 		cms_content_dir  = CMS_CHROOT CMS_CONTENT_DIR;
 		cms_template_dir = CMS_CHROOT CMS_TEMPLATE_DIR;
 		cms_session_db  = CMS_CHROOT CMS_SESSION_DIR "/session.db";
 		cms_session_htpasswd = CMS_CHROOT CMS_SESSION_DIR "/htpasswd";
-		if (argv[1][0] != '/')
+		cms_cache_file = CMS_CHROOT CMS_CACHE_FILE;
+		cms_catalog_file = CMS_CHROOT CMS_CATALOG_FILE;
+		cms_generation_file = CMS_CHROOT CMS_GENERATION_FILE;
+		cms_md_cache_dir = CMS_CHROOT CMS_MD_CACHE_DIR;
+		cms_pack_file = CMS_CHROOT CMS_PACK_FILE;
+	}
+	if (sflag)
+		cache_stats();
+	if (argc >= 1) {
+		if (argv[0][0] != '/')
 			errx(1, "Require absolute path as argument");
 		// XXX Substitude PATH_INFO env variable
-		setenv("PATH_INFO", argv[1], 1);
+		setenv("PATH_INFO", argv[0], 1);
 	}
 
+	md_cache_open(cms_md_cache_dir);
+
 	char *path_info = getenv("PATH_INFO");
 	if (path_info == NULL || strlen(path_info) == 0
 			|| strcmp(path_info, "index.html") == 0
@@ -83,6 +272,86 @@ main(int argc, char **argv)
 	r = request_new(path_info);
 	if (r == NULL)
 		_error("404 Not Found", NULL);
+	request_negotiate_encoding(r);
+
+	// Only GET and HEAD requests are answered from the render cache,
+	// HEAD takes the same path and request_output() drops the body
+	if (r->request_method == GET || r->request_method == HEAD)
+		cache = cache_open(cms_cache_file, CMS_CACHE_SLOTS,
+				CMS_CACHE_SLOT_SIZE);
+	if (cache) {
+		// Also used for the navigation rows of login pages
+		r->cache = cache;
+		cache_key = request_cache_key(r);
+		// Compressed variants are stored next to the page
+		if (r->encoding != ENCODING_IDENTITY
+				&& asprintf(&variant_key, "%s;%s", cache_key,
+					encoding_name(r->encoding)) == -1)
+			err(1, NULL);
+		negative = request_negative_validator(r);
+		if (cache_negative_lookup(cache, cache_key, negative))
+			_error("404 Not Found", NULL);
+	}
+	if (! request_open(r))
+		not_found(cache, cache_key, negative);
+
+	// A POST is always answered by rendering the page, it needs no
+	// validator
+	struct page_validator pv;
+	struct cache_meta meta, hit;
+	memset(&pv, 0, sizeof(pv));
+	if (r->request_method != POST) {
+		if (! request_validate(r, CMS_DEFAULT_TEMPLATE, &pv))
+			not_found(cache, cache_key, negative);
+		request_check_modified(r, &pv);
+	}
+	memset(&meta, 0, sizeof(meta));
+	meta.validator = pv.etag;
+	meta.access = pv.access;
+	meta.modified = pv.newest;
+	strlcpy(meta.type, CMS_PAGE_TYPE, sizeof(meta.type));
+
+	// Pages behind a login depend on the session, never share them
+	if (cache && ! pv.login) {
+		struct buffer *b;
+		if (variant_key
+				&& (b = cache_lookup(cache, variant_key,
+						pv.etag, &hit))) {
+			struct buffer_list *body = buffer_list_new();
+			buffer_list_add_buffer(body, b);
+			request_add_validator_headers(r, &pv);
+			cache_output(r, body, &hit);
+			return 0;
+		}
+		b = cache_lookup(cache, cache_key, pv.etag, &hit);
+		// Serve a recently outdated copy without delay and render
+		// the new one after the response is sent. The copy is sent
+		// with its own validators and only if the page is protected
+		// the same way as when it was stored.
+		if (b == NULL && CMS_CACHE_STALE > 0
+				&& time(NULL) - pv.changed <= CMS_CACHE_STALE
+				&& (b = cache_lookup_stale(cache, cache_key,
+						pv.access, &hit)) != NULL) {
+			struct page_validator stale = pv;
+			stale.etag = hit.validator;
+			stale.newest = hit.modified;
+			request_add_validator_headers(r, &stale);
+			cache_output(r, cache_body(r, cache, NULL, &hit, b),
+					&hit);
+			cache_revalidate(r, cache, cache_key, &meta);
+			return 0;
+		}
+		// Let a single process render a missing page and have the
+		// others wait for its result
+		if (b == NULL && ! cache_fill_begin(cache, cache_key))
+			b = cache_fill_wait(cache, cache_key, pv.etag, &hit);
+		if (b) {
+			request_add_validator_headers(r, &pv);
+			cache_output(r, cache_body(r, cache, variant_key,
+						&hit, b), &hit);
+			return 0;
+		}
+	}
 
 	struct page_info *page = request_fetch_page(r);
 	if (page == NULL)
@@ -90,17 +359,37 @@ main(int argc, char **argv)
 
 	request_init_tmpl_data(r);
 	request_handle_login(r);
-	out = request_render_page(r, CMS_DEFAULT_TEMPLATE);
-	result = buffer_list_concat_string(out);
-	request_add_header(r, "Content-type", "application/xhtml+xml");
-	request_add_header(r, "Status", "200 Ok");
-
-	hb = request_output_headers(r);
-	char *header = buffer_list_concat_string(hb);
-	dprintf(STDOUT_FILENO, "%s\r\n%s", header, result);
+	if (r->request_method != POST)
+		request_add_validator_headers(r, &pv);
+	bool store = (cache && ! pv.login);
+	if (store || r->request_method == HEAD) {
+		// Store the page before it is sent, a slow client must not
+		// hold up the processes waiting for it. HEAD needs the
+		// length of the body it does not send.
+		out = request_render_page(r, CMS_DEFAULT_TEMPLATE, false);
+		if (store)
+			cache_store(cache, cache_key, &meta, out);
+		struct buffer_list *body = encoder_list(r->encoding, out);
+		if (store && body && variant_key)
+			cache_store(cache, variant_key, &meta, body);
+		if (store)
+			cache_fill_end(cache, cache_key);
+		if (body == NULL) {
+			body = out;
+			out = NULL;
+		}
+		cache_output(r, body, &meta);
+	} else {
+		// The page is sent while it is rendered
+		request_add_header(r, "Content-type", meta.type);
+		request_add_header(r, "Status", "200 Ok");
+		out = request_render_page(r, CMS_DEFAULT_TEMPLATE, true);
+	}
 
+	cache_close(cache);
+	free(cache_key);
+	free(variant_key);
 	request_free(r);
-	buffer_list_free(hb);
 	buffer_list_free(out);
 	return 0;
 }
@@ -6,6 +6,7 @@ CMS_HTROOT?=		/var/www/htdocs
 CONTENT_DIR=		${ROOT_DIR}/content
 TEMPLATE_DIR=		${ROOT_DIR}/templates
 SESSION_DIR=		${ROOT_DIR}/session
+CACHE_DIR=		${ROOT_DIR}/cache
 CMS_DEFAULT_LANGUAGE?=	en
 CMS_DEFAULT_TEMPLATE?=	page.tmpl
 CMS_CONFIG_URL_IMAGES?=	/images/
@@ -16,6 +17,25 @@ CHROOT?=		/var/www
 WWW_USER?=		www
 WWW_GROUP?=		www
 
+# Shared render cache, set CMS_CACHE_SLOTS to 0 to disable it.
+# The cache file takes about CMS_CACHE_SLOTS * CMS_CACHE_SLOT_SIZE bytes,
+# pages larger than a slot are not cached.
+CMS_CACHE_SLOTS?=	1024
+CMS_CACHE_SLOT_SIZE?=	65536
+# Seconds after a content change in which the outdated cached page is
+# still served while a new one is rendered in the background, 0 disables.
+CMS_CACHE_STALE?=	60
+# Pages are sent compressed to clients accepting gzip, level 1 to 9 or 0
+# to disable it. Set CMS_ZSTD to yes to also offer zstd, which needs the
+# zstd package.
+CMS_GZIP_LEVEL?=	6
+CMS_ZSTD?=		no
+CMS_ZSTD_LEVEL?=	3
+
+# The installed lowdown version is part of the name of converted
+# markdown files in the cache, an update does not reuse them.
+LOWDOWN_VERSION!=	pkg_info -e 'lowdown-*' 2>/dev/null || true
+
 # Absolute path from within the chroot
 ROOT_DIR=		${CMS_ROOT_DIR:S/^${CHROOT}//}
 
@@ -39,5 +59,21 @@ CFLAGS+=		-DCMS_HOSTNAME=\"${CMS_HOSTNAME}\" \
 			-DCMS_DEFAULT_TEMPLATE=\"${CMS_DEFAULT_TEMPLATE}\" \
 			-DCMS_CONFIG_URL_IMAGES=\"${CMS_CONFIG_URL_IMAGES}\" \
 			-DCMS_ROOT_URL=\"${CMS_ROOT_URL}\" \
-			-DCMS_CHROOT=\"${CHROOT}\"
+			-DCMS_CHROOT=\"${CHROOT}\" \
+			-DCMS_CACHE_DIR=\"${CACHE_DIR}\" \
+			-DCMS_CACHE_FILE=\"${CACHE_DIR}/render.cache\" \
+			-DCMS_CATALOG_FILE=\"${CACHE_DIR}/content.idx\" \
+			-DCMS_GENERATION_FILE=\"${CACHE_DIR}/generation\" \
+			-DCMS_MD_CACHE_DIR=\"${CACHE_DIR}/md\" \
+			-DCMS_PACK_FILE=\"${CACHE_DIR}/content.pack\" \
+			-DCMS_CACHE_SLOTS=${CMS_CACHE_SLOTS} \
+			-DCMS_CACHE_SLOT_SIZE=${CMS_CACHE_SLOT_SIZE} \
+			-DCMS_CACHE_STALE=${CMS_CACHE_STALE} \
+			-DCMS_GZIP_LEVEL=${CMS_GZIP_LEVEL} \
+			-DCMS_LOWDOWN_VERSION=\"${LOWDOWN_VERSION}\"
+
+.if ${CMS_ZSTD:L} == "yes"
+CFLAGS+=		-DCMS_ZSTD -DCMS_ZSTD_LEVEL=${CMS_ZSTD_LEVEL}
+LDADD+=			-lzstd
+.endif
 
@@ -0,0 +1,320 @@
+/*
+ * Copyright (c) 2018 Markus Hennecke <markus-hennecke@markus-hennecke.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "encoding.h"
+
+#ifndef CMS_GZIP_LEVEL
+#define CMS_GZIP_LEVEL		6
+#endif
+#ifndef CMS_ZSTD_LEVEL
+#define CMS_ZSTD_LEVEL		3
+#endif
+
+#define ENCODE_BUF_SIZE		0x4000
+
+enum _encoder_mode {
+	ENCODER_CONTINUE,
+	ENCODER_FLUSH,
+	ENCODER_END
+};
+
+static const char *encoding_names[ENCODING_NTYPES] = {
+	"identity",
+	"gzip",
+	"zstd"
+};
+
+static float		 _encoding_quality(const char *, size_t);
+static void		 _encoder_emit(struct encoder *, struct buffer_list *);
+static void		 _encoder_run(struct encoder *, const void *, size_t,
+		enum _encoder_mode, struct buffer_list *);
+
+
+bool
+encoding_enabled(enum content_encoding _type)
+{
+	switch (_type) {
+	case ENCODING_GZIP:
+		return (CMS_GZIP_LEVEL > 0);
+	case ENCODING_ZSTD:
+#ifdef CMS_ZSTD
+		return true;
+#else
+		return false;
+#endif
+	default:
+		return false;
+	}
+}
+
+
+/*
+ * Reads the q parameter from the parameters of a coding, which start after
+ * its name. A missing one is 1.
+ */
+float
+_encoding_quality(const char *_params, size_t _len)
+{
+	const char *p = _params;
+	const char *end = _params + _len;
+
+	while (p < end) {
+		while (p < end && (*p == ';' || *p == ' ' || *p == '\t'))
+			p++;
+		if (end - p > 2 && (p[0] == 'q' || p[0] == 'Q') && p[1] == '=')
+			return strtof(p + 2, NULL);
+		while (p < end && *p != ';')
+			p++;
+	}
+	return 1.0;
+}
+
+
+/*
+ * Picks the coding of the response from an Accept-Encoding header value.
+ * The highest quality wins, a tie goes to the better compression. Without
+ * an acceptable coding the response is not encoded.
+ */
+enum content_encoding
+encoding_negotiate(const char *_accept)
+{
+	float quality[ENCODING_NTYPES];
+	float any = -1;
+
+	if (_accept == NULL)
+		return ENCODING_IDENTITY;
+	for (int i = 0; i < ENCODING_NTYPES; i++)
+		quality[i] = -1;
+
+	const char *s = _accept;
+	while (*s != '\0') {
+		while (*s == ' ' || *s == '\t' || *s == ',')
+			s++;
+		size_t len = strcspn(s, ",");
+		size_t namelen = strcspn(s, ",; \t");
+		float q = _encoding_quality(s + namelen, len - namelen);
+		if (namelen == 1 && s[0] == '*')
+			any = q;
+		else if (namelen == 6 && strncasecmp(s, "x-gzip", 6) == 0)
+			quality[ENCODING_GZIP] = q;
+		for (int i = 0; i < ENCODING_NTYPES; i++) {
+			if (strlen(encoding_names[i]) == namelen
+					&& strncasecmp(s, encoding_names[i],
+						namelen) == 0)
+				quality[i] = q;
+		}
+		s += len;
+	}
+
+	enum content_encoding best = ENCODING_IDENTITY;
+	float best_quality = 0;
+	for (int i = ENCODING_GZIP; i < ENCODING_NTYPES; i++) {
+		float q = (quality[i] >= 0) ? quality[i] : any;
+		if (encoding_enabled(i) && q > 0 && q >= best_quality) {
+			best = i;
+			best_quality = q;
+		}
+	}
+	return best;
+}
+
+
+const char *
+encoding_name(enum content_encoding _type)
+{
+	return encoding_names[_type];
+}
+
+
+/*
+ * Returns an encoder producing _type, or NULL for the identity coding.
+ */
+struct encoder *
+encoder_new(enum content_encoding _type)
+{
+	int rc;
+
+	if (! encoding_enabled(_type))
+		return NULL;
+	struct encoder *e = calloc(1, sizeof(struct encoder));
+	if (e == NULL)
+		err(1, NULL);
+	e->type = _type;
+	e->out = buffer_empty_new(ENCODE_BUF_SIZE);
+
+	switch (_type) {
+	case ENCODING_GZIP:
+		// The gzip header zlib writes has no name and no time stamp
+		if ((rc = deflateInit2(&e->strm, CMS_GZIP_LEVEL, Z_DEFLATED,
+					MAX_WBITS + 16, 8,
+					Z_DEFAULT_STRATEGY)) != Z_OK)
+			errx(1, "deflateInit2: %s", zError(rc));
+		break;
+#ifdef CMS_ZSTD
+	case ENCODING_ZSTD:
+		if ((e->zstd = ZSTD_createCCtx()) == NULL)
+			err(1, NULL);
+		ZSTD_CCtx_setParameter(e->zstd, ZSTD_c_compressionLevel,
+				CMS_ZSTD_LEVEL);
+		break;
+#endif
+	default:
+		break;
+	}
+	return e;
+}
+
+
+void
+encoder_free(struct encoder *_e)
+{
+	if (_e == NULL)
+		return;
+	if (_e->type == ENCODING_GZIP)
+		deflateEnd(&_e->strm);
+#ifdef CMS_ZSTD
+	if (_e->type == ENCODING_ZSTD)
+		ZSTD_freeCCtx(_e->zstd);
+#endif
+	free(_e->out);
+	free(_e);
+}
+
+
+/*
+ * Appends the pending output, a full buffer moves into _out.
+ */
+void
+_encoder_emit(struct encoder *_e, struct buffer_list *_out)
+{
+	if (_e->used == ENCODE_BUF_SIZE) {
+		buffer_list_add_buffer(_out, _e->out);
+		_e->out = buffer_empty_new(ENCODE_BUF_SIZE);
+	} else if (_e->used) {
+		buffer_list_add(_out, _e->out->data, _e->used);
+	}
+	_e->used = 0;
+}
+
+
+void
+_encoder_run(struct encoder *_e, const void *_data, size_t _size,
+		enum _encoder_mode _mode, struct buffer_list *_out)
+{
+	static const int flush[] = { Z_NO_FLUSH, Z_SYNC_FLUSH, Z_FINISH };
+	int rc;
+
+	if (_e->type == ENCODING_GZIP) {
+		_e->strm.next_in = (Bytef *)(uintptr_t)_data;
+		_e->strm.avail_in = _size;
+		for (;;) {
+			_e->strm.next_out = (Bytef *)_e->out->data + _e->used;
+			_e->strm.avail_out = ENCODE_BUF_SIZE - _e->used;
+			rc = deflate(&_e->strm, flush[_mode]);
+			if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR)
+				errx(1, "deflate: %s", zError(rc));
+			_e->used = ENCODE_BUF_SIZE - _e->strm.avail_out;
+			if (_e->strm.avail_out == 0)
+				_encoder_emit(_e, _out);
+			else if (_e->strm.avail_in == 0)
+				break;
+		}
+	}
+#ifdef CMS_ZSTD
+	if (_e->type == ENCODING_ZSTD) {
+		static const ZSTD_EndDirective directive[] = {
+			ZSTD_e_continue, ZSTD_e_flush, ZSTD_e_end
+		};
+		ZSTD_inBuffer in = { _data, _size, 0 };
+		for (;;) {
+			ZSTD_outBuffer zout = { _e->out->data, ENCODE_BUF_SIZE,
+				_e->used };
+			size_t left = ZSTD_compressStream2(_e->zstd, &zout, &in,
+					directive[_mode]);
+			if (ZSTD_isError(left))
+				errx(1, "ZSTD_compressStream2: %s",
+						ZSTD_getErrorName(left));
+			_e->used = zout.pos;
+			if (_e->used == ENCODE_BUF_SIZE)
+				_encoder_emit(_e, _out);
+			else if ((_mode == ENCODER_CONTINUE)
+					? in.pos == in.size : left == 0)
+				break;
+		}
+	}
+#endif
+	if (_mode != ENCODER_CONTINUE)
+		_encoder_emit(_e, _out);
+}
+
+
+/*
+ * Compresses _size bytes at _data, the output is appended to _out once
+ * a buffer is full.
+ */
+void
+encoder_add(struct encoder *_e, const void *_data, size_t _size,
+		struct buffer_list *_out)
+{
+	_encoder_run(_e, _data, _size, ENCODER_CONTINUE, _out);
+}
+
+
+/*
+ * Appends everything compressed so far to _out, so a client can decode
+ * what has been sent.
+ */
+void
+encoder_flush(struct encoder *_e, struct buffer_list *_out)
+{
+	_encoder_run(_e, NULL, 0, ENCODER_FLUSH, _out);
+}
+
+
+/*
+ * Ends the compressed stream, no more data can be added.
+ */
+void
+encoder_finish(struct encoder *_e, struct buffer_list *_out)
+{
+	_encoder_run(_e, NULL, 0, ENCODER_END, _out);
+}
+
+
+/*
+ * Returns _in encoded as _type.
+ */
+struct buffer_list *
+encoder_list(enum content_encoding _type, struct buffer_list *_in)
+{
+	struct encoder *e = encoder_new(_type);
+	if (e == NULL)
+		return NULL;
+
+	struct buffer_list *out = buffer_list_new();
+	struct buffer *b;
+	TAILQ_FOREACH(b, &_in->buffers, entries)
+		encoder_add(e, b->data, b->size, out);
+	encoder_finish(e, out);
+	encoder_free(e);
+	return out;
+}
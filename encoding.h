@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2018 Markus Hennecke <markus-hennecke@markus-hennecke.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __ENCODING_H__
+#define __ENCODING_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <zlib.h>
+#ifdef CMS_ZSTD
+#include <zstd.h>
+#endif
+
+#include "buffer.h"
+
+// Ordered by preference, a better compression comes last
+enum content_encoding {
+	ENCODING_IDENTITY = 0,
+	ENCODING_GZIP,
+	ENCODING_ZSTD,
+	ENCODING_NTYPES
+};
+
+struct encoder {
+	enum content_encoding	 type;
+	z_stream		 strm;
+#ifdef CMS_ZSTD
+	ZSTD_CCtx		*zstd;
+#endif
+	struct buffer		*out;
+	size_t			 used;
+};
+
+bool			 encoding_enabled(enum content_encoding);
+enum content_encoding	 encoding_negotiate(const char *);
+const char		*encoding_name(enum content_encoding);
+struct encoder		*encoder_new(enum content_encoding);
+void			 encoder_free(struct encoder *);
+void			 encoder_add(struct encoder *, const void *, size_t,
+		struct buffer_list *);
+void			 encoder_flush(struct encoder *, struct buffer_list *);
+void			 encoder_finish(struct encoder *,
+		struct buffer_list *);
+struct buffer_list	*encoder_list(enum content_encoding,
+		struct buffer_list *);
+
+#endif // __ENCODING_H__
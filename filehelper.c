@@ -18,6 +18,7 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,49 +27,87 @@
 
 #include "filehelper.h"
 
+static bool	_dir_entry_attr(int, struct dir_entry *, int);
+
+/*
+ * Fills in the attributes requested by _flags, d_type saves the stat call
+ * if only the type is needed and the file system provides it.
+ */
+bool
+_dir_entry_attr(int _fd, struct dir_entry *_entry, int _flags)
+{
+	if (_flags == DIR_LIST_NAMES)
+		return true;
+	if ((_flags & DIR_LIST_STAT) != DIR_LIST_STAT
+			&& _entry->type != DT_UNKNOWN)
+		return true;
+	if (fstatat(_fd, _entry->filename, &_entry->sb,
+				AT_SYMLINK_NOFOLLOW) == -1)
+		return false;
+	_entry->type = IFTODT(_entry->sb.st_mode);
+	return true;
+}
+
+
+/*
+ * Returns a new descriptor of the directory _fd to read it from the start.
+ * A dup(2)ed descriptor would share the directory offset.
+ */
+int
+dir_reopen(int _fd)
+{
+	return openat(_fd, ".", O_DIRECTORY | O_RDONLY);
+}
+
+
+/*
+ * Lists the directory _fd and closes it, never touches the working
+ * directory. readdir(3) reads the entries in large batches, only the
+ * attributes requested by _flags are looked up. The newest mtime of the
+ * list is only known with DIR_LIST_STAT.
+ */
 struct dir_list *
-get_dir_entries_fd(int _fd)
+get_dir_entries_fd(int _fd, int _flags)
 {
+	struct dirent *dirent;
+
 	DIR *dir = fdopendir(_fd);
-	if (dir) {
-		struct dir_list *list = malloc(sizeof(struct dir_list));
-		if (list == NULL)
-			err(1, NULL);
-		int cwd = open(".", O_DIRECTORY | O_RDONLY);
-		if (cwd == -1)
-			err(1, NULL);
-		if (fchdir(_fd) == -1)
-			err(1, NULL);
-		TAILQ_INIT(&list->entries);
-		list->newest = 0;
-		list->path = NULL;
-		struct dirent *dirent;
-		while ((dirent = readdir(dir)) != NULL) {
-			struct dir_entry *entry;
-
-			if (dirent->d_name[0] == '.')
-				continue;
-
-			entry = dir_entry_new(dirent->d_name);
-			TAILQ_INSERT_TAIL(&list->entries, entry, entries);
-			if (entry->sb.st_mtim.tv_sec > list->newest)
-				list->newest = entry->sb.st_mtim.tv_sec;
-		}
-		closedir(dir);
-		fchdir(cwd);
-		return list;
+	if (dir == NULL) {
+		int saved_errno = errno;
+		close(_fd);
+		errno = saved_errno;
+		return NULL;
+	}
+	struct dir_list *list = malloc(sizeof(struct dir_list));
+	if (list == NULL)
+		err(1, NULL);
+	TAILQ_INIT(&list->entries);
+	list->newest = 0;
+	list->path = NULL;
+	while ((dirent = readdir(dir)) != NULL) {
+		if (dirent->d_name[0] == '.')
+			continue;
+
+		struct dir_entry *entry = dir_entry_new(dirent->d_name);
+		entry->type = dirent->d_type;
+		if (! _dir_entry_attr(dirfd(dir), entry, _flags))
+			err(1, "stat error on file %s", dirent->d_name);
+		TAILQ_INSERT_TAIL(&list->entries, entry, entries);
+		if (entry->sb.st_mtim.tv_sec > list->newest)
+			list->newest = entry->sb.st_mtim.tv_sec;
 	}
-	return NULL;
+	closedir(dir);
+	return list;
 }
 
 
 struct dir_list *
-get_dir_entries(const char *_directory)
+get_dir_entries(const char *_directory, int _flags)
 {
 	int fd = open(_directory, O_DIRECTORY | O_RDONLY);
 	if (-1 == fd)
 		err(1, NULL);
-	struct dir_list *res = get_dir_entries_fd(fd);
+	struct dir_list *res = get_dir_entries_fd(fd, _flags);
 	if (res)
 		res->path = strdup(_directory);
 	return res;
@@ -76,12 +115,12 @@ get_dir_entries(const char *_directory)
 
 
 struct dir_list *
-get_dir_entries_at(int _fd, const char *_directory)
+get_dir_entries_at(int _fd, const char *_directory, int _flags)
 {
 	int fd = openat(_fd, _directory, O_DIRECTORY | O_RDONLY);
 	if (-1 == fd)
 		err(1, NULL);
-	struct dir_list *res = get_dir_entries_fd(fd);
+	struct dir_list *res = get_dir_entries_fd(fd, _flags);
 	if (res)
 		res->path = strdup(_directory);
 	return res;
@@ -95,8 +134,8 @@ dir_entry_new(const char *_filename)
 	if (entry == NULL)
 		err(1, NULL);
 	entry->filename = strdup(_filename);
-	if (lstat(_filename, &entry->sb) != 0)
-		err(1, "stat error on file %s", _filename);
+	if (entry->filename == NULL)
+		err(1, NULL);
 	return entry;
 }
 
@@ -123,6 +162,13 @@ dir_entry_exists(const char *_name, struct dir_list *_dir)
 }
 
 
+bool
+dir_entry_is_dir(struct dir_entry *_entry)
+{
+	return (_entry->type == DT_DIR);
+}
+
+
 void
 dir_list_free(struct dir_list *_list)
 {
@@ -133,6 +179,7 @@ dir_list_free(struct dir_list *_list)
 			dir_entry_free(entry);
 		}
 		free(_list->path);
+		free(_list);
 	}
 }
 
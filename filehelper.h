@@ -23,6 +23,11 @@
 
 #include <stdbool.h>
 
+// Attributes a directory listing has to provide
+#define DIR_LIST_NAMES		0x00	// file names only
+#define DIR_LIST_TYPE		0x01	// file type in type
+#define DIR_LIST_STAT		0x03	// type and the stat data in sb
+
 struct dir_entry {
 	TAILQ_ENTRY(dir_entry)	 entries;
 	struct stat		 sb;
@@ -32,17 +37,19 @@ struct dir_entry {
 
 struct dir_list {
 	TAILQ_HEAD(, dir_entry)	 entries;
-	time_t			 newest;
+	time_t			 newest;	// only set with DIR_LIST_STAT
 	char			*path;
 };
 
 struct dir_entry	*dir_entry_new(const char *);
 void	 		 dir_entry_free(struct dir_entry *);
 bool			 dir_entry_exists(const char *, struct dir_list *);
-struct dir_list		*get_dir_entries(const char *);
-struct dir_list		*get_dir_entries_fd(int);
-struct dir_list		*get_dir_entries_at(int, const char *);
+bool			 dir_entry_is_dir(struct dir_entry *);
+struct dir_list		*get_dir_entries(const char *, int);
+struct dir_list		*get_dir_entries_fd(int, int);
+struct dir_list		*get_dir_entries_at(int, const char *, int);
 void			 dir_list_free(struct dir_list *);
+int			 dir_reopen(int);
 
 bool			 file_exists(const char *_filename);
 bool			 dir_exists(const char *_dirname);
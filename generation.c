@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2018 Markus Hennecke <markus-hennecke@markus-hennecke.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Generation numbers published by cms-watch.
+ *
+ * The file holds a table of GENERATION_SLOTS slots addressed like the
+ * render cache by a 64 bit hash of the key with a probe window of
+ * GENERATION_PROBES. The keys are
+ *
+ *	""		the set of languages
+ *	lang		the navigation of a language: its pages and the files
+ *			of their navigation entries
+ *	lang/		everything below a language
+ *	lang/page	the files of a page
+ *	/templates	the template directory, GENERATION_TEMPLATES
+ *
+ * The set of languages a page exists in has the key "*", a slash and the
+ * page name.
+ *
+ * Along with its generation a slot keeps a hash over the stat data last
+ * seen by the watcher, a generation is only increased when that hash
+ * changes. The watcher is the only writer, it holds a fcntl(2) lock on
+ * the first byte of the file while it runs. Without that lock the
+ * numbers are not maintained and generation_open() fails. Keys that do
+ * not fit into the table increase the overflow counter which is part of
+ * every generation returned.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "generation.h"
+#include "helper.h"
+
+static size_t			 _generation_size(uint32_t);
+static int			 _generation_lock(int, int, int);
+static struct generation	*_generation_map(int, size_t, int);
+static struct generation_slot	*_generation_find(struct generation *,
+		uint64_t, bool);
+static uint64_t			 _generation_tag(const char *);
+
+
+size_t
+_generation_size(uint32_t _nslots)
+{
+	return sizeof(struct generation_header)
+		+ (size_t)_nslots * sizeof(struct generation_slot);
+}
+
+
+int
+_generation_lock(int _fd, int _cmd, int _type)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_start = 0;
+	fl.l_len = 1;
+	fl.l_type = _type;
+	fl.l_whence = SEEK_SET;
+	if (fcntl(_fd, _cmd, &fl) == -1)
+		return -1;
+	return (_cmd == F_GETLK) ? fl.l_type : 0;
+}
+
+
+struct generation *
+_generation_map(int _fd, size_t _size, int _prot)
+{
+	struct generation *g = calloc(1, sizeof(struct generation));
+	if (g == NULL)
+		err(1, NULL);
+	g->map = mmap(NULL, _size, _prot, MAP_SHARED, _fd, 0);
+	if (g->map == MAP_FAILED) {
+		warn("mmap");
+		free(g);
+		return NULL;
+	}
+	g->fd = _fd;
+	g->mapsize = _size;
+	g->header = g->map;
+	g->slots = (struct generation_slot *)(g->header + 1);
+	return g;
+}
+
+
+uint64_t
+_generation_tag(const char *_key)
+{
+	uint64_t tag = hash_fnv1a(HASH_FNV1A_INIT, _key, strlen(_key));
+	return (tag != 0) ? tag : 1;
+}
+
+
+struct generation_slot *
+_generation_find(struct generation *_g, uint64_t _tag, bool _create)
+{
+	uint32_t nslots = _g->header->nslots;
+	for (uint32_t i = 0; i < GENERATION_PROBES; i++) {
+		struct generation_slot *slot = &_g->slots[(_tag + i) % nslots];
+		uint64_t tag = __atomic_load_n(&slot->tag, __ATOMIC_ACQUIRE);
+		if (tag == _tag)
+			return slot;
+		if (tag == 0)
+			return (_create) ? slot : NULL;
+	}
+	return NULL;
+}
+
+
+/*
+ * Maps the generation file for reading. Returns NULL if the watcher is
+ * not running.
+ */
+struct generation *
+generation_open(const char *_filename)
+{
+	struct stat sb;
+
+	int fd = open(_filename, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			warn("%s", _filename);
+		return NULL;
+	}
+	if (_generation_lock(fd, F_GETLK, F_WRLCK) != F_WRLCK
+			|| fstat(fd, &sb) == -1
+			|| (size_t)sb.st_size
+				!= _generation_size(GENERATION_SLOTS)) {
+		close(fd);
+		return NULL;
+	}
+	struct generation *g = _generation_map(fd, sb.st_size, PROT_READ);
+	if (g == NULL) {
+		close(fd);
+		return NULL;
+	}
+	if (g->header->magic != GENERATION_MAGIC
+			|| g->header->version != GENERATION_VERSION
+			|| g->header->nslots != GENERATION_SLOTS) {
+		generation_close(g);
+		return NULL;
+	}
+	return g;
+}
+
+
+/*
+ * Opens the generation file for the watcher. Fails if another watcher
+ * is running.
+ */
+struct generation *
+generation_create(const char *_filename)
+{
+	struct stat sb;
+	size_t size = _generation_size(GENERATION_SLOTS);
+
+	int fd = open(_filename, O_RDWR | O_CREAT, 0644);
+	if (fd == -1) {
+		warn("%s", _filename);
+		return NULL;
+	}
+	if (_generation_lock(fd, F_SETLK, F_WRLCK) == -1) {
+		warnx("%s: locked by another process", _filename);
+		close(fd);
+		return NULL;
+	}
+	if (fstat(fd, &sb) == -1 || ((size_t)sb.st_size != size
+				&& ftruncate(fd, size) == -1)) {
+		warn("%s", _filename);
+		close(fd);
+		return NULL;
+	}
+	struct generation *g = _generation_map(fd, size,
+			PROT_READ | PROT_WRITE);
+	if (g == NULL) {
+		close(fd);
+		return NULL;
+	}
+	if (g->header->magic != GENERATION_MAGIC
+			|| g->header->version != GENERATION_VERSION
+			|| g->header->nslots != GENERATION_SLOTS) {
+		memset(g->map, 0, size);
+		g->header->version = GENERATION_VERSION;
+		g->header->nslots = GENERATION_SLOTS;
+		g->header->magic = GENERATION_MAGIC;
+	}
+	g->header->started = time(NULL);
+	return g;
+}
+
+
+void
+generation_close(struct generation *_g)
+{
+	if (_g) {
+		munmap(_g->map, _g->mapsize);
+		close(_g->fd);
+		free(_g);
+	}
+}
+
+
+/*
+ * Returns the generation of a key and raises _changed to the time of its
+ * last change.
+ */
+uint64_t
+generation_get(struct generation *_g, const char *_key, time_t *_changed)
+{
+	uint64_t gen = __atomic_load_n(&_g->header->overflow,
+			__ATOMIC_RELAXED);
+	time_t changed = _g->header->started;
+
+	struct generation_slot *slot = _generation_find(_g,
+			_generation_tag(_key), false);
+	if (slot) {
+		gen += __atomic_load_n(&slot->gen, __ATOMIC_RELAXED);
+		changed = slot->changed;
+	}
+	if (_changed && changed > *_changed)
+		*_changed = changed;
+	return gen;
+}
+
+
+bool
+generation_differs(struct generation *_g, const char *_key, uint64_t _state)
+{
+	struct generation_slot *slot = _generation_find(_g,
+			_generation_tag(_key), false);
+	return (slot == NULL || slot->state != _state);
+}
+
+
+/*
+ * Records the stat hash _state for a key and increases its generation if
+ * it differs from the last one. _newest is the newest mtime of the files
+ * covered by the key. Returns true if the generation changed.
+ */
+bool
+generation_update(struct generation *_g, const char *_key, uint64_t _state,
+		time_t _newest)
+{
+	uint64_t tag = _generation_tag(_key);
+	struct generation_slot *slot = _generation_find(_g, tag, true);
+
+	if (slot == NULL) {
+		__atomic_fetch_add(&_g->header->overflow, 1, __ATOMIC_RELAXED);
+		return true;
+	}
+	if (slot->tag == tag && slot->state == _state)
+		return false;
+	slot->state = _state;
+	slot->changed = _newest;
+	__atomic_fetch_add(&slot->gen, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&slot->tag, tag, __ATOMIC_RELEASE);
+	return true;
+}
+
+
+char *
+generation_page_key(const char *_page)
+{
+	return generation_key("*", _page);
+}
+
+
+/*
+ * Returns the key of the page _page of the language _lang, an empty page
+ * name stands for everything below the language.
+ */
+char *
+generation_key(const char *_lang, const char *_page)
+{
+	char *key;
+	if (asprintf(&key, "%s/%s", _lang, _page) == -1)
+		err(1, NULL);
+	return key;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2018 Markus Hennecke <markus-hennecke@markus-hennecke.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __GENERATION_H__
+#define __GENERATION_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define GENERATION_MAGIC	0x4e45474d	// "MGEN"
+#define GENERATION_VERSION	2
+#define GENERATION_SLOTS	65536
+#define GENERATION_PROBES	16
+
+// Key of the template directory, can not collide with a language
+#define GENERATION_TEMPLATES	"/templates"
+
+struct generation_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	nslots;
+	uint32_t	reserved;
+	uint64_t	overflow;
+	int64_t		started;
+};
+
+struct generation_slot {
+	uint64_t	tag;
+	uint64_t	gen;
+	int64_t		changed;
+	uint64_t	state;
+};
+
+struct generation {
+	int				 fd;
+	void				*map;
+	size_t				 mapsize;
+	struct generation_header	*header;
+	struct generation_slot		*slots;
+};
+
+struct generation	*generation_open(const char *);
+struct generation	*generation_create(const char *);
+void			 generation_close(struct generation *);
+uint64_t		 generation_get(struct generation *, const char *,
+		time_t *);
+bool			 generation_differs(struct generation *, const char *,
+		uint64_t);
+bool			 generation_update(struct generation *, const char *,
+		uint64_t, time_t);
+char			*generation_page_key(const char *);
+char			*generation_key(const char *, const char *);
+
+#endif // __GENERATION_H__
@@ -15,7 +15,9 @@
  */
 
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -24,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -42,14 +45,55 @@
 	" *(; *q *= *(1|0\\.[0-9]+))?$"
 #define ACCEPT_LANGUAGE_MAX_GROUPS 5
 
-#define HTTP_DATE_FMT "%a, %d %b %y %H:%M:%S GMT"
 
-const char *supported_request_methods[3] = {
+const char *supported_request_methods[4] = {
 	"GET",
 	"POST",
+	"HEAD",
 	NULL
 };
 
+static bool	_request_list_page(struct request *, int);
+static struct page_info	*_page_info_pack(struct request *);
+static struct md_mmap	*_page_info_md(struct page_info *, struct md_mmap **,
+		enum page_file);
+static struct memmap	*_page_info_file(struct page_info *, struct memmap **,
+		enum page_file);
+static void	_page_info_read_header(struct page_info *);
+static struct memmap	*_page_info_header(struct page_info *, enum page_file);
+
+static const char *page_files[PAGE_NFILES] = {
+	"CONTENT", "CONTENT.md", "DESCR", "DESCR.md", "LINK", "LOGIN",
+	"SCRIPT", "SORT", "SSL", "STYLE", "SUB", "TITLE"
+};
+
+// The pack holds markdown converted, flags are read from its catalog
+static const int page_pack_files[PAGE_NFILES] = {
+	PACK_CONTENT, -1, PACK_DESCR, -1, PACK_LINK, PACK_LOGIN,
+	PACK_SCRIPT, PACK_SORT, -1, PACK_STYLE, -1, PACK_TITLE
+};
+
+// Files a page header may replace
+static const int page_header_fields[PAGE_NFILES] = {
+	-1, -1, PAGE_HEADER_DESCR, -1, PAGE_HEADER_LINK, -1,
+	-1, PAGE_HEADER_SORT, -1, -1, -1, PAGE_HEADER_TITLE
+};
+static struct dir_list	*_request_catalog_languages(struct request *);
+static void	_request_fill_page(struct request *);
+static void	_request_stream(struct tmpl_sink *, struct buffer_list *);
+static void	_request_stream_encoded(struct request *);
+static void	_request_format_etag(struct request *,
+		struct page_validator *, char *, size_t);
+static uint64_t	_etag_add_dir_list(uint64_t, struct dir_list *, time_t *);
+static uint64_t	_etag_add_links(uint64_t, struct request *, time_t *);
+static uint64_t	_etag_add_languages(uint64_t, struct request *);
+static uint64_t	_etag_add_templates(uint64_t, struct request *, const char *,
+		time_t *);
+static bool	_request_validate_pack(struct request *, const char *,
+		struct page_validator *);
+static bool	_request_validate_generations(struct request *, const char *,
+		struct page_validator *);
+
 struct lang_pref *
 lang_pref_new(const char *_lang, const float _prio)
 {
@@ -163,16 +207,191 @@ cleanup_lang:
 
 
 struct page_info *
-page_info_new(char *_path)
+page_info_new(char *_path, int _dir)
 {
 	struct page_info *info = calloc(1, sizeof(struct page_info));
 	if (NULL == info)
 		err(1, NULL);
 	info->path = _path;
+	info->dir = _dir;
 	return info;
 }
 
 
+bool
+page_info_has(struct page_info *_info, enum page_file _file)
+{
+	return ((_info->present & (1U << _file)) != 0);
+}
+
+
+/*
+ * Reads the header of a page without a LINK file, its fields count as
+ * files of the page.
+ */
+void
+_page_info_read_header(struct page_info *_info)
+{
+	struct page_header *h = &_info->header;
+
+	if ((_info->header_data = malloc(PAGE_HEADER_MAX)) == NULL)
+		err(1, NULL);
+	if (! page_header_read_at(_info->dir, h, _info->header_data,
+				PAGE_HEADER_MAX))
+		return;
+	for (int i = 0; i < PAGE_NFILES; i++)
+		if (page_header_fields[i] != -1
+				&& h->value[page_header_fields[i]])
+			_info->present |= (1U << i);
+	if (h->flags & PAGE_HEADER_SSL)
+		_info->present |= (1U << PAGE_SSL);
+	if (h->flags & PAGE_HEADER_SUB)
+		_info->present |= (1U << PAGE_SUB);
+}
+
+
+/*
+ * Returns the field of the page header that replaces _file, NULL if the
+ * file has to be read.
+ */
+struct memmap *
+_page_info_header(struct page_info *_info, enum page_file _file)
+{
+	int f = page_header_fields[_file];
+	if (f == -1 || _info->header.value[f] == NULL)
+		return NULL;
+	return memmap_new_ref(_info->header.value[f], _info->header.len[f]);
+}
+
+
+/*
+ * Loads the markdown variant _file + 1 if it exists, the plain file _file
+ * otherwise, and converts it.
+ */
+struct md_mmap *
+_page_info_md(struct page_info *_info, struct md_mmap **_field,
+		enum page_file _file)
+{
+	if (_info->loaded & (1U << _file))
+		return *_field;
+	_info->loaded |= (1U << _file);
+
+	if (_info->pack) {
+		struct memmap *mm = pack_file(_info->pack, _info->pack_page,
+				page_pack_files[_file]);
+		if (mm)
+			*_field = md_mmap_new_from_memmap(mm);
+		return *_field;
+	}
+	struct memmap *mm = _page_info_header(_info, _file);
+	if (mm) {
+		*_field = md_mmap_new_from_memmap(mm);
+		return *_field;
+	}
+	struct dir_entry *e = _info->files[_file + 1];
+	if (e == NULL)
+		e = _info->files[_file];
+	if (e == NULL)
+		return NULL;
+	*_field = md_mmap_new_at(_info->dir, e->filename);
+	if (*_field == NULL)
+		return NULL;
+	if (_file == PAGE_CONTENT
+			&& _info->header.size <= (*_field)->mmap->size)
+		(*_field)->skip = _info->header.size;
+	md_mmap_parse(*_field);
+	return *_field;
+}
+
+
+struct memmap *
+_page_info_file(struct page_info *_info, struct memmap **_field,
+		enum page_file _file)
+{
+	if (_info->loaded & (1U << _file))
+		return *_field;
+	_info->loaded |= (1U << _file);
+
+	if (_info->pack)
+		*_field = pack_file(_info->pack, _info->pack_page,
+				page_pack_files[_file]);
+	else {
+		*_field = _page_info_header(_info, _file);
+		if (*_field == NULL && _info->files[_file])
+			*_field = memmap_new_at(_info->dir,
+					_info->files[_file]->filename);
+	}
+	return *_field;
+}
+
+
+struct md_mmap *
+page_info_content(struct page_info *_info)
+{
+	return _page_info_md(_info, &_info->content, PAGE_CONTENT);
+}
+
+
+struct md_mmap *
+page_info_descr(struct page_info *_info)
+{
+	return _page_info_md(_info, &_info->descr, PAGE_DESCR);
+}
+
+
+struct md_mmap *
+page_info_login(struct page_info *_info)
+{
+	if (_info->loaded & (1U << PAGE_LOGIN))
+		return _info->login;
+	_info->loaded |= (1U << PAGE_LOGIN);
+
+	if (_info->pack) {
+		struct memmap *mm = pack_file(_info->pack, _info->pack_page,
+				PACK_LOGIN);
+		if (mm)
+			_info->login = md_mmap_new_from_memmap(mm);
+	} else if (_info->files[PAGE_LOGIN])
+		_info->login = md_mmap_new_at(_info->dir, "LOGIN");
+	return _info->login;
+}
+
+
+struct memmap *
+page_info_link(struct page_info *_info)
+{
+	return _page_info_file(_info, &_info->link, PAGE_LINK);
+}
+
+
+struct memmap *
+page_info_script(struct page_info *_info)
+{
+	return _page_info_file(_info, &_info->script, PAGE_SCRIPT);
+}
+
+
+struct memmap *
+page_info_sort(struct page_info *_info)
+{
+	return _page_info_file(_info, &_info->sort, PAGE_SORT);
+}
+
+
+struct memmap *
+page_info_style(struct page_info *_info)
+{
+	return _page_info_file(_info, &_info->style, PAGE_STYLE);
+}
+
+
+struct memmap *
+page_info_title(struct page_info *_info)
+{
+	return _page_info_file(_info, &_info->title, PAGE_TITLE);
+}
+
+
 void
 page_info_free(struct page_info *_info)
 {
@@ -188,12 +407,18 @@ page_info_free(struct page_info *_info)
 	memmap_free(_info->script);
 	memmap_free(_info->title);
 
+	free(_info->header_data);
 	free(_info->path);
 
 	free(_info);
 }
 
 
+/*
+ * Sets up a request from the URI without touching the content tree,
+ * unless the language has to be negotiated. Returns NULL if the URI is
+ * not a valid page URI.
+ */
 struct request *
 request_new(char *_path_info)
 {
@@ -204,13 +429,8 @@ request_new(char *_path_info)
 	if (req == NULL)
 		err(1, NULL);
 
-	req->content_dir = open(cms_content_dir, O_DIRECTORY | O_RDONLY);
-	if (-1 == req->content_dir)
-		err(1, "%s", cms_content_dir);
-
-	req->template_dir = open(cms_template_dir, O_DIRECTORY | O_RDONLY);
-	if (-1 == req->template_dir)
-		err(1, "%s", cms_template_dir);
+	req->content_dir = -1;
+	req->template_dir = -1;
 	req->page_dir = -1;
 	req->lang_dir = -1;
 	req->path_info = strdup(_path_info);
@@ -253,6 +473,7 @@ request_new(char *_path_info)
 			rx_group_array, 0);
 	switch (rc) {
 	case REG_NOMATCH:
+		regfree(&rx);
 		request_free(req);
 		return NULL;
 	case 0:
@@ -273,10 +494,31 @@ request_new(char *_path_info)
 
 	regfree(&rx);
 
-	req->avail_languages = get_dir_entries(cms_content_dir);
-	request_parse_lang_pref(req);
+	if (NULL == req->page) {
+		request_free(req);
+		return NULL;
+	}
+
+	// A content pack replaces the content directory and the catalog
+	// unless the content changed after it was built
+	req->pack = pack_open(cms_pack_file);
+	if (req->pack && pack_outdated(req->pack, cms_catalog_file)) {
+		pack_close(req->pack);
+		req->pack = NULL;
+	}
+	if (req->pack == NULL)
+		req->generations = generation_open(cms_generation_file);
+	req->catalog = (req->pack) ? req->pack->catalog
+		: catalog_open(cms_catalog_file);
 
+	// The available languages are only needed for negotiation
 	if (NULL == req->lang) {
+		req->avail_languages = _request_catalog_languages(req);
+		if (req->avail_languages == NULL)
+			req->avail_languages = get_dir_entries(cms_content_dir,
+					DIR_LIST_NAMES);
+		request_parse_lang_pref(req);
+
 		struct lang_pref *lang = TAILQ_FIRST(&req->accept_languages);
 		if (lang == NULL) {
 			req->lang = strndup(CMS_DEFAULT_LANGUAGE,
@@ -288,15 +530,124 @@ request_new(char *_path_info)
 				req->lang = strdup(lang->short_lang);
 		}
 	}
-	req->lang_dir = openat(req->content_dir, req->lang,
+
+	return req;
+}
+
+
+/*
+ * Opens the directories needed to answer the request. Returns false with
+ * errno set if the requested language can not be opened, ENOENT if it
+ * does not exist.
+ */
+bool
+request_open(struct request *_req)
+{
+	_req->template_dir = open(cms_template_dir, O_DIRECTORY | O_RDONLY);
+	if (-1 == _req->template_dir)
+		err(1, "%s", cms_template_dir);
+
+	if (_req->pack) {
+		_req->catalog_lang = catalog_find_lang(_req->catalog,
+				_req->lang);
+		_req->page_langs = catalog_page_langs(_req->catalog,
+				_req->page);
+		if (_req->catalog_lang == NULL) {
+			errno = ENOENT;
+			return false;
+		}
+		return true;
+	}
+
+	if (-1 == _req->content_dir)
+		_req->content_dir = open(cms_content_dir,
+				O_DIRECTORY | O_RDONLY);
+	if (-1 == _req->content_dir)
+		err(1, "%s", cms_content_dir);
+
+	_req->lang_dir = openat(_req->content_dir, _req->lang,
 			O_DIRECTORY | O_RDONLY);
+	if (-1 == _req->lang_dir)
+		return false;
+	// The watcher rewrites the catalog before publishing a change.
+	// Without it an edit to the LINK, SORT or DESCR of a page changes
+	// no directory, only the languages of the page are taken from the
+	// catalog then, as long as every language directory matches it.
+	if (_req->generations) {
+		_req->catalog_lang = catalog_find_lang(_req->catalog,
+				_req->lang);
+		if (_req->catalog_lang)
+			_req->page_langs = catalog_page_langs(_req->catalog,
+					_req->page);
+	} else if (catalog_langs_fresh(_req->catalog, _req->content_dir)) {
+		_req->page_langs = catalog_page_langs(_req->catalog,
+				_req->page);
+	}
 
-	if (req->lang_dir == -1) {
-		request_free(req);
-		_error("404 Not Found", NULL);
+	return true;
+}
+
+
+/*
+ * Lists the languages from the content catalog if it is up to date,
+ * returns NULL otherwise.
+ */
+struct dir_list *
+_request_catalog_languages(struct request *_req)
+{
+	if (_req->catalog == NULL)
+		return NULL;
+	// The watcher rewrites the catalog before publishing a change
+	if (_req->pack == NULL && _req->generations == NULL) {
+		_req->content_dir = open(cms_content_dir,
+				O_DIRECTORY | O_RDONLY);
+		if (-1 == _req->content_dir)
+			err(1, "%s", cms_content_dir);
+		if (! catalog_fresh(_req->catalog, _req->content_dir))
+			return NULL;
 	}
 
-	return req;
+	struct dir_list *list = calloc(1, sizeof(struct dir_list));
+	if (list == NULL)
+		err(1, NULL);
+	TAILQ_INIT(&list->entries);
+	for (uint32_t i = 0; i < _req->catalog->header->nlangs; i++) {
+		struct dir_entry *e = calloc(1, sizeof(struct dir_entry));
+		if (e == NULL)
+			err(1, NULL);
+		e->filename = strdup(catalog_str(_req->catalog,
+					&_req->catalog->langs[i].name));
+		if (e->filename == NULL)
+			err(1, NULL);
+		TAILQ_INSERT_TAIL(&list->entries, e, entries);
+	}
+	return list;
+}
+
+
+/*
+ * Validator for remembering that the requested page does not exist. It
+ * changes whenever a language or a page is added or removed.
+ */
+uint64_t
+request_negative_validator(struct request *_req)
+{
+	struct stat sb;
+	char path[PATH_MAX];
+	uint64_t validator = HASH_FNV1A_INIT;
+
+	if (_req->pack)
+		return hash_fnv1a(validator, &_req->pack->sb.st_mtim,
+				sizeof(_req->pack->sb.st_mtim));
+	if (stat(cms_content_dir, &sb) == 0)
+		validator = hash_fnv1a(validator, &sb.st_mtim,
+				sizeof(sb.st_mtim));
+	if ((size_t)snprintf(path, sizeof(path), "%s/%s", cms_content_dir,
+				_req->lang) < sizeof(path)
+			&& stat(path, &sb) == 0)
+		validator = hash_fnv1a(validator, &sb.st_mtim,
+				sizeof(sb.st_mtim));
+	return validator;
 }
 
 
@@ -315,6 +666,10 @@ request_free(struct request *_req)
 
 		page_info_free(_req->page_info);
 		tmpl_data_free(_req->data);
+		free(_req->nav_rows);
+		encoder_free(_req->encoder);
+		buffer_list_free(_req->encoded);
+		free(_req->encoded);
 
 		free(_req->path_info);
 		free(_req->page);
@@ -346,6 +701,7 @@ request_free(struct request *_req)
 		}
 
 		dir_list_free(_req->avail_languages);
+		dir_list_free(_req->page_files);
 
 		session_free(_req->session);
 		if (_req->session_store)
@@ -353,104 +709,471 @@ request_free(struct request *_req)
 		session_store_free(_req->session_store);
 
 		htpasswd_free(_req->htpasswd);
+		if (_req->pack)
+			pack_close(_req->pack);
+		else
+			catalog_close(_req->catalog);
+		generation_close(_req->generations);
 
 		memmap_free(_req->tmpl_file);
 	}
 }
 
 
+/*
+ * Opens and lists the page directory once for the validation and the
+ * loading stage, _flags names the attributes the caller needs. Returns
+ * false with errno set if that is not possible.
+ */
+bool
+_request_list_page(struct request *_req, int _flags)
+{
+	if (_req->page_files)
+		return true;
+	if (_req->page_dir == -1) {
+		_req->page_dir = openat(_req->lang_dir, _req->page,
+				O_DIRECTORY | O_RDONLY);
+		if (_req->page_dir == -1)
+			return false;
+	}
+	int fd = dir_reopen(_req->page_dir);
+	if (fd == -1)
+		return false;
+	_req->page_files = get_dir_entries_fd(fd, _flags);
+	return (_req->page_files != NULL);
+}
+
+
+/*
+ * Records the files of the requested page from the content pack, returns
+ * NULL if the pack does not hold the page.
+ */
+struct page_info *
+_page_info_pack(struct request *_req)
+{
+	char *path;
+
+	int64_t idx = pack_find(_req->pack, _req->lang, _req->page);
+	if (idx == -1)
+		return NULL;
+	if (-1 == asprintf(&path, "%s/%s/%s", cms_pack_file, _req->lang,
+				_req->page))
+		err(1, NULL);
+	struct page_info *p = page_info_new(path, -1);
+	p->pack = _req->pack;
+	p->pack_page = idx;
+	for (int i = 0; i < PAGE_NFILES; i++)
+		if (page_pack_files[i] != -1
+				&& pack_has(_req->pack, idx, page_pack_files[i]))
+			p->present |= (1U << i);
+	uint32_t flags = _req->catalog->pages[idx].flags;
+	if (flags & CATALOG_SSL)
+		p->present |= (1U << PAGE_SSL);
+	if (flags & CATALOG_SUB)
+		p->present |= (1U << PAGE_SUB);
+	return p;
+}
+
+
+/*
+ * Second stage of answering a request: loads the page files found by
+ * request_validate().
+ */
 struct page_info *
 request_fetch_page(struct request *_req)
 {
 	struct dir_list *files = NULL;
 	struct dir_entry *e;
 	struct page_info *p = NULL;
-	int cwd = -1;
+	int pagefd;
 	char *path;
 
-	if (-1 == asprintf(&path, "%s/%s/%s", cms_content_dir, _req->lang,
-				_req->page))
-		err(1, NULL);
-	cwd = open(path, O_DIRECTORY | O_RDONLY);
-	if (-1 == cwd) {
-		warn("%s", path);
-		goto error_out;
-	}
-
-	p = page_info_new(path);
-	files = get_dir_entries(path);
-	if (files == NULL)
-		goto error_out;
+	if (_req->pack) {
+		p = _page_info_pack(_req);
+		if (p == NULL) {
+			warnx("%s/%s: not in the content pack", _req->lang,
+					_req->page);
+			return NULL;
+		}
+	} else {
+		// Only the names are needed to load the page
+		if (! _request_list_page(_req, DIR_LIST_NAMES)) {
+			warn("%s/%s", _req->lang, _req->page);
+			return NULL;
+		}
+		files = _req->page_files;
+		pagefd = _req->page_dir;
 
-	TAILQ_FOREACH(e, &files->entries, entries) {
-		if (strcmp("CONTENT", e->filename) == 0) {
-			if (p->content == NULL)
-				p->content = md_mmap_new_at(cwd, e->filename);
-		} else if (strcmp("CONTENT.md", e->filename) == 0) {
-			md_mmap_free(p->content);
-			p->content = md_mmap_new_at(cwd, e->filename);
-			md_mmap_parse(p->content);
-		} else if (strcmp("DESCR", e->filename) == 0) {
-			if (p->descr == NULL)
-				p->descr = md_mmap_new_at(cwd, e->filename);
-		} else if (strcmp("DESCR.md", e->filename) == 0) {
-			md_mmap_free(p->descr);
-			p->descr = md_mmap_new_at(cwd, e->filename);
-			md_mmap_parse(p->descr);
-		} else if (strcmp("LINK", e->filename) == 0) {
-			p->link = memmap_new_at(cwd, e->filename);
-		} else if (strcmp("LOGIN", e->filename) == 0) {
-			p->login = md_mmap_new_at(cwd, e->filename);
-		} else if (strcmp("SORT", e->filename) == 0) {
-			p->sort = memmap_new_at(cwd, e->filename);
-		} else if (strcmp("SCRIPT", e->filename) == 0) {
-			p->script = memmap_new_at(cwd, e->filename);
-		} else if (strcmp("SSL", e->filename) == 0) {
-			p->ssl = true;
-		} else if (strcmp("STYLE", e->filename) == 0) {
-			p->style = memmap_new_at(cwd, e->filename);
-		} else if (strcmp("SUB", e->filename) == 0) {
-			p->sub = true;
-		} else if (strcmp("TITLE", e->filename) == 0) {
-			p->title = memmap_new_at(cwd, e->filename);
+		if (-1 == asprintf(&path, "%s/%s/%s", cms_content_dir,
+					_req->lang, _req->page))
+			err(1, NULL);
+		p = page_info_new(path, pagefd);
+
+		TAILQ_FOREACH(e, &files->entries, entries) {
+			for (int i = 0; i < PAGE_NFILES; i++)
+				if (strcmp(page_files[i], e->filename) == 0) {
+					p->files[i] = e;
+					p->present |= (1U << i);
+					break;
+				}
 		}
+		// The header of the content may stand in for the other files
+		if (! page_info_has(p, PAGE_LINK))
+			_page_info_read_header(p);
 	}
+	p->ssl = page_info_has(p, PAGE_SSL);
+	p->sub = page_info_has(p, PAGE_SUB);
 
 	// Test for all required fields, if not here we error out
-	if (!(p->content && p->link && p->sort && p->title && p->descr)) 
+	if (!((page_info_has(p, PAGE_CONTENT)
+				|| page_info_has(p, PAGE_CONTENT_MD))
+			&& (page_info_has(p, PAGE_DESCR)
+				|| page_info_has(p, PAGE_DESCR_MD))
+			&& page_info_has(p, PAGE_LINK)
+			&& page_info_has(p, PAGE_SORT)
+			&& page_info_has(p, PAGE_TITLE)))
 		goto error_out;
 
+	_req->page_info = p;
+	return p;
+
+error_out:
+	page_info_free(p);
+	return NULL;
+}
+
+
+/*
+ * The tag of the page in the coding of the response.
+ */
+void
+_request_format_etag(struct request *_req, struct page_validator *_pv,
+		char *_buf, size_t _size)
+{
+	format_etag(_buf, _size, _pv->etag,
+			(_req->encoding != ENCODING_IDENTITY)
+			? encoding_name(_req->encoding) : NULL);
+}
+
+
+/*
+ * Answers with 304 if the client already has the current version of the
+ * page. If-None-Match takes precedence over If-Modified-Since.
+ */
+void
+request_check_modified(struct request *_req, struct page_validator *_pv)
+{
+	char etag[ETAG_LEN];
+
+	if (_pv->login)
+		return;
+
+	const char *if_none_match = getenv("HTTP_IF_NONE_MATCH");
+	if (if_none_match) {
+		_request_format_etag(_req, _pv, etag, sizeof(etag));
+		// The page exists once it has been validated
+		if (etag_match_any(if_none_match)
+				|| etag_match(if_none_match, etag))
+			_error("304 Not Modified", NULL);
+		return;
+	}
+
 	// Test if the If-Modified-Since header exists and the newest
 	// file from the content directory have equal time stamps
 	const char *if_modified_since = getenv("HTTP_IF_MODIFIED_SINCE");
 	if (if_modified_since) {
 		struct tm tm;
 		if (strptime(if_modified_since, HTTP_DATE_FMT, &tm)) {
-			if (timegm(&tm) >= files->newest)
+			if (timegm(&tm) >= _pv->newest)
 				_error("304 Not Modified", NULL);
 		}
 	}
+}
+
 
+void
+request_add_validator_headers(struct request *_req,
+		struct page_validator *_pv)
+{
+	char etag[ETAG_LEN];
 	char last_modified[30];
+
+	if (_pv->login)
+		return;
+
+	_request_format_etag(_req, _pv, etag, sizeof(etag));
+	request_set_header(_req, "ETag", etag);
 	strftime(last_modified, sizeof(last_modified),
-			HTTP_DATE_FMT, gmtime(&files->newest));
-	request_add_header(_req, "Last-Modified", last_modified);
+			HTTP_DATE_FMT, gmtime(&_pv->newest));
+	request_set_header(_req, "Last-Modified", last_modified);
+}
 
-	_req->page_info = p;
-	_req->content = p->content;
-cleanup:
-	if (files)
+
+char *
+request_cache_key(struct request *_req)
+{
+	char *key;
+	if (asprintf(&key, "%s/%s", _req->lang, _req->page) == -1)
+		err(1, NULL);
+	return key;
+}
+
+
+/*
+ * Chooses the coding of the response from Accept-Encoding. With
+ * compression enabled every variant of a page has to name the header.
+ */
+void
+request_negotiate_encoding(struct request *_req)
+{
+	_req->encoding = encoding_negotiate(getenv("HTTP_ACCEPT_ENCODING"));
+	if (encoding_enabled(ENCODING_GZIP) || encoding_enabled(ENCODING_ZSTD))
+		request_set_header(_req, "Vary", "Accept-Encoding");
+}
+
+
+void
+request_add_encoding_header(struct request *_req)
+{
+	if (_req->encoding != ENCODING_IDENTITY)
+		request_set_header(_req, "Content-Encoding",
+				encoding_name(_req->encoding));
+}
+
+
+uint64_t
+_etag_add_dir_list(uint64_t _etag, struct dir_list *_files, time_t *_newest)
+{
+	struct dir_entry *e;
+	TAILQ_FOREACH(e, &_files->entries, entries) {
+		_etag += hash_stat(e->filename, &e->sb);
+		if (e->sb.st_mtim.tv_sec > *_newest)
+			*_newest = e->sb.st_mtim.tv_sec;
+	}
+	return _etag;
+}
+
+
+/*
+ * Adds the files read for the navigation entry of every page in the
+ * language directory, the content for a page header.
+ */
+uint64_t
+_etag_add_links(uint64_t _etag, struct request *_req, time_t *_changed)
+{
+	static const char *link_files[] = {
+		"LINK", "SORT", "DESCR", "DESCR.md", "SUB", "SSL", "CONTENT",
+		"CONTENT.md", NULL
+	};
+	struct dirent *dirent;
+	struct stat sb;
+	char path[PATH_MAX];
+
+	int fd = dir_reopen(_req->lang_dir);
+	if (fd == -1)
+		err(1, NULL);
+	DIR *dir = fdopendir(fd);
+	if (dir == NULL)
+		err(1, NULL);
+	while ((dirent = readdir(dir)) != NULL) {
+		if (dirent->d_name[0] == '.')
+			continue;
+		for (const char **f = link_files; *f; f++) {
+			snprintf(path, sizeof(path), "%s/%s", dirent->d_name,
+					*f);
+			if (fstatat(_req->lang_dir, path, &sb, 0) == -1)
+				continue;
+			_etag += hash_stat(path, &sb);
+			if (sb.st_mtim.tv_sec > *_changed)
+				*_changed = sb.st_mtim.tv_sec;
+		}
+	}
+	closedir(dir);
+	return _etag;
+}
+
+
+/*
+ * Adds the set of languages and the languages the page exists in.
+ */
+uint64_t
+_etag_add_languages(uint64_t _etag, struct request *_req)
+{
+	struct dirent *dirent;
+	struct stat sb;
+	char path[PATH_MAX];
+
+	if (_req->page_langs) {
+		uint64_t h = hash_fnv1a(HASH_FNV1A_INIT,
+				&_req->catalog->header->langs,
+				sizeof(_req->catalog->header->langs));
+		return _etag + hash_fnv1a(h, _req->page_langs,
+				CATALOG_WORDS(_req->catalog->header->nlangs)
+				* sizeof(uint64_t));
+	}
+
+	int fd = dir_reopen(_req->content_dir);
+	if (fd == -1)
+		err(1, NULL);
+	DIR *dir = fdopendir(fd);
+	if (dir == NULL)
+		err(1, NULL);
+	while ((dirent = readdir(dir)) != NULL) {
+		if (dirent->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dirent->d_name,
+				_req->page);
+		bool exists = (fstatat(_req->content_dir, path, &sb, 0) == 0
+				&& S_ISDIR(sb.st_mode));
+		// Fold the existence into the hash of its language, a sum
+		// would not tell which of the languages has the page
+		_etag += hash_fnv1a(hash_stat(path, NULL), &exists,
+				sizeof(exists));
+	}
+	closedir(dir);
+	return _etag;
+}
+
+
+/*
+ * Adds the template directory and the page template.
+ */
+uint64_t
+_etag_add_templates(uint64_t _etag, struct request *_req,
+		const char *_tmpl_filename, time_t *_changed)
+{
+	struct stat sb;
+
+	int fd = dir_reopen(_req->template_dir);
+	if (fd == -1)
+		err(1, NULL);
+	struct dir_list *files = get_dir_entries_fd(fd, DIR_LIST_STAT);
+	if (files) {
+		_etag = _etag_add_dir_list(_etag, files, _changed);
 		dir_list_free(files);
-	if (cwd != -1) {
-		fchdir(cwd);
-		close(cwd);
 	}
-	return p;
+	if (fstatat(_req->template_dir, _tmpl_filename, &sb, 0) == 0)
+		_etag += hash_stat(_tmpl_filename, &sb);
+	return _etag;
+}
 
-error_out:
-	page_info_free(p);
-	p = NULL;
-	goto cleanup;
+
+/*
+ * First stage of answering a request: collects the stat data of every
+ * input affecting the rendered page (page files, navigation entries,
+ * languages and templates) without reading any of them and computes a
+ * strong entity tag from it. While the catalog is up to date it stands
+ * for the languages of the page. Returns false with errno set if the page
+ * directory can not be read.
+ */
+bool
+request_validate(struct request *_req, const char *_tmpl_filename,
+		struct page_validator *_pv)
+{
+	uint64_t etag = 0;
+
+	memset(_pv, 0, sizeof(*_pv));
+
+	if (_req->pack)
+		return _request_validate_pack(_req, _tmpl_filename, _pv);
+	if (_req->generations)
+		return _request_validate_generations(_req, _tmpl_filename, _pv);
+
+	if (! _request_list_page(_req, DIR_LIST_STAT))
+		return false;
+	etag = _etag_add_dir_list(etag, _req->page_files, &_pv->newest);
+	struct dir_entry *e;
+	TAILQ_FOREACH(e, &_req->page_files->entries, entries) {
+		if (strcmp(e->filename, "LOGIN") == 0) {
+			_pv->login = true;
+			_pv->access = hash_stat(e->filename, &e->sb);
+		}
+	}
+	_pv->changed = _pv->newest;
+
+	_req->nav_validator = _etag_add_links(0, _req, &_pv->changed);
+	etag += _req->nav_validator;
+	etag = _etag_add_languages(etag, _req);
+	etag = _etag_add_templates(etag, _req, _tmpl_filename, &_pv->changed);
+
+	_pv->etag = (etag != 0) ? etag : 1;
+	return true;
+}
+
+
+/*
+ * The whole content lives in the pack, its stat data stands for the page,
+ * the navigation and the languages.
+ */
+bool
+_request_validate_pack(struct request *_req, const char *_tmpl_filename,
+		struct page_validator *_pv)
+{
+	struct pack *pack = _req->pack;
+
+	int64_t idx = pack_find(pack, _req->lang, _req->page);
+	if (idx == -1) {
+		errno = ENOENT;
+		return false;
+	}
+	_pv->login = (_req->catalog->pages[idx].flags & CATALOG_LOGIN);
+	_pv->access = (_pv->login) ? 1 : 0;
+	_pv->changed = pack->sb.st_mtim.tv_sec;
+	_req->nav_validator = hash_stat(cms_pack_file, &pack->sb);
+
+	uint64_t etag = hash_fnv1a(_req->nav_validator, _req->lang,
+			strlen(_req->lang) + 1);
+	etag = hash_fnv1a(etag, _req->page, strlen(_req->page) + 1);
+	etag = _etag_add_templates(etag, _req, _tmpl_filename, &_pv->changed);
+	_pv->newest = _pv->changed;
+	_pv->etag = (etag != 0) ? etag : 1;
+	return true;
+}
+
+
+/*
+ * Computes the entity tag from the generations published by cms-watch
+ * instead of the stat data of every input.
+ */
+bool
+_request_validate_generations(struct request *_req, const char *_tmpl_filename,
+		struct page_validator *_pv)
+{
+	struct stat sb;
+	uint64_t gen[5];
+
+	if (_req->page_dir == -1) {
+		_req->page_dir = openat(_req->lang_dir, _req->page,
+				O_DIRECTORY | O_RDONLY);
+		if (_req->page_dir == -1)
+			return false;
+	}
+	if (fstatat(_req->page_dir, "LOGIN", &sb, 0) == 0) {
+		_pv->login = true;
+		_pv->access = hash_stat("LOGIN", &sb);
+	}
+
+	// A change to another page only matters for the navigation
+	char *langs_key = generation_page_key(_req->page);
+	char *page_key = generation_key(_req->lang, _req->page);
+	gen[0] = generation_get(_req->generations, "", &_pv->changed);
+	gen[1] = generation_get(_req->generations, _req->lang, &_pv->changed);
+	gen[2] = generation_get(_req->generations, langs_key, &_pv->changed);
+	gen[3] = generation_get(_req->generations, page_key, &_pv->changed);
+	gen[4] = generation_get(_req->generations, GENERATION_TEMPLATES,
+			&_pv->changed);
+	free(langs_key);
+	free(page_key);
+	_pv->newest = _pv->changed;
+	_req->nav_validator = hash_fnv1a(HASH_FNV1A_INIT, &gen[1],
+			sizeof(gen[1]));
+
+	uint64_t etag = hash_fnv1a(HASH_FNV1A_INIT, gen, sizeof(gen));
+	etag = hash_fnv1a(etag, _req->lang, strlen(_req->lang) + 1);
+	etag = hash_fnv1a(etag, _req->page, strlen(_req->page) + 1);
+	etag = hash_fnv1a(etag, _tmpl_filename, strlen(_tmpl_filename));
+	_pv->etag = (etag != 0) ? etag : 1;
+	return true;
 }
 
 
@@ -459,12 +1182,13 @@ request_init_tmpl_data(struct request *_req)
 {
 	_req->data = tmpl_data_new();
 	tmpl_data_set_variable(_req->data, "CURRENT_PAGE", _req->path_info);
-	if (_req->page_info->descr) {
+	struct md_mmap *descr = page_info_descr(_req->page_info);
+	if (descr) {
 		void	*data;
 		size_t	 size;
-		md_mmap_content(_req->page_info->descr, &data, &size);
+		md_mmap_content(descr, &data, &size);
 
-		tmpl_data_set_variablen(_req->data, "DESCR", data, size);
+		tmpl_data_set_variable_ref(_req->data, "DESCR", data, size);
 	}
 
 	return _req->data;
@@ -474,7 +1198,7 @@ request_init_tmpl_data(struct request *_req)
 bool
 request_handle_login(struct request *_req)
 {
-	if (! _req->page_info->login)
+	if (! page_info_has(_req->page_info, PAGE_LOGIN))
 		return true;
 
 	request_parse_cookies(_req);
@@ -532,34 +1256,29 @@ request_handle_login(struct request *_req)
 		}
 	}
 	if (!_req->session->data.loggedin) {
-		_req->content = _req->page_info->login;
+		// Never fall back to the protected content
+		_req->content = page_info_login(_req->page_info);
+		if (_req->content == NULL)
+			_error("500 Internal Server Error", NULL);
 	}
 
-	return (_req->content == _req->page_info->content);
+	return _req->session->data.loggedin;
 }
 
 
-struct buffer_list *
-request_render_page(struct request *_req, const char *_tmpl_filename)
+/*
+ * Adds the content and the navigation, which the template usually needs
+ * only after the head of the page.
+ */
+void
+_request_fill_page(struct request *_req)
 {
-	struct buffer_list *cb;
-	struct buffer_list *result = NULL;
+	void	*data;
+	size_t	 size;
 
-	if (_req->content) {
-		void	*data;
-		size_t	 size;
-		md_mmap_content(_req->content, &data, &size);
-
-		cb = tmpl_parse(data, size, _req->data);
-		tmpl_data_set_variable(_req->data, "CONTENT",
-				buffer_list_concat_string(cb));
-	} else {
-		_error("404 Not Found", NULL);
-	}
-	tmpl_data_set_variable(_req->data, "LANGUAGE", _req->lang);
-	tmpl_data_set_variablen(_req->data, "TITLE",
-			_req->page_info->title->data,
-			memmap_chomp(_req->page_info->title));
+	md_mmap_content(_req->content, &data, &size);
+	tmpl_data_move_list(_req->data, "CONTENT",
+			tmpl_parse(data, size, _req->data));
 
 	struct tmpl_loop *links = request_get_links(_req);
 	struct tmpl_loop *lang_links = request_get_language_links(_req);
@@ -567,16 +1286,103 @@ request_render_page(struct request *_req, const char *_tmpl_filename)
 		tmpl_data_set_loop(_req->data, "LINK_LOOP", links);
 	if (lang_links)
 		tmpl_data_set_loop(_req->data, "LANGUAGE_LINKS", lang_links);
+}
+
+
+/*
+ * Writes the output not sent yet, the headers go out first. There is no
+ * Content-Length, the server sends the response chunked. A compressed
+ * response is flushed to the encoder at each call.
+ */
+void
+_request_stream(struct tmpl_sink *_sink, struct buffer_list *_out)
+{
+	struct request *req = _sink->arg;
+
+	if (! req->headers_sent) {
+		struct buffer_list *hb = request_output_headers(req);
+		buffer_list_add_string(hb, "\r\n");
+		buffer_list_writev(hb, STDOUT_FILENO);
+		buffer_list_free(hb);
+		free(hb);
+		req->headers_sent = true;
+	}
+	struct buffer *b = (req->sent) ? TAILQ_NEXT(req->sent, entries)
+		: TAILQ_FIRST(&_out->buffers);
+	if (b == NULL)
+		return;
+	req->sent = TAILQ_LAST(&_out->buffers, buffer_list_head);
+	if (req->encoder == NULL) {
+		buffer_writev(b, STDOUT_FILENO);
+		return;
+	}
+
+	// The client can decode everything sent so far
+	for (; b; b = TAILQ_NEXT(b, entries))
+		encoder_add(req->encoder, b->data, b->size, req->encoded);
+	encoder_flush(req->encoder, req->encoded);
+	_request_stream_encoded(req);
+}
+
+
+void
+_request_stream_encoded(struct request *_req)
+{
+	struct buffer *b = (_req->encoded_sent)
+		? TAILQ_NEXT(_req->encoded_sent, entries)
+		: TAILQ_FIRST(&_req->encoded->buffers);
+	if (b == NULL)
+		return;
+	buffer_writev(b, STDOUT_FILENO);
+	_req->encoded_sent = TAILQ_LAST(&_req->encoded->buffers,
+			buffer_list_head);
+}
 
+
+/*
+ * Renders the page. The content and the navigation are rendered before
+ * anything is sent, so a failure can still be answered with an error
+ * status. With _stream the headers, which must be complete, go out with
+ * the head of the page and the rest follows as the template produces
+ * it, compressed in the negotiated coding. The uncompressed page is
+ * returned either way.
+ */
+struct buffer_list *
+request_render_page(struct request *_req, const char *_tmpl_filename,
+		bool _stream)
+{
+	// Everything that can fail is checked before the first byte is sent
+	if (_req->content == NULL)
+		_req->content = page_info_content(_req->page_info);
+	if (_req->content == NULL)
+		_error("404 Not Found", NULL);
+	struct memmap *title = page_info_title(_req->page_info);
+	if (title == NULL)
+		_error("500 Internal Server Error", NULL);
 	_req->tmpl_file = memmap_new_at(_req->template_dir, _tmpl_filename);
 	if (_req->tmpl_file == NULL)
 		_error("500 Internal Server Error", NULL);
-	result = tmpl_parse(_req->tmpl_file->data, _req->tmpl_file->size,
-			_req->data);
-
-	buffer_list_free(cb);
 
-	return result;
+	tmpl_data_set_variable(_req->data, "LANGUAGE", _req->lang);
+	tmpl_data_set_variable_ref(_req->data, "TITLE", title->data,
+			memmap_chomp(title));
+	_request_fill_page(_req);
+
+	_req->sink.flush = _request_stream;
+	_req->sink.arg = _req;
+	if (_stream && _req->encoding != ENCODING_IDENTITY) {
+		request_add_encoding_header(_req);
+		_req->encoder = encoder_new(_req->encoding);
+		_req->encoded = buffer_list_new();
+	}
+	struct buffer_list *out = tmpl_parse_sink(_req->tmpl_file->data,
+			_req->tmpl_file->size, _req->data,
+			(_stream) ? &_req->sink : NULL);
+	if (_req->encoder) {
+		encoder_finish(_req->encoder, _req->encoded);
+		_request_stream_encoded(_req);
+	}
+	return out;
 }
 
 
@@ -611,6 +1417,21 @@ request_add_header(struct request *_req, const char *_key, const char *_value)
 }
 
 
+void
+request_set_header(struct request *_req, const char *_key, const char *_value)
+{
+	struct header *h;
+	TAILQ_FOREACH(h, &_req->headers, entries) {
+		if (strcasecmp(h->key, _key) == 0) {
+			free(h->value);
+			h->value = strdup(_value);
+			return;
+		}
+	}
+	request_add_header(_req, _key, _value);
+}
+
+
 struct buffer_list *
 request_output_headers(struct request *_req)
 {
@@ -627,6 +1448,32 @@ request_output_headers(struct request *_req)
 }
 
 
+/*
+ * Sends the headers and _body, if any, with Content-Length. The buffers of
+ * _body move into the response and go out with writev(2) uncopied. A HEAD
+ * response carries the length of _body but not the body itself.
+ */
+void
+request_output(struct request *_req, struct buffer_list *_body)
+{
+	char len[24];
+
+	if (_body) {
+		snprintf(len, sizeof(len), "%zu", _body->size);
+		request_add_header(_req, "Content-Length", len);
+	}
+	struct buffer_list *out = request_output_headers(_req);
+	buffer_list_add_string(out, "\r\n");
+	if (_req->request_method == HEAD)
+		buffer_list_free(_body);
+	else
+		buffer_list_add_list(out, _body);
+	buffer_list_writev(out, STDOUT_FILENO);
+	buffer_list_free(out);
+	free(out);
+}
+
+
 void
 request_cookie_mark_delete(struct request *_req, struct cookie *_cookie)
 {
@@ -19,9 +19,17 @@
 
 #include <sys/queue.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
 
+#include "cache.h"
+#include "catalog.h"
+#include "encoding.h"
+#include "generation.h"
 #include "helper.h"
 #include "htpasswd.h"
+#include "pack.h"
+#include "pageheader.h"
 #include "session.h"
 #include "template.h"
 
@@ -29,9 +37,45 @@ extern char *cms_content_dir;
 extern char *cms_template_dir;
 extern char *cms_session_db;
 extern char *cms_session_htpasswd;
+extern char *cms_cache_file;
+extern char *cms_catalog_file;
+extern char *cms_generation_file;
+extern char *cms_md_cache_dir;
+extern char *cms_pack_file;
+
+// Files of a page directory, a .md variant follows its plain file
+enum page_file {
+	PAGE_CONTENT,
+	PAGE_CONTENT_MD,
+	PAGE_DESCR,
+	PAGE_DESCR_MD,
+	PAGE_LINK,
+	PAGE_LOGIN,
+	PAGE_SCRIPT,
+	PAGE_SORT,
+	PAGE_SSL,
+	PAGE_STYLE,
+	PAGE_SUB,
+	PAGE_TITLE,
+	PAGE_NFILES
+};
 
+/*
+ * The directory scan only records the files of a page, every file is read
+ * on the first call of its accessor. Only for a page without a LINK file
+ * request_fetch_page() reads the page header, its fields point into
+ * header_data. Pages of a content pack have no directory.
+ */
 struct page_info {
 	char		*path;
+	int		 dir;
+	struct dir_entry *files[PAGE_NFILES];
+	struct pack	*pack;
+	uint32_t	 pack_page;
+	uint32_t	 present;
+	uint32_t	 loaded;
+	struct page_header header;
+	char		*header_data;
 
 	struct md_mmap	*content;
 	struct md_mmap	*descr;
@@ -46,6 +90,16 @@ struct page_info {
 };
 
 
+
+struct page_validator {
+	uint64_t	 etag;
+	uint64_t	 access;	// LOGIN, 0 for a public page
+	time_t		 newest;
+	time_t		 changed;
+	bool		 login;
+};
+
+
 struct lang_pref {
 	TAILQ_ENTRY(lang_pref)	entries;
 	float			priority;
@@ -79,7 +133,7 @@ struct cookie {
 
 
 enum request_method {
-	GET = 0, POST, INVALID
+	GET = 0, POST, HEAD, INVALID
 };
 
 
@@ -94,12 +148,24 @@ struct request {
 	char			*lang;
 	char			*path;
 
+	struct dir_list		*page_files;
 	struct page_info	*page_info;
 	struct tmpl_data	*data;
 	struct md_mmap		*content;
 
 	struct memmap		*tmpl_file;
 
+	// Sends the page while it is rendered
+	struct tmpl_sink	 sink;
+	struct buffer		*sent;
+	bool			 headers_sent;
+
+	// A compressed page keeps its whole encoded output for the cache
+	enum content_encoding	 encoding;
+	struct encoder		*encoder;
+	struct buffer_list	*encoded;
+	struct buffer		*encoded_sent;
+
 	int			 status_code;
 	int			 request_method;
 	char			*status;
@@ -111,6 +177,16 @@ struct request {
 
 	struct dir_list		*avail_languages;
 
+	struct pack		*pack;
+	struct catalog		*catalog;
+	struct catalog_lang	*catalog_lang;
+	const uint64_t		*page_langs;
+	struct generation	*generations;
+	struct cache		*cache;
+	uint64_t		 nav_validator;
+	// The LINK_LOOP borrows its values from the navigation rows
+	void			*nav_rows;
+
 	struct session		*session;
 	struct session_store	*session_store;
 
@@ -126,14 +202,34 @@ void			 lang_pref_free(struct lang_pref *);
 
 
 struct request		*request_new(char *_page_uri);
+bool			 request_open(struct request *);
+uint64_t		 request_negative_validator(struct request *);
 void			 request_free(struct request *);
 
 
-struct page_info	*page_info_new(char *_path);
+struct page_info	*page_info_new(char *_path, int);
 void			 page_info_free(struct page_info *);
+bool			 page_info_has(struct page_info *, enum page_file);
+struct md_mmap		*page_info_content(struct page_info *);
+struct md_mmap		*page_info_descr(struct page_info *);
+struct md_mmap		*page_info_login(struct page_info *);
+struct memmap		*page_info_link(struct page_info *);
+struct memmap		*page_info_script(struct page_info *);
+struct memmap		*page_info_sort(struct page_info *);
+struct memmap		*page_info_style(struct page_info *);
+struct memmap		*page_info_title(struct page_info *);
 
 
 struct page_info	*request_fetch_page(struct request *);
+bool			 request_validate(struct request *, const char *,
+		struct page_validator *);
+void			 request_check_modified(struct request *,
+		struct page_validator *);
+void			 request_add_validator_headers(struct request *,
+		struct page_validator *);
+char			*request_cache_key(struct request *);
+void			 request_negotiate_encoding(struct request *);
+void			 request_add_encoding_header(struct request *);
 struct tmpl_loop	*fetch_language_links(struct request *);
 struct tmpl_loop	*fetch_links(struct request *);
 
@@ -146,7 +242,10 @@ struct header		*header_new(const char *, const char *);
 void			 header_free(struct header *);
 void			 request_add_header(struct request *, const char *,
 		const char *);
+void			 request_set_header(struct request *, const char *,
+		const char *);
 struct buffer_list *	 request_output_headers(struct request *);
+void			 request_output(struct request *, struct buffer_list *);
 
 struct cookie		*cookie_new(const char *, const char *);
 void			 cookie_free(struct cookie *);
@@ -172,7 +271,8 @@ struct param		*request_get_param(struct request *, const char *,
 		struct param *);
 bool			 request_read_post_body(struct request *);
 bool			 request_handle_login(struct request *);
-struct buffer_list	*request_render_page(struct request *, const char *);
+struct buffer_list	*request_render_page(struct request *, const char *,
+		bool);
 
 __dead void		 _error(const char *, const char *);
 
@@ -18,23 +18,52 @@
 #include <sys/queue.h>
 #include <sys/stat.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <err.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <lowdown.h>
 
+#include "filehelper.h"
 #include "helper.h"
 
-static struct memmap	*_map_fd(int);
+#ifndef CMS_LOWDOWN_VERSION
+#define CMS_LOWDOWN_VERSION	""
+#endif
+
+// Age in seconds of a temporary file in the markdown cache that is
+// assumed to be left behind
+#define MD_CACHE_TMP_AGE	3600
+
+struct _md_keys {
+	uint64_t	*v;
+	size_t		 n;
+	size_t		 size;
+};
+
+static struct memmap	*_map_fd(int, struct stat *);
+static uint64_t		 _md_key(struct stat *);
+static void		 _md_cache_name(struct md_mmap *, char *, size_t);
+static bool		 _md_cache_load(struct md_mmap *);
+static void		 _md_cache_store(struct md_mmap *);
+static int		 _md_key_cmp(const void *, const void *);
+static void		 _md_keys_add(struct _md_keys *, int, const char *);
+static void		 _md_keys_scan(struct _md_keys *, int, int);
 static char		 decode_hexdigit(const char *);
 static bool		 ishexdigit(const int);
 static const char	*_get_file_extension(const char *);
 
+// Directory of the converted markdown files, see md_cache_open()
+static int		 md_cache_dir = -1;
+static char		 md_cache_path[PATH_MAX];
+
 
 const char *
 rx_get_errormsg(int _rc, regex_t *_rx)
@@ -55,20 +84,54 @@ _get_file_extension(const char *_filename)
 }
 
 
+/*
+ * Loads the file _fd and closes it. The small metadata files are read with
+ * a single read(2) into the same allocation as the memmap, which saves the
+ * mapping and the page fault, larger files are mapped. The data of a read
+ * file is NUL terminated.
+ */
 struct memmap *
-_map_fd(int _fd)
+_map_fd(int _fd, struct stat *_sb)
 {
+	struct memmap *mm;
 	struct stat sb;
 	if (-1 == fstat(_fd, &sb))
 		err(1, NULL);
+	if (_sb)
+		*_sb = sb;
+
+	if (sb.st_size <= MEMMAP_READ_MAX) {
+		mm = malloc(sizeof(struct memmap) + sb.st_size + 1);
+		if (NULL == mm)
+			err(1, NULL);
+		mm->data = mm + 1;
+		mm->mapped = false;
+		ssize_t len = (sb.st_size > 0)
+			? read(_fd, mm->data, sb.st_size) : 0;
+		if (len == -1) {
+			warn("read");
+			free(mm);
+			close(_fd);
+			return NULL;
+		}
+		mm->size = len;
+		((char *)mm->data)[len] = '\0';
+		close(_fd);
+		return mm;
+	}
 
-	struct memmap *mm = malloc(sizeof(struct memmap));
+	mm = malloc(sizeof(struct memmap));
 	if (NULL == mm)
 		err(1, NULL);
 	mm->size = sb.st_size;
-
+	mm->mapped = true;
 	mm->data = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, _fd, 0);
 	close(_fd);
+	if (mm->data == MAP_FAILED) {
+		warn("mmap");
+		free(mm);
+		return NULL;
+	}
 	return mm;
 }
 
@@ -82,7 +145,7 @@ memmap_new(const char *_filename)
 		return NULL;
 	}
 
-	return _map_fd(fd);
+	return _map_fd(fd, NULL);
 }
 
 
@@ -95,14 +158,31 @@ memmap_new_at(int _fd, const char *_filename)
 		return NULL;
 	}
 
-	return _map_fd(fd);
+	return _map_fd(fd, NULL);
+}
+
+
+/*
+ * Returns a memmap for data owned by someone else, memmap_free() only frees
+ * the memmap itself.
+ */
+struct memmap *
+memmap_new_ref(const void *_data, size_t _size)
+{
+	struct memmap *mm = malloc(sizeof(struct memmap));
+	if (mm == NULL)
+		err(1, NULL);
+	mm->data = (void *)(uintptr_t)_data;
+	mm->size = _size;
+	mm->mapped = false;
+	return mm;
 }
 
 
 void
 memmap_free(struct memmap *_map)
 {
-	if (_map && _map->data)
+	if (_map && _map->mapped)
 		munmap(_map->data, _map->size);
 	free(_map);
 }
@@ -123,7 +203,14 @@ memmap_chomp(struct memmap *_m)
 struct md_mmap *
 md_mmap_new(const char *_filename)
 {
-	struct memmap *mmap = memmap_new(_filename);
+	struct stat sb;
+	int fd = open(_filename, O_RDONLY);
+	if (-1 == fd) {
+		warn("open(%s) in %s", _filename, __func__);
+		return NULL;
+	}
+
+	struct memmap *mmap = _map_fd(fd, &sb);
 	if (mmap == NULL)
 		return NULL;
 
@@ -132,6 +219,7 @@ md_mmap_new(const char *_filename)
 		err(1, NULL);
 	mdbuf->mmap = mmap;
 	mdbuf->md = (strcmp("md", _get_file_extension(_filename)) == 0);
+	mdbuf->key = _md_key(&sb);
 	return mdbuf;
 }
 
@@ -145,7 +233,8 @@ md_mmap_new_at(int _fd, const char *_filename)
 		return NULL;
 	}
 
-	struct memmap *mmap = _map_fd(fd);
+	struct stat sb;
+	struct memmap *mmap = _map_fd(fd, &sb);
 	if (mmap == NULL)
 		return NULL;
 
@@ -154,6 +243,7 @@ md_mmap_new_at(int _fd, const char *_filename)
 		err(1, NULL);
 	mdbuf->mmap = mmap;
 	mdbuf->md = (strcmp("md", _get_file_extension(_filename)) == 0);
+	mdbuf->key = _md_key(&sb);
 	return mdbuf;
 }
 
@@ -174,7 +264,9 @@ md_mmap_free(struct md_mmap *_md)
 {
 	if (_md) {
 		memmap_free(_md->mmap);
+		memmap_free(_md->cached);
 		free(_md->html);
+		free(_md);
 	}
 }
 
@@ -187,21 +279,244 @@ static const struct lowdown_opts ldopts = {
 };
 
 
+/*
+ * Identifies the converted HTML of a markdown file, a change of the file,
+ * of the lowdown options or of the lowdown version gives a new key. 0
+ * means unknown.
+ */
+uint64_t
+_md_key(struct stat *_sb)
+{
+	uint64_t key = hash_fnv1a(HASH_FNV1A_INIT, &_sb->st_dev,
+			sizeof(_sb->st_dev));
+	key = hash_fnv1a(key, &_sb->st_ino, sizeof(_sb->st_ino));
+	key = hash_fnv1a(key, &_sb->st_mtim, sizeof(_sb->st_mtim));
+	key = hash_fnv1a(key, &_sb->st_size, sizeof(_sb->st_size));
+	key = hash_fnv1a(key, &ldopts.type, sizeof(ldopts.type));
+	key = hash_fnv1a(key, &ldopts.feat, sizeof(ldopts.feat));
+	key = hash_fnv1a(key, &ldopts.oflags, sizeof(ldopts.oflags));
+	key = hash_fnv1a(key, CMS_LOWDOWN_VERSION,
+			sizeof(CMS_LOWDOWN_VERSION));
+	return (key != 0) ? key : 1;
+}
+
+
+/*
+ * Keeps the HTML lowdown produces as one file per markdown file in _dir.
+ * Without the directory every markdown file is converted on each request.
+ */
+void
+md_cache_open(const char *_dir)
+{
+	if (md_cache_dir != -1)
+		return;
+	md_cache_dir = open(_dir, O_DIRECTORY | O_RDONLY);
+	if (strlcpy(md_cache_path, _dir, sizeof(md_cache_path))
+			>= sizeof(md_cache_path)) {
+		close(md_cache_dir);
+		md_cache_dir = -1;
+	}
+}
+
+
+/*
+ * The size of the page header skipped before the conversion follows the
+ * key in the name.
+ */
+void
+_md_cache_name(struct md_mmap *_md, char *_name, size_t _size)
+{
+	snprintf(_name, _size, "%016llx-%zx.html", (unsigned long long)_md->key,
+			_md->skip);
+}
+
+
+bool
+_md_cache_load(struct md_mmap *_md)
+{
+	char name[48];
+
+	if (md_cache_dir == -1 || _md->key == 0)
+		return false;
+	_md_cache_name(_md, name, sizeof(name));
+	int fd = openat(md_cache_dir, name, O_RDONLY);
+	if (fd == -1)
+		return false;
+	_md->cached = _map_fd(fd, NULL);
+	return (_md->cached != NULL);
+}
+
+
+/*
+ * Writes the converted HTML under a temporary name and renames it, readers
+ * never see a partly written file.
+ */
+void
+_md_cache_store(struct md_mmap *_md)
+{
+	char name[48], path[PATH_MAX], tmpname[PATH_MAX];
+
+	if (md_cache_dir == -1 || _md->key == 0 || _md->html == NULL)
+		return;
+	_md_cache_name(_md, name, sizeof(name));
+	if ((size_t)snprintf(path, sizeof(path), "%s/%s", md_cache_path,
+				name) >= sizeof(path)
+			|| (size_t)snprintf(tmpname, sizeof(tmpname),
+				"%s.XXXXXXXXXX", path) >= sizeof(tmpname))
+		return;
+	int fd = mkstemp(tmpname);
+	if (fd == -1)
+		return;
+	for (size_t off = 0; off < _md->htmlsz; ) {
+		ssize_t len = write(fd, _md->html + off, _md->htmlsz - off);
+		if (len == -1) {
+			warn("%s", tmpname);
+			close(fd);
+			unlink(tmpname);
+			return;
+		}
+		off += len;
+	}
+	if (fchmod(fd, 0644) == -1 || rename(tmpname, path) == -1) {
+		warn("%s", path);
+		unlink(tmpname);
+	}
+	close(fd);
+}
+
+
+int
+_md_key_cmp(const void *_a, const void *_b)
+{
+	const uint64_t a = *(const uint64_t *)_a, b = *(const uint64_t *)_b;
+	return (a > b) - (a < b);
+}
+
+
+void
+_md_keys_add(struct _md_keys *_k, int _fd, const char *_name)
+{
+	struct stat sb;
+	size_t len = strlen(_name);
+
+	if (len < 3 || strcmp(_name + len - 3, ".md") != 0
+			|| fstatat(_fd, _name, &sb, 0) == -1)
+		return;
+	if (_k->n == _k->size) {
+		_k->size = (_k->size) ? _k->size * 2 : 256;
+		_k->v = reallocarray(_k->v, _k->size, sizeof(uint64_t));
+		if (_k->v == NULL)
+			err(1, NULL);
+	}
+	_k->v[_k->n++] = _md_key(&sb);
+}
+
+
+/*
+ * Collects the keys of the markdown files below the directory _fd, down
+ * to _depth levels of directories (language and page).
+ */
+void
+_md_keys_scan(struct _md_keys *_k, int _fd, int _depth)
+{
+	struct dirent *dirent;
+
+	int dfd = dir_reopen(_fd);
+	DIR *dir = (dfd == -1) ? NULL : fdopendir(dfd);
+	if (dir == NULL) {
+		if (dfd != -1)
+			close(dfd);
+		return;
+	}
+	while ((dirent = readdir(dir)) != NULL) {
+		if (dirent->d_name[0] == '.')
+			continue;
+		if (_depth == 0) {
+			_md_keys_add(_k, _fd, dirent->d_name);
+			continue;
+		}
+		int fd = openat(_fd, dirent->d_name, O_DIRECTORY | O_RDONLY);
+		if (fd == -1)
+			continue;
+		_md_keys_scan(_k, fd, _depth - 1);
+		close(fd);
+	}
+	closedir(dir);
+}
+
+
+/*
+ * Removes the converted files of markdown files below _content_dir that
+ * have changed or no longer exist, and temporary files left behind.
+ * Returns the number of files removed, -1 on error.
+ */
+int
+md_cache_expire(const char *_dir, const char *_content_dir)
+{
+	struct _md_keys keys = { NULL, 0, 0 };
+	struct dirent *dirent;
+	struct stat sb;
+	int removed = 0;
+
+	int cfd = open(_content_dir, O_DIRECTORY | O_RDONLY);
+	if (cfd == -1) {
+		warn("%s", _content_dir);
+		return -1;
+	}
+	_md_keys_scan(&keys, cfd, 2);
+	close(cfd);
+	qsort(keys.v, keys.n, sizeof(uint64_t), _md_key_cmp);
+
+	DIR *dir = opendir(_dir);
+	if (dir == NULL) {
+		warn("%s", _dir);
+		free(keys.v);
+		return -1;
+	}
+	time_t now = time(NULL);
+	while ((dirent = readdir(dir)) != NULL) {
+		if (dirent->d_name[0] == '.')
+			continue;
+		bool keep = false;
+		char *ep;
+		const char *suffix = strrchr(dirent->d_name, '.');
+		uint64_t key = strtoull(dirent->d_name, &ep, 16);
+		if (suffix && strcmp(suffix, ".html") == 0 && *ep == '-')
+			keep = (bsearch(&key, keys.v, keys.n, sizeof(uint64_t),
+					_md_key_cmp) != NULL);
+		else if (fstatat(dirfd(dir), dirent->d_name, &sb, 0) == 0)
+			keep = (now - sb.st_mtim.tv_sec < MD_CACHE_TMP_AGE);
+		if (! keep && unlinkat(dirfd(dir), dirent->d_name, 0) == 0)
+			removed++;
+	}
+	closedir(dir);
+	free(keys.v);
+	return removed;
+}
+
+
 void
 md_mmap_parse(struct md_mmap *_md)
 {
-	if (_md && _md->md)
-		lowdown_buf(&ldopts, _md->mmap->data, _md->mmap->size,
-				&(_md->html), &(_md->htmlsz), NULL);
+	if (_md == NULL || ! _md->md || _md_cache_load(_md))
+		return;
+	lowdown_buf(&ldopts, (char *)_md->mmap->data + _md->skip,
+			_md->mmap->size - _md->skip, &(_md->html), &(_md->htmlsz),
+			NULL);
+	_md_cache_store(_md);
 }
 
 
 void
 md_mmap_content(struct md_mmap *_md, void **_data, size_t *_size)
 {
-	if (_md) {
-		*_data = _md->md ? _md->html : _md->mmap->data;
-		*_size = _md->md ? _md->htmlsz : _md->mmap->size;
+	if (_md && _md->cached) {
+		*_data = _md->cached->data;
+		*_size = _md->cached->size;
+	} else if (_md) {
+		*_data = _md->md ? _md->html
+			: (char *)_md->mmap->data + _md->skip;
+		*_size = _md->md ? _md->htmlsz : _md->mmap->size - _md->skip;
 	} else {
 		*_data = NULL;
 		*_size = 0;
@@ -235,6 +550,89 @@ decode_hexdigit(const char *_s)
 }
 
 
+uint64_t
+hash_fnv1a(uint64_t _hash, const void *_data, size_t _len)
+{
+	const unsigned char *p = _data;
+	while (_len-- > 0) {
+		_hash ^= *p++;
+		_hash *= 0x100000001b3ULL;
+	}
+	return _hash;
+}
+
+
+/*
+ * Hashes the name and the stat data of a file, a NULL _sb hashes the name
+ * only. The hashes of the files of a directory are summed up, so the
+ * result does not depend on readdir order.
+ */
+uint64_t
+hash_stat(const char *_name, const struct stat *_sb)
+{
+	uint64_t h = hash_fnv1a(HASH_FNV1A_INIT, _name, strlen(_name) + 1);
+	if (_sb) {
+		h = hash_fnv1a(h, &_sb->st_ino, sizeof(_sb->st_ino));
+		h = hash_fnv1a(h, &_sb->st_mtim, sizeof(_sb->st_mtim));
+		h = hash_fnv1a(h, &_sb->st_size, sizeof(_sb->st_size));
+	}
+	return h;
+}
+
+
+/*
+ * Formats the strong entity tag for _etag. Each content coding of a
+ * representation needs its own tag, a _coding other than NULL is
+ * appended to it.
+ */
+void
+format_etag(char *_buf, size_t _size, uint64_t _etag, const char *_coding)
+{
+	snprintf(_buf, _size, "\"%016llx%s%s\"", (unsigned long long)_etag,
+			(_coding) ? "-" : "", (_coding) ? _coding : "");
+}
+
+
+/*
+ * Weak comparison of the entity tags in an If-None-Match header value
+ * with the quoted tag _etag. The value "*" is left to the caller, it
+ * matches any existing representation.
+ */
+bool
+etag_match(const char *_header, const char *_etag)
+{
+	size_t len = strlen(_etag);
+	const char *s = _header;
+
+	while (*s != '\0') {
+		while (*s == ' ' || *s == '\t' || *s == ',')
+			s++;
+		if (strncmp(s, "W/", 2) == 0)
+			s += 2;
+		if (strncmp(s, _etag, len) == 0
+				&& (s[len] == '\0' || s[len] == ','
+					|| s[len] == ' ' || s[len] == '\t'))
+			return true;
+		while (*s != '\0' && *s != ',')
+			s++;
+	}
+	return false;
+}
+
+
+/*
+ * Checks for the If-None-Match value "*".
+ */
+bool
+etag_match_any(const char *_header)
+{
+	const char *s = _header + strspn(_header, " \t");
+	if (*s++ != '*')
+		return false;
+	return (s[strspn(s, " \t")] == '\0');
+}
+
+
 void
 decode_string(char *_s)
 {
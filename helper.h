@@ -16,27 +16,47 @@
 #ifndef __HELPER_H__
 #define __HELPER_H__
 
+#include <sys/stat.h>
 #include <regex.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+#define HASH_FNV1A_INIT	0xcbf29ce484222325ULL
+
+#define ETAG_LEN	32
+#define HTTP_DATE_FMT	"%a, %d %b %Y %H:%M:%S GMT"
+
+// Files up to this size are read instead of mapped
+#define MEMMAP_READ_MAX	16384
 
 struct memmap {
 	void	*data;
 	size_t	 size;
+	bool	 mapped;
 };
 
 struct md_mmap {
 	struct memmap	*mmap;
 	bool		 md;
+	size_t		 skip;		// page header before the content
+	uint64_t	 key;
 	char		*html;
 	size_t		 htmlsz;
+	struct memmap	*cached;
 };
 
 const char	*rx_get_errormsg(int, regex_t *);
 
 void		 decode_string(char *);
+uint64_t	 hash_fnv1a(uint64_t, const void *, size_t);
+uint64_t	 hash_stat(const char *, const struct stat *);
+void		 format_etag(char *, size_t, uint64_t, const char *);
+bool		 etag_match(const char *, const char *);
+bool		 etag_match_any(const char *);
 
 struct memmap	*memmap_new(const char *);
 struct memmap	*memmap_new_at(int, const char *);
+struct memmap	*memmap_new_ref(const void *, size_t);
 void		 memmap_free(struct memmap *);
 size_t		 memmap_chomp(struct memmap *);
 struct md_mmap	*md_mmap_new(const char *);
@@ -45,5 +65,7 @@ struct md_mmap	*md_mmap_new_from_memmap(struct memmap *);
 void		 md_mmap_free(struct md_mmap *);
 void		 md_mmap_parse(struct md_mmap *);
 void		 md_mmap_content(struct md_mmap *, void **, size_t *);
+void		 md_cache_open(const char *);
+int		 md_cache_expire(const char *, const char *);
 
 #endif // __HELPER_H__
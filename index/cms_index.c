@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2018 Markus Hennecke <markus-hennecke@markus-hennecke.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <sys/stat.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "catalog.h"
+#include "helper.h"
+
+#ifndef CMS_CONTENT_DIR
+#error "Need CMS_CONTENT_DIR defined to compile"
+#endif
+#ifndef CMS_CATALOG_FILE
+#error "Need CMS_CATALOG_FILE defined to compile"
+#endif
+#ifndef CMS_MD_CACHE_DIR
+#error "Need CMS_MD_CACHE_DIR defined to compile"
+#endif
+
+static __dead void	usage(void);
+
+__dead void
+usage(void)
+{
+	extern char *__progname;
+
+	dprintf(STDERR_FILENO, "usage: %s [-m md_cache_dir] [-o catalog] "
+			"[content_dir]\n", __progname);
+	exit(1);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	char *content_dir = CMS_CHROOT CMS_CONTENT_DIR;
+	char *catalog_file = CMS_CHROOT CMS_CATALOG_FILE;
+	char *md_cache_dir = CMS_CHROOT CMS_MD_CACHE_DIR;
+	struct stat sb;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "m:o:")) != -1) {
+		switch (ch) {
+		case 'm':
+			md_cache_dir = optarg;
+			break;
+		case 'o':
+			catalog_file = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc > 1)
+		usage();
+	if (argc == 1)
+		content_dir = argv[0];
+
+	if (! catalog_write(content_dir, catalog_file))
+		errx(1, "unable to write %s", catalog_file);
+	// Drop the HTML of markdown files that have changed since
+	if (stat(md_cache_dir, &sb) == 0
+			&& md_cache_expire(md_cache_dir, content_dir) == -1)
+		errx(1, "unable to clean up %s", md_cache_dir);
+	return EXIT_SUCCESS;
+}
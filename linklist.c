@@ -20,93 +20,227 @@
 #include <dirent.h>
 #include <err.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "buffer.h"
+#include "cache.h"
+#include "catalog.h"
 #include "filehelper.h"
 #include "handler.h"
 #include "helper.h"
+#include "pageheader.h"
 #include "template.h"
 
 struct _link {
-	TAILQ_ENTRY(_link)	 entries;
 	struct memmap		*link;
 	struct memmap		*descr;
 	struct memmap		*sort;
+	const char		*text;
+	size_t			 textlen;
+	const char		*nr;
+	size_t			 nrlen;
+	const char		*descrtext;
+	size_t			 descrlen;
 	bool			 sub;
 	bool			 ssl;
 	char			*linkname;
-	bool			 selected;
+	char			*header;	// start of the content
+};
+
+// A top-level entry and the SUB entries following it
+struct _link_topic {
+	struct _link		 *link;
+	struct _link		**subs;
+	size_t			  nsubs;
 };
 
 struct _link_list {
-	TAILQ_HEAD(, _link)	 links;
+	struct _link		**links;
+	size_t			  nlinks;
+	size_t			  size;
+	struct _link_topic	 *topics;
+	size_t			  ntopics;
+};
+
+/*
+ * The navigation of a language as stored in the render cache:
+ *
+ *	struct _link_rows_header
+ *	struct _link_rows_topic	[ntopics]	navigation order
+ *	struct _link_rows_name	[nlinks]	sorted by page name
+ *	rows
+ *
+ * A row is a flags byte followed by the fields name, NR, DESCR, LINK and
+ * JSLINK, each one a 32 bit length and the data. Offsets are relative to
+ * the first row. The page name index leads to the topic of the current
+ * page, only the SUB rows of that topic are turned into loop entries.
+ */
+#define LINK_ROW_SUB		0x01
+#define LINK_ROW_FIELDS		5
+
+enum _link_row_field {
+	LINK_ROW_NAME, LINK_ROW_NR, LINK_ROW_DESCR, LINK_ROW_LINK,
+	LINK_ROW_JSLINK
+};
+
+struct _link_row {
+	uint8_t		 flags;
+	const char	*field[LINK_ROW_FIELDS];
+	uint32_t	 len[LINK_ROW_FIELDS];
+};
+
+struct _link_rows_header {
+	uint32_t	ntopics;
+	uint32_t	nlinks;
+};
+
+struct _link_rows_topic {
+	uint32_t	off;	// topic row
+	uint32_t	end;	// end of its last SUB row
+};
+
+struct _link_rows_name {
+	uint32_t	off;
+	uint32_t	topic;
+};
+
+struct _link_rows {
+	struct _link_rows_header	 header;
+	const char			*topics;
+	const char			*names;
+	const char			*data;
+	size_t				 size;
+};
+
+// Entry of the page name index while it is sorted
+struct _link_name {
+	const char		*name;
+	struct _link_rows_name	 entry;
 };
 
 static void			 _link_free(struct _link *);
 static struct _link		*_link_new_at(int, char *);
-static struct tmpl_data		*_link_get_tmpl_data(struct _link *,
-		struct request *, bool);
-static int			 _link_cmp(struct _link *, struct _link *);
-static void			 _link_list_insert_link(struct _link_list *,
+static void			 _link_add_field(struct buffer_list *,
+		const char *, size_t);
+static void			 _link_add_row(struct _link *,
+		struct request *, struct buffer_list *);
+static size_t			 _link_parse_row(const char *, size_t,
+		struct _link_row *);
+static bool			 _link_rows_open(struct _link_rows *,
+		const char *, size_t);
+static struct _link_rows_topic	 _link_rows_topic(struct _link_rows *,
+		uint32_t);
+static struct _link_rows_name	 _link_rows_name(struct _link_rows *,
+		uint32_t);
+static uint32_t			 _link_rows_find(struct _link_rows *,
+		const char *);
+static struct tmpl_data		*_link_row_data(struct _link_row *, bool);
+static struct tmpl_loop		*_link_rows_loop(const char *, size_t,
+		struct request *);
+static int			 _link_name_cmp(const void *, const void *);
+static struct buffer_list	*_link_list_rows(struct request *);
+static int			 _link_cmp(const void *, const void *);
+static void			 _link_list_add(struct _link_list *,
 		struct _link *);
+static void			 _link_list_group(struct _link_list *);
 static void			 _link_list_free(struct _link_list *);
-static struct _link_list	*_link_list_new_at(int, char *);
-static void			 _link_list_remove_unselected_subs(
-		struct _link_list *_lst);
+static struct _link_list	*_link_list_new(void);
+static struct _link_list	*_link_list_new_at(int);
+static struct _link_list	*_link_list_new_catalog(struct catalog *,
+		struct catalog_lang *);
+static void			 _language_link_add(struct tmpl_loop *,
+		struct request *, const char *);
 
+/*
+ * Orders by the SORT values, a value before the longer ones it is a prefix
+ * of, entries with an equal SORT value by name.
+ */
 int
-_link_cmp(struct _link *_a, struct _link *_b)
+_link_cmp(const void *_a, const void *_b)
 {
-	size_t cmplen = (_a->sort->size <= _b->sort->size)
-		? _a->sort->size : _b->sort->size;
-	int result = strncmp((char *)_a->sort->data, (char *)_b->sort->data,
-			cmplen);
+	const struct _link *a = *(struct _link * const *)_a;
+	const struct _link *b = *(struct _link * const *)_b;
+	size_t cmplen = (a->nrlen <= b->nrlen) ? a->nrlen : b->nrlen;
+	int result = strncmp(a->nr, b->nr, cmplen);
+	if (result == 0)
+		result = (a->nrlen > b->nrlen) - (a->nrlen < b->nrlen);
+	if (result == 0)
+		result = strcmp(a->linkname, b->linkname);
 
 	return result;
 }
 
 
 void
-_link_list_insert_link(struct _link_list *_lst, struct _link *_link)
+_link_list_add(struct _link_list *_lst, struct _link *_link)
 {
-	struct _link *l = TAILQ_FIRST(&_lst->links);
-	while (l) {
-		int cmp = _link_cmp(_link, l);
-		if (cmp > 0) {
-			l = TAILQ_NEXT(l, entries);
-		} else  {
-			TAILQ_INSERT_BEFORE(l, _link, entries);
-			return;
-		}
+	if (_lst->nlinks == _lst->size) {
+		_lst->size = (_lst->size) ? _lst->size * 2 : 64;
+		_lst->links = reallocarray(_lst->links, _lst->size,
+				sizeof(struct _link *));
+		if (_lst->links == NULL)
+			err(1, NULL);
 	}
-	TAILQ_INSERT_TAIL(&_lst->links, _link, entries);
+	_lst->links[_lst->nlinks++] = _link;
 }
 
 
+/*
+ * Builds the topics from the sorted links. SUB entries at the start of
+ * the list belong to the first one.
+ */
 void
-_link_list_free(struct _link_list *_lst)
+_link_list_group(struct _link_list *_lst)
 {
-	struct _link *l;
-	while ((l = TAILQ_FIRST(&_lst->links))) {
-		TAILQ_REMOVE(&_lst->links, l, entries);
-		_link_free(l);
+	_lst->topics = calloc(_lst->nlinks ? _lst->nlinks : 1,
+			sizeof(struct _link_topic));
+	if (_lst->topics == NULL)
+		err(1, NULL);
+	for (size_t i = 0; i < _lst->nlinks; i++) {
+		struct _link *l = _lst->links[i];
+		if (i == 0 || ! l->sub) {
+			struct _link_topic *t = &_lst->topics[_lst->ntopics++];
+			t->link = l;
+			t->subs = &_lst->links[i + 1];
+		} else
+			_lst->topics[_lst->ntopics - 1].nsubs++;
 	}
+}
+
+
+void
+_link_list_free(struct _link_list *_lst)
+{
+	for (size_t i = 0; i < _lst->nlinks; i++)
+		_link_free(_lst->links[i]);
+	free(_lst->links);
+	free(_lst->topics);
 	free(_lst);
 }
 
 
 struct _link_list *
-_link_list_new_at(int _fd, char *_cur_page)
+_link_list_new(void)
+{
+	struct _link_list *lst = calloc(1, sizeof(struct _link_list));
+	if (lst == NULL)
+		err(1, NULL);
+	return lst;
+}
+
+
+struct _link_list *
+_link_list_new_at(int _fd)
 {
 	struct dirent *dirent;
-	struct _link_list *lst = malloc(sizeof(struct _link_list));
-	TAILQ_INIT(&lst->links);
+	struct _link_list *lst = _link_list_new();
 
-	int dirfd = dup(_fd);
+	int dirfd = dir_reopen(_fd);
 	if (dirfd == -1)
 		err(1, NULL);
 	DIR *dir = fdopendir(dirfd);
@@ -115,18 +249,52 @@ _link_list_new_at(int _fd, char *_cur_page)
 			if (dirent->d_name[0] == '.')
 				continue;
 			struct _link *l = _link_new_at(_fd, dirent->d_name);
-			if (l != NULL) {
-				l->selected = (strcmp(l->linkname,
-							_cur_page) == 0);
-				_link_list_insert_link(lst, l);
-			}
+			if (l != NULL)
+				_link_list_add(lst, l);
 		}
 		closedir(dir);
 	} else {
 		free(lst);
-		lst = NULL;
+		return NULL;
 	}
 
+	qsort(lst->links, lst->nlinks, sizeof(struct _link *), _link_cmp);
+	_link_list_group(lst);
+	return lst;
+}
+
+
+/*
+ * Builds the list from the content catalog, the pages are already in
+ * navigation order.
+ */
+struct _link_list *
+_link_list_new_catalog(struct catalog *_c, struct catalog_lang *_cl)
+{
+	struct _link_list *lst = _link_list_new();
+
+	struct catalog_page *pages = catalog_lang_pages(_c, _cl);
+	for (uint32_t i = 0; i < _cl->npages; i++) {
+		struct catalog_page *p = &pages[i];
+		if ((p->flags & CATALOG_NAV) == 0)
+			continue;
+		struct _link *l = calloc(1, sizeof(struct _link));
+		if (l == NULL)
+			err(1, NULL);
+		l->text = catalog_str(_c, &p->link);
+		l->textlen = p->link.len;
+		l->nr = catalog_str(_c, &p->sort);
+		l->nrlen = p->sort.len;
+		l->descrtext = catalog_str(_c, &p->descr);
+		l->descrlen = p->descr.len;
+		l->sub = ((p->flags & CATALOG_SUB) != 0);
+		l->ssl = ((p->flags & CATALOG_SSL) != 0);
+		if ((l->linkname = strdup(catalog_str(_c, &p->name))) == NULL)
+			err(1, NULL);
+		_link_list_add(lst, l);
+	}
+
+	_link_list_group(lst);
 	return lst;
 }
 
@@ -134,36 +302,76 @@ _link_list_new_at(int _fd, char *_cur_page)
 struct _link *
 _link_new_at(int _fd, char *_dirname)
 {
+	struct page_header h;
 	struct _link *link = calloc(1, sizeof(struct _link));
+	if (link == NULL)
+		err(1, NULL);
 	int dirfd = openat(_fd, _dirname, O_RDONLY | O_DIRECTORY);
 	if (-1 == dirfd)
 		err(1, NULL);
 
-	// Try to mmap the files LINK and SORT
-	link->link = memmap_new_at(dirfd, "LINK");
-	if (link->link == NULL)
-		goto bailout;
-
+	// Only a page without LINK has a header, which saves reading the
+	// files DESCR and SORT
 	struct stat sb;
-	if (fstatat(dirfd, "DESCR", &sb, 0) != -1) {
-		link->descr = memmap_new_at(dirfd, "DESCR");
-		if (link->descr == NULL)
+	memset(&h, 0, sizeof(h));
+	if (fstatat(dirfd, "LINK", &sb, 0) == -1) {
+		if ((link->header = malloc(PAGE_HEADER_MAX)) == NULL)
+			err(1, NULL);
+		if (! page_header_read_at(dirfd, &h, link->header,
+					PAGE_HEADER_MAX)) {
+			free(link->header);
+			link->header = NULL;
+		}
+	}
+
+	if (h.value[PAGE_HEADER_LINK]) {
+		link->text = h.value[PAGE_HEADER_LINK];
+		link->textlen = h.len[PAGE_HEADER_LINK];
+	} else {
+		link->link = memmap_new_at(dirfd, "LINK");
+		if (link->link == NULL)
 			goto bailout;
-	} else if (fstatat(dirfd, "DESCR.md", &sb, 0) != -1) {
-		link->descr = memmap_new_at(dirfd, "DESCR.md");
-		if (link->descr == NULL)
+		link->text = link->link->data;
+		link->textlen = memmap_chomp(link->link);
+	}
+
+	if (h.value[PAGE_HEADER_DESCR]) {
+		link->descrtext = h.value[PAGE_HEADER_DESCR];
+		link->descrlen = h.len[PAGE_HEADER_DESCR];
+	} else {
+		if (fstatat(dirfd, "DESCR", &sb, 0) != -1) {
+			link->descr = memmap_new_at(dirfd, "DESCR");
+			if (link->descr == NULL)
+				goto bailout;
+		} else if (fstatat(dirfd, "DESCR.md", &sb, 0) != -1) {
+			link->descr = memmap_new_at(dirfd, "DESCR.md");
+			if (link->descr == NULL)
+				goto bailout;
+		} else {
+			warnx("unable to find DESCR or DESCR.md in %s",
+					_dirname);
 			goto bailout;
+		}
+		link->descrtext = link->descr->data;
+		link->descrlen = link->descr->size;
+	}
+
+	if (h.value[PAGE_HEADER_SORT]) {
+		link->nr = h.value[PAGE_HEADER_SORT];
+		link->nrlen = h.len[PAGE_HEADER_SORT];
 	} else {
-		warnx("unable to find DESCR or DESCR.md in %s", _dirname);
-		goto bailout;
+		link->sort = memmap_new_at(dirfd, "SORT");
+		if (link->sort == NULL)
+			goto bailout;
+		link->nr = link->sort->data;
+		link->nrlen = memmap_chomp(link->sort);
 	}
-	link->sort = memmap_new_at(dirfd, "SORT");
-	if (link->sort == NULL)
-		goto bailout;
 
-	if (fstatat(dirfd, "SUB", &sb, 0) != -1)
+	link->sub = ((h.flags & PAGE_HEADER_SUB) != 0);
+	if (! link->sub && fstatat(dirfd, "SUB", &sb, 0) != -1)
 		link->sub = ((sb.st_mode & S_IFREG) != 0);
-	if (fstatat(dirfd, "SSL", &sb, 0) != -1)
+	link->ssl = ((h.flags & PAGE_HEADER_SSL) != 0);
+	if (! link->ssl && fstatat(dirfd, "SSL", &sb, 0) != -1)
 		link->ssl = ((sb.st_mode & S_IFREG) != 0);
 	link->linkname = strdup(_dirname);
 
@@ -184,145 +392,375 @@ _link_free(struct _link *_link)
 	memmap_free(_link->descr);
 	memmap_free(_link->sort);
 	free(_link->linkname);
+	free(_link->header);
 	free(_link);
 }
 
 
 void
-_link_list_remove_unselected_subs(struct _link_list *_lst)
+_link_add_field(struct buffer_list *_bl, const char *_data, size_t _len)
 {
-	struct _link *topic = TAILQ_FIRST(&_lst->links);
-	struct _link *next;
-	bool selected = false;
-
-	while (topic) {
-		selected = topic->selected;
-		next = TAILQ_NEXT(topic, entries);
-		if (next && next->sub) {
-			struct _link *sub_start = next;
-			while (next && next->sub) {
-				selected |= next->selected;
-				next = TAILQ_NEXT(next, entries);
-			}
-			if (!selected) {
-				// Remove all SUB entries from sub_start to next
-				struct _link *rem = sub_start;
-				do {
-					struct _link *next_rem 
-						= TAILQ_NEXT(rem, entries);
-					TAILQ_REMOVE(&_lst->links, rem,
-							entries);
-					_link_free(rem);
-
-					rem = next_rem;
-				} while (rem != next);
-			}
-		}
-		topic = next;
-	}
+	uint32_t len = _len;
+	buffer_list_add(_bl, &len, sizeof(len));
+	buffer_list_add(_bl, _data, _len);
 }
 
 
-struct tmpl_data *
-_link_get_tmpl_data(struct _link *_l, struct request *_req, bool _js)
+void
+_link_add_row(struct _link *_l, struct request *_req, struct buffer_list *_bl)
 {
-	char *linkdata = strndup(_l->link->data, memmap_chomp(_l->link));
 	char *aref, *jslink, *link;
+	uint8_t flags = (_l->sub) ? LINK_ROW_SUB : 0;
+
 	if ((asprintf(&link, "%s%s/%s.html", _req->path, _req->lang,
 					_l->linkname) == -1))
 		err(1, NULL);
-	if ((asprintf(&aref, "<a href=\"%s%s\">%s</a>",
+	if ((asprintf(&aref, "<a href=\"%s%s\">%.*s</a>",
 					(_l->ssl || _req->page_info->ssl)
 					? "https://" CMS_HOSTNAME
 					: "",
-					link, linkdata) == -1))
+					link, (int)_l->textlen, _l->text)
+				== -1))
+		err(1, NULL);
+	if ((asprintf(&jslink, "onclick=\"javascript:location.replace"
+					"('%s')\"", link) == -1))
 		err(1, NULL);
-	struct tmpl_data *data =  tmpl_data_new();
-	tmpl_data_set_variablen(data, "NR", _l->sort->data,
-			memmap_chomp(_l->sort));
-	tmpl_data_set_variablen(data, "DESCR", _l->descr->data,
-			_l->descr->size);
-	tmpl_data_move_variable(data, "LINK", aref);
-	if (_js) {
-		if ((asprintf(&jslink, "onclick=\"javascript:location.replace"
-						"('%s')\"", link) == -1))
-			err(1, NULL);
-		tmpl_data_move_variable(data, "JSLINK", jslink);
-	}
-	if (_l->sub)
-		tmpl_data_set_variable(data, "SUB", "1");
-	if (_l->selected)
-		tmpl_data_set_variable(data, "SELECTED", "1");
 
-	free(linkdata);
+	buffer_list_add(_bl, &flags, sizeof(flags));
+	_link_add_field(_bl, _l->linkname, strlen(_l->linkname));
+	_link_add_field(_bl, _l->nr, _l->nrlen);
+	_link_add_field(_bl, _l->descrtext, _l->descrlen);
+	_link_add_field(_bl, aref, strlen(aref));
+	_link_add_field(_bl, jslink, strlen(jslink));
+
+	free(jslink);
+	free(aref);
 	free(link);
+}
+
 
+/*
+ * Returns the size of the row at _data or 0 if it is truncated.
+ */
+size_t
+_link_parse_row(const char *_data, size_t _size, struct _link_row *_row)
+{
+	size_t off = 1;
+
+	if (_size < 1)
+		return 0;
+	_row->flags = (uint8_t)_data[0];
+	for (int i = 0; i < LINK_ROW_FIELDS; i++) {
+		if (_size - off < sizeof(uint32_t))
+			return 0;
+		memcpy(&_row->len[i], _data + off, sizeof(uint32_t));
+		off += sizeof(uint32_t);
+		if (_size - off < _row->len[i])
+			return 0;
+		_row->field[i] = _data + off;
+		off += _row->len[i];
+	}
+	return off;
+}
+
+
+bool
+_link_rows_open(struct _link_rows *_r, const char *_data, size_t _size)
+{
+	if (_size < sizeof(struct _link_rows_header))
+		return false;
+	memcpy(&_r->header, _data, sizeof(struct _link_rows_header));
+	size_t tables = sizeof(struct _link_rows_header)
+		+ (size_t)_r->header.ntopics * sizeof(struct _link_rows_topic)
+		+ (size_t)_r->header.nlinks * sizeof(struct _link_rows_name);
+	if (tables > _size)
+		return false;
+	_r->topics = _data + sizeof(struct _link_rows_header);
+	_r->names = _r->topics
+		+ _r->header.ntopics * sizeof(struct _link_rows_topic);
+	_r->data = _data + tables;
+	_r->size = _size - tables;
+	return true;
+}
+
+
+struct _link_rows_topic
+_link_rows_topic(struct _link_rows *_r, uint32_t _i)
+{
+	struct _link_rows_topic t;
+	memcpy(&t, _r->topics + _i * sizeof(t), sizeof(t));
+	if (t.end > _r->size || t.off > t.end)
+		t.off = t.end = 0;
+	return t;
+}
+
+
+struct _link_rows_name
+_link_rows_name(struct _link_rows *_r, uint32_t _i)
+{
+	struct _link_rows_name n;
+	memcpy(&n, _r->names + _i * sizeof(n), sizeof(n));
+	return n;
+}
+
+
+/*
+ * Binary search for the topic of the page _name, returns UINT32_MAX if
+ * it is not part of the navigation.
+ */
+uint32_t
+_link_rows_find(struct _link_rows *_r, const char *_name)
+{
+	struct _link_row row;
+	uint32_t lo = 0, hi = _r->header.nlinks;
+	size_t len = strlen(_name);
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		struct _link_rows_name n = _link_rows_name(_r, mid);
+		if (n.off >= _r->size || _link_parse_row(_r->data + n.off,
+					_r->size - n.off, &row) == 0)
+			return UINT32_MAX;
+		size_t cmplen = (len < row.len[LINK_ROW_NAME])
+			? len : row.len[LINK_ROW_NAME];
+		int cmp = memcmp(_name, row.field[LINK_ROW_NAME], cmplen);
+		if (cmp == 0)
+			cmp = (len > row.len[LINK_ROW_NAME])
+				- (len < row.len[LINK_ROW_NAME]);
+		if (cmp == 0)
+			return n.topic;
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return UINT32_MAX;
+}
+
+
+struct tmpl_data *
+_link_row_data(struct _link_row *_row, bool _selected)
+{
+	struct tmpl_data *data = tmpl_data_new();
+	tmpl_data_set_variable_ref(data, "NR", _row->field[LINK_ROW_NR],
+			_row->len[LINK_ROW_NR]);
+	tmpl_data_set_variable_ref(data, "DESCR", _row->field[LINK_ROW_DESCR],
+			_row->len[LINK_ROW_DESCR]);
+	tmpl_data_set_variable_ref(data, "LINK", _row->field[LINK_ROW_LINK],
+			_row->len[LINK_ROW_LINK]);
+	tmpl_data_set_variable_ref(data, "JSLINK", _row->field[LINK_ROW_JSLINK],
+			_row->len[LINK_ROW_JSLINK]);
+	if (_row->flags & LINK_ROW_SUB)
+		tmpl_data_set_variable(data, "SUB", "1");
+	if (_selected)
+		tmpl_data_set_variable(data, "SELECTED", "1");
 	return data;
 }
 
 
+/*
+ * Turns the rows into the LINK_LOOP. The SUB entries of a topic are only
+ * kept if the topic or one of them is the current page.
+ */
 struct tmpl_loop *
-request_get_links(struct request *_req)
+_link_rows_loop(const char *_data, size_t _size, struct request *_req)
+{
+	struct _link_rows r;
+	struct _link_row row;
+	size_t n, page_len = strlen(_req->page);
+
+	if (! _link_rows_open(&r, _data, _size))
+		return NULL;
+	uint32_t selected = _link_rows_find(&r, _req->page);
+
+	struct tmpl_loop *loop = tmpl_loop_new("LINK_LOOP");
+	for (uint32_t i = 0; i < r.header.ntopics; i++) {
+		struct _link_rows_topic t = _link_rows_topic(&r, i);
+		size_t off = t.off;
+		size_t end = (i == selected) ? t.end : off + 1;
+		while (off < end && (n = _link_parse_row(r.data + off,
+						t.end - off, &row))) {
+			bool sel = (row.len[LINK_ROW_NAME] == page_len
+					&& memcmp(row.field[LINK_ROW_NAME],
+						_req->page, page_len) == 0);
+			tmpl_loop_add_data(loop, _link_row_data(&row, sel));
+			off += n;
+		}
+	}
+
+	return loop;
+}
+
+
+int
+_link_name_cmp(const void *_a, const void *_b)
+{
+	const struct _link_name *a = _a, *b = _b;
+	return strcmp(a->name, b->name);
+}
+
+
+struct buffer_list *
+_link_list_rows(struct request *_req)
 {
-	struct _link_list *lst = _link_list_new_at(_req->lang_dir, _req->page);
+	struct _link_rows_header header;
+	struct _link_list *lst = (_req->catalog_lang)
+		? _link_list_new_catalog(_req->catalog, _req->catalog_lang)
+		: _link_list_new_at(_req->lang_dir);
 	if (lst == NULL)
 		return NULL;
 
-	_link_list_remove_unselected_subs(lst);
+	struct buffer_list *rows = buffer_list_new();
+	struct _link_rows_topic *topics = calloc(lst->ntopics ? lst->ntopics
+			: 1, sizeof(struct _link_rows_topic));
+	struct _link_name *names = calloc(lst->nlinks ? lst->nlinks : 1,
+			sizeof(struct _link_name));
+	if (topics == NULL || names == NULL)
+		err(1, NULL);
 
-	struct tmpl_loop *loop = tmpl_loop_new("LINK_LOOP");
-	struct _link *l;
-	TAILQ_FOREACH(l, &lst->links, entries) {
-		struct tmpl_data *data = _link_get_tmpl_data(l, _req, true);
-		tmpl_loop_add_data(loop, data);
+	size_t k = 0;
+	for (size_t i = 0; i < lst->ntopics; i++) {
+		struct _link_topic *t = &lst->topics[i];
+		topics[i].off = rows->size;
+		for (size_t j = 0; j <= t->nsubs; j++) {
+			struct _link *l = (j == 0) ? t->link : t->subs[j - 1];
+			names[k].name = l->linkname;
+			names[k].entry.off = rows->size;
+			names[k++].entry.topic = i;
+			_link_add_row(l, _req, rows);
+		}
+		topics[i].end = rows->size;
+	}
+	if (rows->size > UINT32_MAX)
+		errx(1, "navigation of %s too large", _req->lang);
+
+	qsort(names, lst->nlinks, sizeof(struct _link_name), _link_name_cmp);
+
+	struct buffer_list *out = buffer_list_new();
+	header.ntopics = lst->ntopics;
+	header.nlinks = lst->nlinks;
+	buffer_list_add(out, &header, sizeof(header));
+	buffer_list_add(out, topics, lst->ntopics * sizeof(*topics));
+	for (size_t i = 0; i < lst->nlinks; i++)
+		buffer_list_add(out, &names[i].entry,
+				sizeof(struct _link_rows_name));
+	buffer_list_add_list(out, rows);
+
+	buffer_list_free(rows);
+	free(names);
+	free(topics);
+	_link_list_free(lst);
+	return out;
+}
+
+
+/*
+ * The rows of a language only depend on the navigation files and the
+ * SSL setting of the current page, they are kept in the render cache
+ * until the navigation validator changes. The rows of a big site need
+ * more than one slot and are stored in chunks.
+ */
+struct tmpl_loop *
+request_get_links(struct request *_req)
+{
+	struct tmpl_loop *loop = NULL;
+	char *key = NULL;
+
+	if (_req->cache && _req->nav_validator) {
+		if (asprintf(&key, "nav/%s/%d", _req->lang,
+					_req->page_info->ssl) == -1)
+			err(1, NULL);
+		struct buffer *b = cache_lookup_chunks(_req->cache, key,
+				_req->nav_validator);
+		if (b) {
+			loop = _link_rows_loop(b->data, b->size, _req);
+			_req->nav_rows = b;
+			free(key);
+			return loop;
+		}
+	}
+
+	struct buffer_list *rows = _link_list_rows(_req);
+	if (rows) {
+		if (key) {
+			struct cache_meta meta = { _req->nav_validator, 0, 0,
+				"" };
+			cache_store_chunks(_req->cache, key, &meta, rows);
+		}
+		char *data = (rows->size) ? buffer_list_concat(rows) : NULL;
+		loop = _link_rows_loop(data, rows->size, _req);
+		_req->nav_rows = data;
+		buffer_list_free(rows);
 	}
 
 	// TODO: add logout if we have a valid login session
 
-	_link_list_free(lst);
+	free(key);
 	return loop;
 }
 
 
+void
+_language_link_add(struct tmpl_loop *_loop, struct request *_req,
+		const char *_lang)
+{
+	char *lang_link;
+
+	if ((asprintf(&lang_link, "<a href=\"%s%s/%s.html\">"
+			"<img src=\"" CMS_CONFIG_URL_IMAGES "flag_%s.png\" "
+			"alt=\"%s\"/></a>", _req->path, _lang, _req->page,
+			_lang, _lang) == -1))
+		err(1, NULL);
+	struct tmpl_data *d = tmpl_data_new();
+	tmpl_data_move_variable(d, "LANGUAGE_LINK", lang_link);
+	tmpl_loop_add_data(_loop, d);
+}
+
+
 struct tmpl_loop *
 request_get_language_links(struct request *_req)
 {
 	struct tmpl_loop *loop = tmpl_loop_new("LANGUAGE_LINKS");
-	int contentfd = dup(_req->content_dir);
-	DIR *dir = fdopendir(contentfd);
-	if (dir) {
-		struct dirent *dirent;
-		while ((dirent = readdir(dir))) {
-			if (dirent->d_name[0] == '.')
-				continue;
-			if (strcmp(dirent->d_name, _req->page) == 0)
+
+	// Read the languages of the page from the catalog without touching
+	// the content directory
+	if (_req->page_langs) {
+		struct catalog *c = _req->catalog;
+		for (uint32_t i = 0; i < c->header->nlangs; i++) {
+			if ((_req->page_langs[i / 64] & (1ULL << (i % 64))) == 0)
 				continue;
-			int fd = openat(_req->content_dir, dirent->d_name,
-					O_DIRECTORY | O_RDONLY);
-			if (-1 == fd) {
-				warn("%s", dirent->d_name);
+			const char *lang = catalog_str(c, &c->langs[i].name);
+			if (strcmp(lang, _req->page) == 0)
 				continue;
-			}
-			if (dir_exists_at(fd, _req->page)) {
-				char *lang_link;
-				if ((asprintf(&lang_link,
-						"<a href=\"%s%s/%s.html\">"
-						"<img src=\""
-						CMS_CONFIG_URL_IMAGES
-						"flag_%s.png\" alt=\"%s\"/>"
-						"</a>",
-						_req->path, dirent->d_name,
-						_req->page, dirent->d_name,
-						dirent->d_name) == -1))
-					err(1, NULL);
-				struct tmpl_data *d = tmpl_data_new();
-				tmpl_data_move_variable(d, "LANGUAGE_LINK",
-						lang_link);
-				tmpl_loop_add_data(loop, d);
-			}
-
-			close(fd);
+			_language_link_add(loop, _req, lang);
+		}
+		return loop;
+	}
+
+	int contentfd = dir_reopen(_req->content_dir);
+	DIR *dir = (contentfd == -1) ? NULL : fdopendir(contentfd);
+	if (dir == NULL) {
+		warn("%s", cms_content_dir);
+		if (contentfd != -1)
+			close(contentfd);
+		return loop;
+	}
+	struct dirent *dirent;
+	while ((dirent = readdir(dir))) {
+		if (dirent->d_name[0] == '.')
+			continue;
+		if (strcmp(dirent->d_name, _req->page) == 0)
+			continue;
+		int fd = openat(_req->content_dir, dirent->d_name,
+				O_DIRECTORY | O_RDONLY);
+		if (-1 == fd) {
+			warn("%s", dirent->d_name);
+			continue;
 		}
+		if (dir_exists_at(fd, _req->page))
+			_language_link_add(loop, _req, dirent->d_name);
+		close(fd);
 	}
+	closedir(dir);
 	return loop;
 }
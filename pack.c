@@ -0,0 +1,451 @@
+/*
+ * Copyright (c) 2018 Markus Hennecke <markus-hennecke@markus-hennecke.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * The content pack is written by cmspack and holds a whole content tree in
+ * one read only mapping:
+ *
+ *	struct pack_header
+ *	content catalog				navigation, see catalog.c
+ *	uint32_t		[nslots]	page index + 1, hashed by
+ *						language and page name
+ *	struct pack_page	[npages]	files of every page
+ *	file data
+ *
+ * While a pack exists cms reads nothing from the content directory, run
+ * cmspack again after every change. A pack older than the catalog misses
+ * the latest edits and is not used.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pack.h"
+#include "pageheader.h"
+
+#define PACK_ALIGN(x)	(((x) + 7) & ~(uint64_t)7)
+
+static uint64_t	_hash(const char *, const char *);
+static bool	_write_all(int, const void *, size_t);
+static bool	_add_data(int, uint64_t *, struct pack_blob *, const void *,
+		size_t);
+static bool	_add_file(int, uint64_t *, struct pack_blob *, int,
+		const char *, const char *, size_t);
+static bool	_write_pages(int, int, struct pack_header *);
+
+
+uint64_t
+_hash(const char *_lang, const char *_page)
+{
+	uint64_t h = hash_fnv1a(HASH_FNV1A_INIT, _lang, strlen(_lang) + 1);
+	return hash_fnv1a(h, _page, strlen(_page));
+}
+
+
+struct pack *
+pack_open(const char *_filename)
+{
+	struct pack *p = calloc(1, sizeof(struct pack));
+	if (p == NULL)
+		err(1, NULL);
+
+	int fd = open(_filename, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			warn("%s", _filename);
+		free(p);
+		return NULL;
+	}
+	if (fstat(fd, &p->sb) == -1) {
+		warn("%s", _filename);
+		goto fail;
+	}
+	if ((size_t)p->sb.st_size < sizeof(struct pack_header))
+		goto invalid;
+	p->size = p->sb.st_size;
+	p->map = mmap(NULL, p->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p->map == MAP_FAILED) {
+		p->map = NULL;
+		warn("%s", _filename);
+		goto fail;
+	}
+	close(fd);
+	fd = -1;
+
+	struct pack_header *h = p->header = p->map;
+	if (h->magic != PACK_MAGIC || h->version != PACK_VERSION
+			|| h->size != p->size
+			|| h->catalog + h->catalog_size > p->size
+			|| h->nslots == 0 || (h->nslots & (h->nslots - 1)) != 0
+			|| h->slots + (uint64_t)h->nslots * sizeof(uint32_t)
+				> p->size
+			|| h->pages + (uint64_t)h->npages
+				* sizeof(struct pack_page) > p->size)
+		goto invalid;
+	p->catalog = catalog_open_mem((char *)p->map + h->catalog,
+			h->catalog_size, &p->sb);
+	if (p->catalog == NULL || p->catalog->header->npages != h->npages)
+		goto invalid;
+	p->slots = (uint32_t *)((char *)p->map + h->slots);
+	p->pages = (struct pack_page *)((char *)p->map + h->pages);
+	return p;
+
+invalid:
+	warnx("%s: invalid content pack", _filename);
+fail:
+	if (fd != -1)
+		close(fd);
+	pack_close(p);
+	return NULL;
+}
+
+
+void
+pack_close(struct pack *_p)
+{
+	if (_p) {
+		catalog_close(_p->catalog);
+		if (_p->map)
+			munmap(_p->map, _p->size);
+		free(_p);
+	}
+}
+
+
+/*
+ * Returns true if the catalog _catalog_file was written after the pack.
+ * cms-watch and cms-index write it after each change of the content.
+ */
+bool
+pack_outdated(const struct pack *_p, const char *_catalog_file)
+{
+	struct stat sb;
+
+	if (stat(_catalog_file, &sb) == -1)
+		return false;
+	if (sb.st_mtim.tv_sec != _p->sb.st_mtim.tv_sec)
+		return (sb.st_mtim.tv_sec > _p->sb.st_mtim.tv_sec);
+	return (sb.st_mtim.tv_nsec > _p->sb.st_mtim.tv_nsec);
+}
+
+
+/*
+ * Returns the index of a page in the catalog of the pack, -1 if the page
+ * does not exist in the language.
+ */
+int64_t
+pack_find(struct pack *_p, const char *_lang, const char *_page)
+{
+	struct catalog *c = _p->catalog;
+	struct catalog_lang *l = catalog_find_lang(c, _lang);
+	if (l == NULL)
+		return -1;
+
+	uint32_t mask = _p->header->nslots - 1;
+	uint64_t h = _hash(_lang, _page);
+	for (uint32_t i = 0; i < _p->header->nslots; i++) {
+		uint32_t slot = _p->slots[(h + i) & mask];
+		if (slot == 0)
+			break;
+		uint32_t idx = slot - 1;
+		if (idx < l->first || idx >= l->first + l->npages)
+			continue;
+		if (strcmp(catalog_str(c, &c->pages[idx].name), _page) == 0)
+			return idx;
+	}
+	return -1;
+}
+
+
+bool
+pack_has(struct pack *_p, uint32_t _page, enum pack_file _file)
+{
+	return (_page < _p->header->npages
+			&& _p->pages[_page].files[_file].present);
+}
+
+
+/*
+ * Returns a memmap pointing into the pack, memmap_free() leaves the pack
+ * mapped.
+ */
+struct memmap *
+pack_file(struct pack *_p, uint32_t _page, enum pack_file _file)
+{
+	if (! pack_has(_p, _page, _file))
+		return NULL;
+	struct pack_blob *b = &_p->pages[_page].files[_file];
+	if (b->off + b->len > _p->size)
+		return NULL;
+
+	return memmap_new_ref((char *)_p->map + b->off, b->len);
+}
+
+
+bool
+_write_all(int _fd, const void *_data, size_t _size)
+{
+	const char *p = _data;
+	while (_size > 0) {
+		ssize_t n = write(_fd, p, _size);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += n;
+		_size -= n;
+	}
+	return true;
+}
+
+
+bool
+_add_data(int _fd, uint64_t *_off, struct pack_blob *_blob, const void *_data,
+		size_t _size)
+{
+	if (_size > UINT32_MAX || ! _write_all(_fd, _data, _size))
+		return false;
+	_blob->off = *_off;
+	_blob->len = _size;
+	_blob->present = 1;
+	*_off += _size;
+	return true;
+}
+
+
+/*
+ * Appends the file _md, or _name if there is no markdown variant, of the
+ * page directory _dir without its first _skip bytes. A missing file is not
+ * an error.
+ */
+bool
+_add_file(int _fd, uint64_t *_off, struct pack_blob *_blob, int _dir,
+		const char *_name, const char *_md, size_t _skip)
+{
+	struct stat sb;
+	struct md_mmap *md;
+	void *data;
+	size_t size;
+
+	if (_md && fstatat(_dir, _md, &sb, 0) == 0)
+		md = md_mmap_new_at(_dir, _md);
+	else if (fstatat(_dir, _name, &sb, 0) == 0)
+		md = md_mmap_new_at(_dir, _name);
+	else
+		return true;
+	if (md == NULL)
+		return false;
+	md->skip = _skip;
+	md_mmap_parse(md);
+	md_mmap_content(md, &data, &size);
+	bool result = _add_data(_fd, _off, _blob, data, size);
+	md_mmap_free(md);
+	return result;
+}
+
+
+/*
+ * Appends the files of every page of the catalog just written to _fd and
+ * writes the hashed directory and the page table.
+ */
+bool
+_write_pages(int _cfd, int _fd, struct pack_header *_h)
+{
+	static const char *files[PACK_NFILES][2] = {
+		{ "CONTENT", "CONTENT.md" },	// PACK_CONTENT
+		{ "DESCR", "DESCR.md" },	// PACK_DESCR
+		{ "LINK", NULL },		// PACK_LINK
+		{ "LOGIN", NULL },		// PACK_LOGIN
+		{ "SCRIPT", NULL },		// PACK_SCRIPT
+		{ "SORT", NULL },		// PACK_SORT
+		{ "STYLE", NULL },		// PACK_STYLE
+		{ "TITLE", NULL }		// PACK_TITLE
+	};
+	static const int header_fields[PACK_NFILES] = {
+		-1, PAGE_HEADER_DESCR, PAGE_HEADER_LINK, -1, -1,
+		PAGE_HEADER_SORT, -1, PAGE_HEADER_TITLE
+	};
+	struct page_header ph;
+	char buf[PAGE_HEADER_MAX];
+	struct catalog *c = NULL;
+	struct pack_page *pages = NULL;
+	uint32_t *slots = NULL;
+	struct stat sb;
+	bool result = false;
+
+	char *image = malloc(_h->catalog_size);
+	if (image == NULL)
+		err(1, NULL);
+	if (fstat(_fd, &sb) == -1 || pread(_fd, image, _h->catalog_size,
+				_h->catalog) != (ssize_t)_h->catalog_size
+			|| (c = catalog_open_mem(image, _h->catalog_size, &sb))
+				== NULL) {
+		warnx("can not read back the catalog");
+		goto done;
+	}
+
+	_h->npages = c->header->npages;
+	for (_h->nslots = 1; _h->nslots < 2 * _h->npages; _h->nslots *= 2)
+		;
+	_h->slots = PACK_ALIGN(_h->catalog + _h->catalog_size);
+	_h->pages = PACK_ALIGN(_h->slots + _h->nslots * sizeof(uint32_t));
+	uint64_t off = _h->pages + _h->npages * sizeof(struct pack_page);
+	slots = calloc(_h->nslots, sizeof(uint32_t));
+	pages = calloc(_h->npages ? _h->npages : 1, sizeof(struct pack_page));
+	if (slots == NULL || pages == NULL)
+		err(1, NULL);
+	if (lseek(_fd, off, SEEK_SET) == -1)
+		goto write_error;
+
+	for (uint32_t i = 0; i < c->header->nlangs; i++) {
+		const char *lang = catalog_str(c, &c->langs[i].name);
+		int lfd = openat(_cfd, lang, O_DIRECTORY | O_RDONLY);
+		if (lfd == -1) {
+			warn("%s", lang);
+			goto done;
+		}
+		for (uint32_t j = 0; j < c->langs[i].npages; j++) {
+			uint32_t idx = c->langs[i].first + j;
+			const char *page = catalog_str(c, &c->pages[idx].name);
+			int pfd = openat(lfd, page, O_DIRECTORY | O_RDONLY);
+			if (pfd == -1) {
+				warn("%s/%s", lang, page);
+				close(lfd);
+				goto done;
+			}
+			// The header of a page without LINK moves from the
+			// content into the fields
+			memset(&ph, 0, sizeof(ph));
+			if (fstatat(pfd, "LINK", &sb, 0) == -1)
+				page_header_read_at(pfd, &ph, buf, sizeof(buf));
+			for (int f = 0; f < PACK_NFILES; f++) {
+				struct pack_blob *b = &pages[idx].files[f];
+				int hf = header_fields[f];
+				bool ok = (hf != -1 && ph.value[hf])
+					? _add_data(_fd, &off, b, ph.value[hf],
+						ph.len[hf])
+					: _add_file(_fd, &off, b, pfd,
+						files[f][0], files[f][1],
+						(f == PACK_CONTENT) ? ph.size : 0);
+				if (! ok) {
+					warn("%s/%s/%s", lang, page,
+							files[f][0]);
+					close(pfd);
+					close(lfd);
+					goto done;
+				}
+			}
+			close(pfd);
+
+			uint32_t mask = _h->nslots - 1;
+			uint64_t h = _hash(lang, page);
+			while (slots[h & mask] != 0)
+				h++;
+			slots[h & mask] = idx + 1;
+		}
+		close(lfd);
+	}
+	_h->size = off;
+
+	if (lseek(_fd, _h->slots, SEEK_SET) == -1
+			|| ! _write_all(_fd, slots,
+				_h->nslots * sizeof(uint32_t))
+			|| lseek(_fd, _h->pages, SEEK_SET) == -1
+			|| ! _write_all(_fd, pages,
+				_h->npages * sizeof(struct pack_page)))
+		goto write_error;
+	result = true;
+	goto done;
+
+write_error:
+	warn("write");
+done:
+	catalog_close(c);
+	free(image);
+	free(slots);
+	free(pages);
+	return result;
+}
+
+
+/*
+ * Reads the content directory and atomically replaces the pack file.
+ */
+bool
+pack_write(const char *_content_dir, const char *_filename)
+{
+	struct pack_header header;
+	char tmpname[PATH_MAX];
+	bool result = false;
+
+	int cfd = open(_content_dir, O_DIRECTORY | O_RDONLY);
+	if (cfd == -1) {
+		warn("%s", _content_dir);
+		return false;
+	}
+	if ((size_t)snprintf(tmpname, sizeof(tmpname), "%s.XXXXXXXXXX",
+				_filename) >= sizeof(tmpname)) {
+		warnx("%s: name too long", _filename);
+		close(cfd);
+		return false;
+	}
+	int fd = mkstemp(tmpname);
+	if (fd == -1) {
+		warn("%s", tmpname);
+		close(cfd);
+		return false;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic = PACK_MAGIC;
+	header.version = PACK_VERSION;
+	header.catalog = sizeof(header);
+	off_t end;
+	if (! _write_all(fd, &header, sizeof(header))
+			|| ! catalog_write_fd(cfd, fd)
+			|| (end = lseek(fd, 0, SEEK_CUR)) == -1)
+		goto done;
+	header.catalog_size = end - header.catalog;
+	if (! _write_pages(cfd, fd, &header))
+		goto done;
+	if (ftruncate(fd, header.size) == -1
+			|| lseek(fd, 0, SEEK_SET) == -1
+			|| ! _write_all(fd, &header, sizeof(header))
+			|| fchmod(fd, 0644) == -1 || fsync(fd) == -1
+			|| rename(tmpname, _filename) == -1) {
+		warn("%s", tmpname);
+		goto done;
+	}
+	result = true;
+
+done:
+	if (! result)
+		unlink(tmpname);
+	close(fd);
+	close(cfd);
+	return result;
+}
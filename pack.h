@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2018 Markus Hennecke <markus-hennecke@markus-hennecke.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __PACK_H__
+#define __PACK_H__
+
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "catalog.h"
+#include "helper.h"
+
+#define PACK_MAGIC		0x50534d43	// "CMSP"
+#define PACK_VERSION		1
+
+// Files stored for every page, markdown is stored converted to HTML
+enum pack_file {
+	PACK_CONTENT,
+	PACK_DESCR,
+	PACK_LINK,
+	PACK_LOGIN,
+	PACK_SCRIPT,
+	PACK_SORT,
+	PACK_STYLE,
+	PACK_TITLE,
+	PACK_NFILES
+};
+
+struct pack_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	size;
+	uint64_t	catalog;
+	uint64_t	catalog_size;
+	uint32_t	npages;
+	uint32_t	nslots;
+	uint64_t	slots;
+	uint64_t	pages;
+};
+
+struct pack_blob {
+	uint64_t	off;
+	uint32_t	len;
+	uint32_t	present;
+};
+
+// Same order as the pages of the catalog
+struct pack_page {
+	struct pack_blob	files[PACK_NFILES];
+};
+
+struct pack {
+	void			*map;
+	size_t			 size;
+	struct stat		 sb;
+	struct pack_header	*header;
+	uint32_t		*slots;
+	struct pack_page	*pages;
+	struct catalog		*catalog;
+};
+
+struct pack	*pack_open(const char *);
+void		 pack_close(struct pack *);
+bool		 pack_outdated(const struct pack *, const char *);
+int64_t		 pack_find(struct pack *, const char *, const char *);
+bool		 pack_has(struct pack *, uint32_t, enum pack_file);
+struct memmap	*pack_file(struct pack *, uint32_t, enum pack_file);
+bool		 pack_write(const char *, const char *);
+
+#endif // __PACK_H__
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2018 Markus Hennecke <markus-hennecke@markus-hennecke.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pack.h"
+
+#ifndef CMS_CONTENT_DIR
+#error "Need CMS_CONTENT_DIR defined to compile"
+#endif
+#ifndef CMS_PACK_FILE
+#error "Need CMS_PACK_FILE defined to compile"
+#endif
+
+static __dead void	usage(void);
+
+__dead void
+usage(void)
+{
+	extern char *__progname;
+
+	dprintf(STDERR_FILENO, "usage: %s [-o pack] [content_dir]\n",
+			__progname);
+	exit(1);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	char *content_dir = CMS_CHROOT CMS_CONTENT_DIR;
+	char *pack_file = CMS_CHROOT CMS_PACK_FILE;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "o:")) != -1) {
+		switch (ch) {
+		case 'o':
+			pack_file = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc > 1)
+		usage();
+	if (argc == 1)
+		content_dir = argv[0];
+
+	if (! pack_write(content_dir, pack_file))
+		errx(1, "unable to write %s", pack_file);
+	return EXIT_SUCCESS;
+}
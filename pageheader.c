@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2018 Markus Hennecke <markus-hennecke@markus-hennecke.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pageheader.h"
+
+static const char	*_line_end(const char *, const char *);
+static bool		 _is_line(const char *, const char *, const char *);
+
+static const char *page_header_fields[PAGE_HEADER_NFIELDS] = {
+	"DESCR", "LINK", "SORT", "TITLE"
+};
+
+
+const char *
+_line_end(const char *_p, const char *_end)
+{
+	const char *nl = memchr(_p, '\n', _end - _p);
+	return (nl) ? nl : _end;
+}
+
+
+bool
+_is_line(const char *_p, const char *_eol, const char *_line)
+{
+	size_t len = strlen(_line);
+	if (_eol > _p && _eol[-1] == '\r')
+		_eol--;
+	return ((size_t)(_eol - _p) == len && memcmp(_p, _line, len) == 0);
+}
+
+
+/*
+ * Parses the header block at the start of _data. Returns false and leaves
+ * _h empty if there is none, a line that is not a known key makes the
+ * whole block part of the content. Empty lines are skipped.
+ */
+bool
+page_header_parse(struct page_header *_h, const char *_data, size_t _size)
+{
+	memset(_h, 0, sizeof(*_h));
+	if (_size > PAGE_HEADER_MAX)
+		_size = PAGE_HEADER_MAX;
+	const char *end = _data + _size;
+	const char *p = _data;
+	const char *eol = _line_end(p, end);
+	if (eol == end || ! _is_line(p, eol, PAGE_HEADER_MARKER))
+		return false;
+
+	for (p = eol + 1; p < end; p = eol + 1) {
+		eol = _line_end(p, end);
+		if (_is_line(p, eol, "---")) {
+			_h->size = (eol < end)
+				? (size_t)(eol + 1 - _data) : _size;
+			return true;
+		}
+		if (eol == end)
+			break;
+		const char *e = eol;
+		if (e > p && e[-1] == '\r')
+			e--;
+		if (e == p)
+			continue;
+
+		const char *key = p;
+		while (p < e && isupper((unsigned char)*p))
+			p++;
+		size_t keylen = p - key;
+		if (keylen == 0 || (p < e && *p != ':'))
+			break;
+		if (p < e)
+			p++;
+		while (p < e && isspace((unsigned char)*p))
+			p++;
+		while (e > p && isspace((unsigned char)e[-1]))
+			e--;
+
+		int i;
+		if (keylen == 3 && memcmp(key, "SSL", 3) == 0)
+			_h->flags |= PAGE_HEADER_SSL;
+		else if (keylen == 3 && memcmp(key, "SUB", 3) == 0)
+			_h->flags |= PAGE_HEADER_SUB;
+		else {
+			for (i = 0; i < PAGE_HEADER_NFIELDS; i++)
+				if (strlen(page_header_fields[i]) == keylen
+						&& memcmp(page_header_fields[i],
+							key, keylen) == 0)
+					break;
+			if (i == PAGE_HEADER_NFIELDS)
+				break;
+			_h->value[i] = p;
+			_h->len[i] = e - p;
+		}
+	}
+	memset(_h, 0, sizeof(*_h));
+	return false;
+}
+
+
+/*
+ * Reads the start of CONTENT.md, or CONTENT, of the page directory _fd into
+ * _buf and parses its header. The values point into _buf. The caller only
+ * asks for the header of a page without a LINK file.
+ */
+bool
+page_header_read_at(int _fd, struct page_header *_h, char *_buf,
+		size_t _size)
+{
+	memset(_h, 0, sizeof(*_h));
+	int fd = openat(_fd, "CONTENT.md", O_RDONLY);
+	if (fd == -1)
+		fd = openat(_fd, "CONTENT", O_RDONLY);
+	if (fd == -1)
+		return false;
+	ssize_t len = read(fd, _buf, _size);
+	close(fd);
+	if (len <= 0)
+		return false;
+	return page_header_parse(_h, _buf, len);
+}
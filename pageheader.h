@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2018 Markus Hennecke <markus-hennecke@markus-hennecke.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __PAGEHEADER_H__
+#define __PAGEHEADER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A page without a LINK file may declare the contents of its small files
+ * in a header block at the top of CONTENT or CONTENT.md:
+ *
+ *	---cms
+ *	TITLE: Welcome
+ *	SORT: 010
+ *	LINK: Home
+ *	DESCR: The start page
+ *	SSL
+ *	---
+ *
+ * Only the keys DESCR, LINK, SORT, TITLE, SSL and SUB are allowed, any
+ * other line makes the block part of the content. A field of the header
+ * replaces the file of the same name, fields the header lacks are still
+ * read from their files. The block is removed from the content.
+ *
+ * A page with a LINK file has no header, its content is not read to look
+ * for one and is used as it is.
+ */
+
+// The block has to end within the first bytes of the file
+#define PAGE_HEADER_MAX		4096
+#define PAGE_HEADER_MARKER	"---cms"
+
+enum page_header_field {
+	PAGE_HEADER_DESCR,
+	PAGE_HEADER_LINK,
+	PAGE_HEADER_SORT,
+	PAGE_HEADER_TITLE,
+	PAGE_HEADER_NFIELDS
+};
+
+// Flags
+#define PAGE_HEADER_SSL		0x01
+#define PAGE_HEADER_SUB		0x02
+
+struct page_header {
+	const char	*value[PAGE_HEADER_NFIELDS];
+	size_t		 len[PAGE_HEADER_NFIELDS];
+	uint32_t	 flags;
+	size_t		 size;		// length of the block, 0 if none
+};
+
+bool	page_header_parse(struct page_header *, const char *, size_t);
+bool	page_header_read_at(int, struct page_header *, char *, size_t);
+
+#endif // __PAGEHEADER_H__
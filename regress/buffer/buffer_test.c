@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2018 Markus Hennecke <markus-hennecke@markus-hennecke.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Deflates the same input with different numbers of blocks at once and
+ * checks that the streams are identical and inflate to the input with the
+ * CRC and the size of the trailer.
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "buffer.h"
+
+// Several blocks of GZIP_BLOCK_SIZE and a short one at the end
+#define INPUT_SIZE	(1024 * 1024 + 12345)
+#define PIECE_SIZE	7777
+
+static unsigned char	*make_input(size_t);
+static char		*deflate_input(const unsigned char *, size_t, size_t,
+		size_t *);
+static void		 check_stream(const char *, size_t,
+		const unsigned char *, size_t);
+
+
+unsigned char *
+make_input(size_t _size)
+{
+	static const char *words[] = { "content ", "sitemap ", "page ",
+		"cache ", "<p>", "</p>\n", "lorem ", "ipsum " };
+	unsigned char *data = malloc(_size);
+	uint32_t x = 1;
+
+	if (data == NULL)
+		err(1, NULL);
+	for (size_t off = 0; off < _size; ) {
+		x = x * 1103515245 + 12345;
+		const char *w = words[(x >> 16) % 8];
+		size_t len = strlen(w);
+		if (len > _size - off)
+			len = _size - off;
+		memcpy(data + off, w, len);
+		off += len;
+		// Some bytes that do not compress
+		if (off < _size && (x >> 8) % 5 == 0)
+			data[off++] = x >> 24;
+	}
+	return data;
+}
+
+
+/*
+ * Returns the gzip stream of the input added in pieces, deflating at most
+ * _nblocks blocks at once.
+ */
+char *
+deflate_input(const unsigned char *_data, size_t _size, size_t _nblocks,
+		size_t *_outsize)
+{
+	struct buffer_list *bl = buffer_list_new();
+	struct buffer_gzip *gz = buffer_gzip_new("sitemap.xml", 1234567890);
+
+	if (_nblocks < gz->nblocks)
+		gz->nblocks = _nblocks;
+	for (size_t off = 0; off < _size; off += PIECE_SIZE) {
+		size_t n = (_size - off < PIECE_SIZE) ? _size - off
+			: PIECE_SIZE;
+		buffer_gzip_add(gz, _data + off, n, bl);
+	}
+	buffer_gzip_finish(gz, bl);
+	buffer_gzip_free(gz);
+
+	*_outsize = bl->size;
+	char *out = buffer_list_concat(bl);
+	buffer_list_free(bl);
+	free(bl);
+	return out;
+}
+
+
+void
+check_stream(const char *_gz, size_t _gzsize, const unsigned char *_data,
+		size_t _size)
+{
+	const unsigned char *trailer = (const unsigned char *)_gz + _gzsize - 8;
+	uint32_t crc = trailer[0] | trailer[1] << 8 | trailer[2] << 16
+		| (uint32_t)trailer[3] << 24;
+	uint32_t isize = trailer[4] | trailer[5] << 8 | trailer[6] << 16
+		| (uint32_t)trailer[7] << 24;
+
+	if (crc != crc32(crc32(0L, Z_NULL, 0), _data, _size))
+		errx(1, "crc32 %08x in the trailer is wrong", crc);
+	if (isize != (_size & 0xffffffff))
+		errx(1, "size %u in the trailer is wrong", isize);
+
+	// inflate() checks the trailer of a gzip stream as well
+	unsigned char *out = malloc(_size + 1);
+	z_stream strm;
+	if (out == NULL)
+		err(1, NULL);
+	memset(&strm, 0, sizeof(strm));
+	if (inflateInit2(&strm, 15 + 16) != Z_OK)
+		errx(1, "inflateInit2");
+	strm.next_in = (unsigned char *)(uintptr_t)_gz;
+	strm.avail_in = _gzsize;
+	strm.next_out = out;
+	strm.avail_out = _size + 1;
+	int rc = inflate(&strm, Z_FINISH);
+	if (rc != Z_STREAM_END)
+		errx(1, "inflate: %d %s", rc, strm.msg ? strm.msg : "");
+	if (strm.total_out != _size || memcmp(out, _data, _size) != 0)
+		errx(1, "inflated data differs from the input");
+	if (strm.avail_in != 0)
+		errx(1, "%u bytes after the trailer", strm.avail_in);
+	inflateEnd(&strm);
+	free(out);
+}
+
+
+int
+main(void)
+{
+	size_t sizes[] = { 0, 1, 100000, INPUT_SIZE };
+	size_t nblocks[] = { 1, 2, 3, 9 };
+	unsigned char *data = make_input(INPUT_SIZE);
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		size_t refsize;
+		char *ref = deflate_input(data, sizes[i], nblocks[0], &refsize);
+		check_stream(ref, refsize, data, sizes[i]);
+		for (size_t j = 1; j < sizeof(nblocks) / sizeof(nblocks[0]);
+				j++) {
+			size_t gzsize;
+			char *gz = deflate_input(data, sizes[i], nblocks[j],
+					&gzsize);
+			if (gzsize != refsize || memcmp(gz, ref, gzsize) != 0)
+				errx(1, "%zu bytes in %zu blocks differ from "
+						"one block", sizes[i],
+						nblocks[j]);
+			free(gz);
+		}
+		free(ref);
+	}
+	free(data);
+	return 0;
+}
@@ -0,0 +1,391 @@
+/*
+ * Copyright (c) 2018 Markus Hennecke <markus-hennecke@markus-hennecke.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Tests the render cache: lookups, slots being written, the CLOCK
+ * eviction, stale entries, entries in chunks, the negative entries and
+ * the fill lock shared by processes.
+ */
+
+#include <sys/wait.h>
+#include <err.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "helper.h"
+
+#define NSLOTS		CACHE_PROBES
+#define SLOT_SIZE	256
+
+static struct cache_slot	*find_slot(struct cache *, const char *);
+static void			 store(struct cache *, const char *,
+		uint64_t, const char *);
+static void			 check_hit(struct cache *, const char *,
+		uint64_t, const char *);
+static void			 test_lookup(const char *);
+static void			 test_seqlock(const char *);
+static void			 test_eviction(const char *);
+static void			 test_chunks(const char *);
+static void			 test_negative(const char *);
+static void			 test_fill_lock(const char *);
+
+
+/*
+ * Returns the slot holding the key without marking it as referenced.
+ */
+struct cache_slot *
+find_slot(struct cache *_c, const char *_key)
+{
+	size_t keylen = strlen(_key);
+	uint64_t hash = hash_fnv1a(HASH_FNV1A_INIT, _key, keylen);
+
+	for (uint32_t i = 0; i < _c->header->nslots; i++) {
+		struct cache_slot *slot = &_c->slots[i];
+		const char *data = _c->data + (size_t)i * SLOT_SIZE;
+		if (slot->hash == hash && slot->keylen == keylen
+				&& memcmp(data, _key, keylen) == 0)
+			return slot;
+	}
+	return NULL;
+}
+
+
+void
+store(struct cache *_c, const char *_key, uint64_t _validator,
+		const char *_data)
+{
+	struct cache_meta meta = { _validator, 0, 0, "text/html" };
+	struct buffer_list *bl = buffer_list_new();
+
+	buffer_list_add_string(bl, _data);
+	if (! cache_store(_c, _key, &meta, bl))
+		errx(1, "cache_store(%s) failed", _key);
+	buffer_list_free(bl);
+	free(bl);
+}
+
+
+void
+check_hit(struct cache *_c, const char *_key, uint64_t _validator,
+		const char *_data)
+{
+	struct buffer *b = cache_lookup(_c, _key, _validator, NULL);
+	if (b == NULL)
+		errx(1, "%s: miss", _key);
+	if (b->size != strlen(_data) || memcmp(b->data, _data, b->size) != 0)
+		errx(1, "%s: wrong data", _key);
+	free(b);
+}
+
+
+void
+test_lookup(const char *_file)
+{
+	struct cache_meta meta = { 1, 2, 3, "application/xhtml+xml" };
+	struct cache_meta hit;
+	struct cache *c = cache_open(_file, NSLOTS, SLOT_SIZE);
+	if (c == NULL)
+		errx(1, "cache_open");
+
+	struct buffer_list *bl = buffer_list_new();
+	buffer_list_add_string(bl, "<p>");
+	buffer_list_add_string(bl, "Hello</p>");
+	if (! cache_store(c, "/en/home.html", &meta, bl))
+		errx(1, "cache_store failed");
+	buffer_list_free(bl);
+
+	struct buffer *b = cache_lookup(c, "/en/home.html", 1, &hit);
+	if (b == NULL || b->size != 12 || memcmp(b->data, "<p>Hello</p>", 12))
+		errx(1, "cache_lookup: wrong entry");
+	free(b);
+	if (hit.validator != 1 || hit.access != 2 || hit.modified != 3
+			|| strcmp(hit.type, "application/xhtml+xml") != 0)
+		errx(1, "cache_lookup: wrong meta data");
+	if (cache_lookup(c, "/en/home.html", 4, NULL) != NULL)
+		errx(1, "cache_lookup: hit with another validator");
+	if (cache_lookup(c, "/en/home.htm", 1, NULL) != NULL)
+		errx(1, "cache_lookup: hit with another key");
+	if (c->header->hits != 1 || c->header->misses != 2)
+		errx(1, "%llu hits, %llu misses",
+				(unsigned long long)c->header->hits,
+				(unsigned long long)c->header->misses);
+
+	// A stale entry is only served with the same access control inputs
+	if ((b = cache_lookup_stale(c, "/en/home.html", 2, &hit)) == NULL)
+		errx(1, "cache_lookup_stale: miss");
+	free(b);
+	if (cache_lookup_stale(c, "/en/home.html", 5, NULL) != NULL)
+		errx(1, "cache_lookup_stale: hit with other access inputs");
+
+	// Replacing the entry keeps a single copy
+	meta.validator = 4;
+	buffer_list_add_string(bl, "<p>Changed</p>");
+	if (! cache_store(c, "/en/home.html", &meta, bl))
+		errx(1, "cache_store failed");
+	check_hit(c, "/en/home.html", 4, "<p>Changed</p>");
+	if (cache_lookup(c, "/en/home.html", 1, NULL) != NULL)
+		errx(1, "cache_lookup: old entry still found");
+
+	// Entries larger than a slot are not stored
+	char big[SLOT_SIZE + 1];
+	memset(big, 'x', SLOT_SIZE);
+	big[SLOT_SIZE] = '\0';
+	buffer_list_free(bl);
+	buffer_list_add_string(bl, big);
+	if (cache_store(c, "/en/big.html", &meta, bl))
+		errx(1, "cache_store: entry larger than a slot stored");
+	buffer_list_free(bl);
+	free(bl);
+	cache_close(c);
+
+	// The entries survive with the same geometry only
+	if ((c = cache_open(_file, NSLOTS, SLOT_SIZE)) == NULL)
+		errx(1, "cache_open");
+	check_hit(c, "/en/home.html", 4, "<p>Changed</p>");
+	cache_close(c);
+	if ((c = cache_open(_file, NSLOTS * 2, SLOT_SIZE)) == NULL)
+		errx(1, "cache_open");
+	if (cache_lookup(c, "/en/home.html", 4, NULL) != NULL)
+		errx(1, "cache_lookup: entry kept with another geometry");
+	cache_close(c);
+}
+
+
+void
+test_seqlock(const char *_file)
+{
+	struct cache *c = cache_open(_file, NSLOTS, SLOT_SIZE);
+	if (c == NULL)
+		errx(1, "cache_open");
+	store(c, "/de/page.html", 1, "<p>Seite</p>");
+	struct cache_slot *slot = find_slot(c, "/de/page.html");
+	if (slot == NULL || (slot->seq & 1))
+		errx(1, "no slot for the entry");
+
+	// An odd sequence number marks a slot being written
+	slot->seq++;
+	if (cache_lookup(c, "/de/page.html", 1, NULL) != NULL)
+		errx(1, "cache_lookup: hit on a slot being written");
+	struct cache_meta meta = { 2, 0, 0, "text/html" };
+	struct buffer_list *bl = buffer_list_new();
+	buffer_list_add_string(bl, "<p>Neu</p>");
+	if (cache_store(c, "/de/page.html", &meta, bl))
+		errx(1, "cache_store: stored into a slot being written");
+	buffer_list_free(bl);
+	free(bl);
+	slot->seq++;
+	check_hit(c, "/de/page.html", 1, "<p>Seite</p>");
+
+	// A store leaves the sequence number even and advanced
+	uint32_t seq = slot->seq;
+	store(c, "/de/page.html", 2, "<p>Neu</p>");
+	if (slot->seq != seq + 2)
+		errx(1, "sequence number %u after the store", slot->seq);
+	check_hit(c, "/de/page.html", 2, "<p>Neu</p>");
+	cache_close(c);
+}
+
+
+void
+test_eviction(const char *_file)
+{
+	char key[32];
+	int i, n;
+
+	unlink(_file);
+	struct cache *c = cache_open(_file, NSLOTS, SLOT_SIZE);
+	if (c == NULL)
+		errx(1, "cache_open");
+	// Every key probes all slots
+	for (i = 0; i < NSLOTS; i++) {
+		snprintf(key, sizeof(key), "/page%d.html", i);
+		store(c, key, 1, key);
+	}
+	for (i = 0; i < NSLOTS; i++) {
+		snprintf(key, sizeof(key), "/page%d.html", i);
+		check_hit(c, key, 1, key);
+	}
+
+	// All slots are referenced, one of them is taken anyway
+	store(c, "/new1.html", 1, "new1");
+	for (i = 0, n = 0; i < NSLOTS; i++) {
+		snprintf(key, sizeof(key), "/page%d.html", i);
+		if (find_slot(c, key))
+			n++;
+	}
+	if (n != NSLOTS - 1 || find_slot(c, "/new1.html") == NULL)
+		errx(1, "%d old entries left", n);
+
+	// Referenced entries get a second chance
+	for (i = 0; i < NSLOTS; i++) {
+		snprintf(key, sizeof(key), "/page%d.html", i);
+		if (find_slot(c, key))
+			break;
+	}
+	check_hit(c, key, 1, key);
+	store(c, "/new2.html", 1, "new2");
+	if (find_slot(c, key) == NULL)
+		errx(1, "referenced entry %s evicted", key);
+	if (find_slot(c, "/new1.html") == NULL)
+		errx(1, "new entry evicted");
+	if (find_slot(c, "/new2.html") == NULL)
+		errx(1, "entry not stored");
+	cache_close(c);
+}
+
+
+void
+test_chunks(const char *_file)
+{
+	struct cache_meta meta = { 7, 0, 0, "" };
+	char data[4 * SLOT_SIZE];
+
+	unlink(_file);
+	struct cache *c = cache_open(_file, 4 * NSLOTS, SLOT_SIZE);
+	if (c == NULL)
+		errx(1, "cache_open");
+	for (size_t i = 0; i < sizeof(data); i++)
+		data[i] = 'a' + i % 26;
+
+	struct buffer_list *bl = buffer_list_new();
+	buffer_list_add(bl, data, sizeof(data));
+	if (! cache_store_chunks(c, "nav", &meta, bl))
+		errx(1, "cache_store_chunks failed");
+	buffer_list_free(bl);
+	free(bl);
+	struct buffer *b = cache_lookup_chunks(c, "nav", 7);
+	if (b == NULL || b->size != sizeof(data)
+			|| memcmp(b->data, data, sizeof(data)) != 0)
+		errx(1, "cache_lookup_chunks: wrong data");
+	free(b);
+	if (cache_lookup_chunks(c, "nav", 8) != NULL)
+		errx(1, "cache_lookup_chunks: hit with another validator");
+
+	// A missing chunk misses the whole entry
+	struct cache_slot *slot = find_slot(c, "nav/2");
+	if (slot == NULL)
+		errx(1, "no third chunk");
+	slot->keylen = 0;
+	if (cache_lookup_chunks(c, "nav", 7) != NULL)
+		errx(1, "cache_lookup_chunks: hit with a missing chunk");
+	if (c->header->chunk_hits != 1 || c->header->chunk_misses != 2)
+		errx(1, "%llu chunk hits, %llu chunk misses",
+				(unsigned long long)c->header->chunk_hits,
+				(unsigned long long)c->header->chunk_misses);
+	cache_close(c);
+}
+
+
+void
+test_negative(const char *_file)
+{
+	struct cache *c = cache_open(_file, NSLOTS, SLOT_SIZE);
+	if (c == NULL)
+		errx(1, "cache_open");
+	if (cache_negative_lookup(c, "/en/missing.html", 1))
+		errx(1, "cache_negative_lookup: hit in an empty table");
+	cache_negative_store(c, "/en/missing.html", 1);
+	if (! cache_negative_lookup(c, "/en/missing.html", 1))
+		errx(1, "cache_negative_lookup: miss");
+	if (cache_negative_lookup(c, "/en/missing.html", 2))
+		errx(1, "cache_negative_lookup: hit with another validator");
+	cache_close(c);
+}
+
+
+/*
+ * A child process fills an entry while the parent waits for it.
+ */
+void
+test_fill_lock(const char *_file)
+{
+	int locked[2], release[2];
+	char ch = 0;
+
+	struct cache *c = cache_open(_file, NSLOTS, SLOT_SIZE);
+	if (c == NULL)
+		errx(1, "cache_open");
+	if (pipe(locked) == -1 || pipe(release) == -1)
+		err(1, "pipe");
+
+	pid_t pid = fork();
+	if (pid == -1)
+		err(1, "fork");
+	if (pid == 0) {
+		if (! cache_fill_begin(c, "/en/slow.html"))
+			_exit(1);
+		if (write(locked[1], &ch, 1) != 1
+				|| read(release[0], &ch, 1) != 1)
+			_exit(1);
+		store(c, "/en/slow.html", 3, "<p>Slow</p>");
+		cache_fill_end(c, "/en/slow.html");
+		_exit(0);
+	}
+
+	if (read(locked[0], &ch, 1) != 1)
+		errx(1, "child did not take the fill lock");
+	if (cache_fill_begin(c, "/en/slow.html"))
+		errx(1, "cache_fill_begin: lock taken twice");
+	// Other keys are not blocked
+	if (! cache_fill_begin(c, "/en/other.html"))
+		errx(1, "cache_fill_begin: other key blocked");
+	cache_fill_end(c, "/en/other.html");
+
+	if (write(release[1], &ch, 1) != 1)
+		err(1, "write");
+	struct buffer *b = cache_fill_wait(c, "/en/slow.html", 3, NULL);
+	if (b == NULL || b->size != 11 || memcmp(b->data, "<p>Slow</p>", 11))
+		errx(1, "cache_fill_wait: no entry from the child");
+	free(b);
+	if (c->header->coalesced != 1)
+		errx(1, "%llu coalesced",
+				(unsigned long long)c->header->coalesced);
+
+	int status;
+	if (waitpid(pid, &status, 0) == -1)
+		err(1, "waitpid");
+	if (! WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		errx(1, "child failed");
+	if (! cache_fill_begin(c, "/en/slow.html"))
+		errx(1, "cache_fill_begin: lock not released");
+	cache_fill_end(c, "/en/slow.html");
+	cache_close(c);
+}
+
+
+int
+main(void)
+{
+	char file[] = "/tmp/cache_test.XXXXXXXXXX";
+	int fd = mkstemp(file);
+	if (fd == -1)
+		err(1, "mkstemp");
+	close(fd);
+
+	test_lookup(file);
+	test_seqlock(file);
+	test_eviction(file);
+	test_chunks(file);
+	test_negative(file);
+	test_fill_lock(file);
+	unlink(file);
+	return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2018 Markus Hennecke <markus-hennecke@markus-hennecke.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Picks the content coding from Accept-Encoding header values.
+ */
+
+#include <err.h>
+#include <stdio.h>
+
+#include "encoding.h"
+
+struct negotiate_test {
+	const char		*accept;
+	enum content_encoding	 gzip;	// result with only gzip enabled
+	enum content_encoding	 zstd;	// result with zstd enabled as well
+};
+
+static const struct negotiate_test tests[] = {
+	{ "", ENCODING_IDENTITY, ENCODING_IDENTITY },
+	{ "identity", ENCODING_IDENTITY, ENCODING_IDENTITY },
+	{ "gzip", ENCODING_GZIP, ENCODING_GZIP },
+	{ "GZip", ENCODING_GZIP, ENCODING_GZIP },
+	{ "x-gzip", ENCODING_GZIP, ENCODING_GZIP },
+	{ "deflate, br", ENCODING_IDENTITY, ENCODING_IDENTITY },
+	{ "gzip;q=0", ENCODING_IDENTITY, ENCODING_IDENTITY },
+	{ "gzip; q=0.0", ENCODING_IDENTITY, ENCODING_IDENTITY },
+	{ "gzip;Q=0.5", ENCODING_GZIP, ENCODING_GZIP },
+	{ "gzipx", ENCODING_IDENTITY, ENCODING_IDENTITY },
+	{ "*", ENCODING_GZIP, ENCODING_ZSTD },
+	{ "*;q=0", ENCODING_IDENTITY, ENCODING_IDENTITY },
+	{ "*;q=0, gzip", ENCODING_GZIP, ENCODING_GZIP },
+	{ "gzip;q=0, *", ENCODING_IDENTITY, ENCODING_ZSTD },
+	{ "gzip, deflate, br, zstd", ENCODING_GZIP, ENCODING_ZSTD },
+	{ "zstd;q=0.5, gzip", ENCODING_GZIP, ENCODING_GZIP },
+	{ "zstd, gzip;q=0.5", ENCODING_GZIP, ENCODING_ZSTD },
+	{ "zstd;q=0, gzip", ENCODING_GZIP, ENCODING_GZIP },
+	{ " gzip ;q=1 ,\tzstd", ENCODING_GZIP, ENCODING_ZSTD },
+};
+
+
+int
+main(void)
+{
+	if (encoding_negotiate(NULL) != ENCODING_IDENTITY)
+		errx(1, "encoding_negotiate(NULL) is not identity");
+	if (! encoding_enabled(ENCODING_GZIP)) {
+		printf("gzip disabled, skipping\n");
+		return 0;
+	}
+
+	for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+		enum content_encoding want = (encoding_enabled(ENCODING_ZSTD))
+			? tests[i].zstd : tests[i].gzip;
+		enum content_encoding got = encoding_negotiate(tests[i].accept);
+		if (got != want)
+			errx(1, "\"%s\": %s instead of %s", tests[i].accept,
+					encoding_name(got), encoding_name(want));
+	}
+	return 0;
+}
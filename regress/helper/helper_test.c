@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2018 Markus Hennecke <markus-hennecke@markus-hennecke.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Entity tags of the responses and their comparison with If-None-Match.
+ */
+
+#include <err.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "helper.h"
+
+struct match_test {
+	const char	*header;
+	bool		 match;
+};
+
+static const struct match_test match_tests[] = {
+	{ "\"00000000deadbeef\"", true },
+	{ "W/\"00000000deadbeef\"", true },
+	{ "\"0000000000000001\", \"00000000deadbeef\"", true },
+	{ "\"0000000000000001\",W/\"00000000deadbeef\"", true },
+	{ " \t\"00000000deadbeef\" ", true },
+	{ "\"00000000deadbeef\"\t, \"0000000000000001\"", true },
+	{ "", false },
+	{ "*", false },
+	{ "\"0000000000000001\"", false },
+	{ "\"00000000deadbeef", false },
+	{ "\"00000000deadbeef\"x", false },
+	{ "\"00000000deadbeef-gzip\"", false },
+	{ "x\"00000000deadbeef\"", false },
+	{ "w/\"00000000deadbeef\"", false },
+};
+
+static const struct match_test any_tests[] = {
+	{ "*", true },
+	{ " *\t", true },
+	{ "", false },
+	{ "**", false },
+	{ "*, \"00000000deadbeef\"", false },
+	{ "\"00000000deadbeef\"", false },
+};
+
+
+int
+main(void)
+{
+	char etag[ETAG_LEN];
+	size_t i;
+
+	format_etag(etag, sizeof(etag), 0xdeadbeef, NULL);
+	if (strcmp(etag, "\"00000000deadbeef\"") != 0)
+		errx(1, "format_etag: %s", etag);
+	for (i = 0; i < sizeof(match_tests) / sizeof(match_tests[0]); i++) {
+		if (etag_match(match_tests[i].header, etag)
+				!= match_tests[i].match)
+			errx(1, "etag_match(%s, %s) is not %d",
+					match_tests[i].header, etag,
+					match_tests[i].match);
+	}
+
+	// Each content coding has its own tag
+	format_etag(etag, sizeof(etag), 0xdeadbeef, "gzip");
+	if (strcmp(etag, "\"00000000deadbeef-gzip\"") != 0)
+		errx(1, "format_etag: %s", etag);
+	if (! etag_match("W/\"00000000deadbeef-gzip\"", etag))
+		errx(1, "etag_match: gzip tag not matched");
+	if (etag_match("\"00000000deadbeef\"", etag))
+		errx(1, "etag_match: identity tag matches the gzip one");
+
+	for (i = 0; i < sizeof(any_tests) / sizeof(any_tests[0]); i++) {
+		if (etag_match_any(any_tests[i].header) != any_tests[i].match)
+			errx(1, "etag_match_any(%s) is not %d",
+					any_tests[i].header, any_tests[i].match);
+	}
+	return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2018 Markus Hennecke <markus-hennecke@markus-hennecke.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Parses the ---cms header block at the top of page content.
+ */
+
+#include <err.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pageheader.h"
+
+struct parse_test {
+	const char	*data;
+	bool		 found;
+	size_t		 size;		// length of the block if found
+};
+
+static const struct parse_test tests[] = {
+	{ "", false, 0 },
+	{ "<p>No header</p>\n", false, 0 },
+	{ "---cms\n", false, 0 },
+	{ "---cms\nTITLE: Open\n", false, 0 },
+	{ "---cms\n---\n", true, 11 },
+	{ "---cms\n---", true, 10 },
+	{ "---cms\r\nSORT: 1\r\n---\r\nbody", true, 22 },
+	{ "---cms\nTITLE: A\n\nSSL\nSUB\n---\nbody", true, 29 },
+	{ " ---cms\nTITLE: A\n---\n", false, 0 },
+	{ "---CMS\nTITLE: A\n---\n", false, 0 },
+	{ "---cms \nTITLE: A\n---\n", false, 0 },
+	// An unknown key makes the block part of the content
+	{ "---cms\nTITLE: A\nAUTHOR: B\n---\nbody", false, 0 },
+	{ "---cms\nTitle: A\n---\n", false, 0 },
+	{ "---cms\nTITLE A\n---\n", false, 0 },
+	{ "---cms\n: A\n---\n", false, 0 },
+	{ "---cms\nSSLX\n---\n", false, 0 },
+};
+
+static void	 check_field(const struct page_header *,
+		enum page_header_field, const char *);
+
+
+void
+check_field(const struct page_header *_h, enum page_header_field _f,
+		const char *_value)
+{
+	if (_value == NULL) {
+		if (_h->value[_f] != NULL)
+			errx(1, "field %d is set", _f);
+		return;
+	}
+	if (_h->value[_f] == NULL || _h->len[_f] != strlen(_value)
+			|| memcmp(_h->value[_f], _value, _h->len[_f]) != 0)
+		errx(1, "field %d is not \"%s\"", _f, _value);
+}
+
+
+int
+main(void)
+{
+	struct page_header h;
+
+	for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+		const char *data = tests[i].data;
+		bool found = page_header_parse(&h, data, strlen(data));
+		if (found != tests[i].found)
+			errx(1, "\"%s\": found is %d", data, found);
+		if (h.size != tests[i].size)
+			errx(1, "\"%s\": size %zu instead of %zu", data,
+					h.size, tests[i].size);
+		if (! found && (h.flags != 0
+					|| h.value[PAGE_HEADER_TITLE] != NULL))
+			errx(1, "\"%s\": header not empty", data);
+	}
+
+	const char *page = "---cms\n"
+		"TITLE:  Welcome \n"
+		"SORT:010\n"
+		"LINK: Home\n"
+		"SSL\n"
+		"---\n"
+		"<p>Content</p>\n";
+	if (! page_header_parse(&h, page, strlen(page)))
+		errx(1, "header not found");
+	check_field(&h, PAGE_HEADER_TITLE, "Welcome");
+	check_field(&h, PAGE_HEADER_SORT, "010");
+	check_field(&h, PAGE_HEADER_LINK, "Home");
+	check_field(&h, PAGE_HEADER_DESCR, NULL);
+	if (h.flags != PAGE_HEADER_SSL)
+		errx(1, "flags %x", h.flags);
+	if (strcmp(page + h.size, "<p>Content</p>\n") != 0)
+		errx(1, "content after the header: %s", page + h.size);
+
+	// The block has to end within PAGE_HEADER_MAX bytes
+	size_t len = PAGE_HEADER_MAX + 64;
+	char *big = malloc(len);
+	if (big == NULL)
+		err(1, NULL);
+	memset(big, '\n', len);
+	memcpy(big, "---cms\n", 7);
+	memcpy(big + len - 4, "---\n", 4);
+	if (page_header_parse(&h, big, len))
+		errx(1, "header beyond PAGE_HEADER_MAX found");
+	memcpy(big + PAGE_HEADER_MAX - 4, "---\n", 4);
+	if (! page_header_parse(&h, big, len) || h.size != PAGE_HEADER_MAX)
+		errx(1, "header within PAGE_HEADER_MAX not found");
+	free(big);
+	return 0;
+}
@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2018 Markus Hennecke <markus-hennecke@markus-hennecke.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Splits sitemaps with more than SITEMAP_MAX_URLS URLs or more than
+ * SITEMAP_MAX_SIZE bytes into parts and lists them in the index.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "buffer.h"
+#include "sitemap.h"
+
+static void		 sink_write(struct sitemap_sink *, const void *,
+		size_t);
+static char		*write_part(struct sitemap *, size_t);
+static size_t		 count(const char *, const char *);
+static struct sitemap	*sitemap_test_new(void);
+static void		 add_urls(struct sitemap *, const char *, size_t,
+		time_t);
+
+
+void
+sink_write(struct sitemap_sink *_sink, const void *_data, size_t _size)
+{
+	buffer_list_add(_sink->arg, _data, _size);
+}
+
+
+char *
+write_part(struct sitemap *_s, size_t _part)
+{
+	struct buffer_list *bl = buffer_list_new();
+	struct sitemap_sink sink = { sink_write, bl };
+
+	if (_part)
+		sitemap_write(_s, _part, &sink);
+	else
+		sitemap_write_index(_s, "https://example.org/sitemap", ".xml",
+				&sink);
+	char *xml = buffer_list_concat_string(bl);
+	buffer_list_free(bl);
+	free(bl);
+	return xml;
+}
+
+
+size_t
+count(const char *_xml, const char *_s)
+{
+	size_t n = 0;
+	for (const char *p = _xml; (p = strstr(p, _s)) != NULL; p++)
+		n++;
+	return n;
+}
+
+
+struct sitemap *
+sitemap_test_new(void)
+{
+	struct sitemap *s = calloc(1, sizeof(struct sitemap));
+	if (s == NULL)
+		err(1, NULL);
+	TAILQ_INIT(&s->languages);
+	return s;
+}
+
+
+/*
+ * Adds a language with _n pages, page i changed at _mtime + i.
+ */
+void
+add_urls(struct sitemap *_s, const char *_lang, size_t _n, time_t _mtime)
+{
+	char url[128];
+	struct lang_entry *lang = lang_entry_new(_lang);
+
+	for (size_t i = 0; i < _n; i++) {
+		snprintf(url, sizeof(url), "https://example.org/%s/page%zu.html",
+				_lang, i);
+		struct url_entry *u = url_entry_new(url, _mtime + i);
+		TAILQ_INSERT_TAIL(&lang->pages, u, entries);
+	}
+	TAILQ_INSERT_TAIL(&_s->languages, lang, entries);
+}
+
+
+int
+main(void)
+{
+	struct sitemap *s = sitemap_test_new();
+	char *xml;
+
+	// An empty sitemap is a single file
+	if (sitemap_parts(s) != 1)
+		errx(1, "empty sitemap has %zu parts", sitemap_parts(s));
+	xml = write_part(s, 1);
+	if (count(xml, "<urlset") != 1 || count(xml, "</urlset>") != 1
+			|| count(xml, "<url>") != 0)
+		errx(1, "empty sitemap: %s", xml);
+	free(xml);
+
+	// Exactly SITEMAP_MAX_URLS URLs still fit into a single file
+	add_urls(s, "de", SITEMAP_MAX_URLS - 20000, 1000000);
+	add_urls(s, "en", 20000 - 1, 2000000);
+	if (sitemap_parts(s) != 1)
+		errx(1, "%d URLs in %zu parts", SITEMAP_MAX_URLS - 1,
+				sitemap_parts(s));
+	add_urls(s, "fr", 1, 3000000);
+	if (sitemap_parts(s) != 1)
+		errx(1, "%d URLs in %zu parts", SITEMAP_MAX_URLS,
+				sitemap_parts(s));
+
+	// One more starts the second part
+	add_urls(s, "it", 2, 4000000);
+	if (sitemap_parts(s) != 2)
+		errx(1, "%d URLs in %zu parts", SITEMAP_MAX_URLS + 2,
+				sitemap_parts(s));
+	xml = write_part(s, 1);
+	if (count(xml, "<url>") != SITEMAP_MAX_URLS
+			|| count(xml, "</urlset>") != 1)
+		errx(1, "part 1 has %zu URLs", count(xml, "<url>"));
+	if (strstr(xml, "/it/") != NULL || strstr(xml, "/fr/page0.html") == NULL)
+		errx(1, "part 1 has the wrong URLs");
+	free(xml);
+	xml = write_part(s, 2);
+	if (count(xml, "<url>") != 2 || count(xml, "<urlset") != 1
+			|| strstr(xml, "<loc>https://example.org/it/page0.html"
+				"</loc><lastmod>1970-02-16T07:06:40Z</lastmod>")
+			== NULL)
+		errx(1, "part 2: %s", xml);
+	free(xml);
+
+	// The index lists each part with its newest change
+	xml = write_part(s, 0);
+	if (count(xml, "<sitemap>") != 2
+			|| strstr(xml, "<loc>https://example.org/sitemap1.xml"
+				"</loc><lastmod>1970-02-04T17:20:00Z</lastmod>")
+			== NULL
+			|| strstr(xml, "<loc>https://example.org/sitemap2.xml"
+				"</loc><lastmod>1970-02-16T07:06:41Z</lastmod>")
+			== NULL)
+		errx(1, "index: %s", xml);
+	free(xml);
+	sitemap_free(s);
+
+	// A part ends before it grows beyond SITEMAP_MAX_SIZE
+	size_t len = SITEMAP_MAX_SIZE / 3;
+	char *url = malloc(len + 1);
+	if (url == NULL)
+		err(1, NULL);
+	memset(url, 'x', len);
+	url[len] = '\0';
+	s = sitemap_test_new();
+	struct lang_entry *lang = lang_entry_new("en");
+	for (int i = 0; i < 4; i++) {
+		struct url_entry *u = url_entry_new(url, 0);
+		TAILQ_INSERT_TAIL(&lang->pages, u, entries);
+	}
+	TAILQ_INSERT_TAIL(&s->languages, lang, entries);
+	free(url);
+	if (sitemap_parts(s) != 2)
+		errx(1, "4 URLs of %zu bytes in %zu parts", len,
+				sitemap_parts(s));
+	xml = write_part(s, 1);
+	if (count(xml, "<url>") != 2 || strlen(xml) > SITEMAP_MAX_SIZE)
+		errx(1, "part 1 has %zu URLs in %zu bytes",
+				count(xml, "<url>"), strlen(xml));
+	free(xml);
+	sitemap_free(s);
+	return 0;
+}
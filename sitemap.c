@@ -15,6 +15,7 @@
  */
 
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #include <err.h>
 #include <fcntl.h>
@@ -25,20 +26,58 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "catalog.h"
 #include "filehelper.h"
-#include "buffer.h"
+#include "generation.h"
+#include "helper.h"
+#include "pageheader.h"
 #include "sitemap.h"
 
+// Size of the pieces passed to a sitemap_sink
+#define SITEMAP_CHUNK		16384
+// Length of a time stamp formatted by format_time()
+#define SITEMAP_TIME_LEN	20
+
+static const char sitemap_head[] =
+	"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	"<urlset xmlns=\"http://www.sitemaps.org/schemas/sitemap/0.9\" "
+	"xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" "
+	"xsi:schemaLocation="
+	"\"http://www.sitemaps.org/schemas/sitemap/0.9\n"
+	"http://www.sitemaps.org/schemas/sitemap/0.9/sitemap.xsd\">\n";
+static const char sitemap_tail[] = "</urlset>";
+static const char url_head[] = "<url><loc>";
+static const char url_lastmod[] = "</loc><lastmod>";
+static const char url_tail[] = "</lastmod></url>";
+static const char index_head[] =
+	"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	"<sitemapindex "
+	"xmlns=\"http://www.sitemaps.org/schemas/sitemap/0.9\">\n";
+static const char index_tail[] = "</sitemapindex>";
+
+// Collects the output into chunks for the sink
+struct sitemap_out {
+	struct sitemap_sink	*sink;
+	size_t			 len;
+	char			 buf[SITEMAP_CHUNK];
+};
+
 
 static char			*concat_path(const char *, const char *);
 static struct lang_entry	*read_language_dir(const char *, const char *,
     const char *);
 static struct url_entry		*read_pages_dir(const char *, const char *,
     const char *, const char *);
-static char			*format_time(time_t);
+static void			 format_time(char *, size_t, time_t);
 static char			*format_url(const char *, const char *,
     const char *, bool ssl);
-static struct buffer_list	*create_xml_buffers(struct sitemap *);
+static void			 out_add(struct sitemap_out *, const char *,
+    size_t);
+static void			 out_flush(struct sitemap_out *);
+static size_t			 sitemap_run(struct sitemap *, size_t,
+    struct sitemap_out *, time_t *);
+static uint64_t			 stat_validator(const struct stat *);
+static uint64_t			 catalog_validator(const char *, const char *);
 
 
 struct url_entry *
@@ -68,6 +107,7 @@ lang_entry_new(const char *_lang)
 	lang->lang = strdup(_lang);
 	TAILQ_INIT(&lang->pages);
 	lang->dir = NULL;
+	lang->newest = 0;
 	return lang;
 }
 
@@ -83,6 +123,7 @@ lang_entry_free(struct lang_entry *_lang)
 		}
 		dir_list_free(_lang->dir);
 		free(_lang->lang);
+		free(_lang);
 	}
 }
 
@@ -98,6 +139,7 @@ sitemap_free(struct sitemap *_sitemap)
 		}
 		free(_sitemap->hostname);
 		dir_list_free(_sitemap->dir);
+		pack_close(_sitemap->pack);
 		free(_sitemap);
 	}
 }
@@ -110,14 +152,27 @@ read_pages_dir(const char *_content_dir, const char *_lang, const char *_page,
 	char *path;
 	if (asprintf(&path, "%s/%s/%s", _content_dir, _lang, _page) == -1)
 		err(1, NULL);
-	struct dir_list *dir = get_dir_entries(path);
+	struct dir_list *dir = get_dir_entries(path, DIR_LIST_STAT);
 	if (! dir)
 		err(1, NULL);
-	char *url_string = format_url(_hostname, _lang, _page,
-				dir_entry_exists("SSL", dir)); 
+	bool ssl = dir_entry_exists("SSL", dir);
+	int fd;
+	// Only a page without LINK has a header
+	if (! ssl && ! dir_entry_exists("LINK", dir)
+			&& (fd = open(path, O_DIRECTORY | O_RDONLY)) != -1) {
+		struct page_header h;
+		char buf[PAGE_HEADER_MAX];
+		page_header_read_at(fd, &h, buf, sizeof(buf));
+		ssl = ((h.flags & PAGE_HEADER_SSL) != 0);
+		close(fd);
+	}
+	char *url_string = format_url(_hostname, _lang, _page, ssl);
 	struct url_entry *url = url_entry_new(url_string, dir->newest);
-	url->dir = dir;
+	// Only the newest time stamp of the files is needed
+	url->dir = NULL;
+	dir_list_free(dir);
 
+	free(url_string);
 	free(path);
 	return url;
 }
@@ -128,7 +183,7 @@ read_language_dir(const char *_content_dir, const char *_lang,
     const char *_hostname)
 {
 	char *lang_path = concat_path(_content_dir, _lang);
-	struct dir_list *dir = get_dir_entries(lang_path);
+	struct dir_list *dir = get_dir_entries(lang_path, DIR_LIST_STAT);
 	free(lang_path);
 	if (! dir)
 		err(1, NULL);
@@ -136,10 +191,11 @@ read_language_dir(const char *_content_dir, const char *_lang,
 	if (!l)
 		err(1, NULL);
 	l->dir = dir;
+	l->newest = dir->newest;
 
 	struct dir_entry *entry;
 	TAILQ_FOREACH(entry, &dir->entries, entries) {
-		if ((entry->sb.st_mode & S_IFDIR) == 0)
+		if (! dir_entry_is_dir(entry))
 			continue;
 
 		struct url_entry *url = read_pages_dir(_content_dir, _lang,
@@ -157,8 +213,9 @@ sitemap_new(const char *_content_dir, const char *_hostname)
 	struct sitemap *sitemap = malloc(sizeof(struct sitemap));
 	TAILQ_INIT(&sitemap->languages);
 	sitemap->hostname = strdup(_hostname);
+	sitemap->pack = NULL;
 
-	sitemap->dir = get_dir_entries(_content_dir);
+	sitemap->dir = get_dir_entries(_content_dir, DIR_LIST_TYPE);
 	if (sitemap->dir == NULL) {
 		warn(NULL);
 		goto bailout;
@@ -166,7 +223,7 @@ sitemap_new(const char *_content_dir, const char *_hostname)
 
 	struct dir_entry *file;
 	TAILQ_FOREACH(file, &sitemap->dir->entries, entries) {
-		if ((file->sb.st_mode & S_IFDIR) == 0)
+		if (! dir_entry_is_dir(file))
 			continue;
 
 		struct lang_entry *l = read_language_dir(_content_dir,
@@ -176,67 +233,189 @@ sitemap_new(const char *_content_dir, const char *_hostname)
 	return sitemap;
 
 bailout:
-	free(sitemap->hostname);
 	sitemap_free(sitemap);
 	return NULL;
 }
 
 
-struct buffer_list *
-create_xml_buffers(struct sitemap *s)
+/*
+ * Builds the sitemap from a content pack instead of the content directory.
+ * The sitemap takes over the pack and closes it in sitemap_free().
+ */
+struct sitemap *
+sitemap_new_pack(struct pack *_pack, const char *_hostname)
 {
-	struct buffer_list *xml = buffer_list_new();
-
-	buffer_list_add_string(xml,
-		"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-		"<urlset xmlns=\"http://www.sitemaps.org/schemas/sitemap/0.9\" "
-		"xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" "
-		"xsi:schemaLocation="
-		"\"http://www.sitemaps.org/schemas/sitemap/0.9\n"
-		"http://www.sitemaps.org/schemas/sitemap/0.9/sitemap.xsd\">\n");
+	struct catalog *c = _pack->catalog;
+	struct sitemap *sitemap = malloc(sizeof(struct sitemap));
+	if (sitemap == NULL)
+		err(1, NULL);
+	TAILQ_INIT(&sitemap->languages);
+	sitemap->hostname = strdup(_hostname);
+	sitemap->dir = NULL;
+	sitemap->pack = _pack;
+
+	for (uint32_t i = 0; i < c->header->nlangs; i++) {
+		const char *lang = catalog_str(c, &c->langs[i].name);
+		struct lang_entry *l = lang_entry_new(lang);
+		l->newest = _pack->sb.st_mtim.tv_sec;
+
+		struct catalog_page *pages = catalog_lang_pages(c, &c->langs[i]);
+		for (uint32_t j = 0; j < c->langs[i].npages; j++) {
+			char *url_string = format_url(_hostname, lang,
+					catalog_str(c, &pages[j].name),
+					(pages[j].flags & CATALOG_SSL));
+			struct url_entry *url = url_entry_new(url_string,
+					pages[j].mtime);
+			url->dir = NULL;
+			free(url_string);
+			TAILQ_INSERT_TAIL(&l->pages, url, entries);
+		}
+		TAILQ_INSERT_TAIL(&sitemap->languages, l, entries);
+	}
+	return sitemap;
+}
+
+
+void
+out_add(struct sitemap_out *_o, const char *_data, size_t _len)
+{
+	if (_o->len + _len > sizeof(_o->buf))
+		out_flush(_o);
+	if (_len > sizeof(_o->buf)) {
+		_o->sink->write(_o->sink, _data, _len);
+		return;
+	}
+	memcpy(_o->buf + _o->len, _data, _len);
+	_o->len += _len;
+}
+
+
+void
+out_flush(struct sitemap_out *_o)
+{
+	if (_o->len)
+		_o->sink->write(_o->sink, _o->buf, _o->len);
+	_o->len = 0;
+}
+
+
+/*
+ * Splits the URLs into parts within SITEMAP_MAX_URLS and SITEMAP_MAX_SIZE
+ * and returns their number. The URLs of part _part, counted from 1, are
+ * written to _o if it is not NULL, the time stamps of the parts raise the
+ * entries of _newest if that is not NULL.
+ */
+size_t
+sitemap_run(struct sitemap *_s, size_t _part, struct sitemap_out *_o,
+    time_t *_newest)
+{
+	const size_t fixed = sizeof(url_head) + sizeof(url_lastmod)
+	    + sizeof(url_tail) - 3 + SITEMAP_TIME_LEN;
+	const size_t limit = SITEMAP_MAX_SIZE - (sizeof(sitemap_head) - 1)
+	    - (sizeof(sitemap_tail) - 1);
+	char lastmod[SITEMAP_TIME_LEN + 1];
+	size_t part = 1, nurls = 0, size = 0;
+
 	struct lang_entry *lang;
-	TAILQ_FOREACH(lang, &s->languages, entries) {
+	TAILQ_FOREACH(lang, &_s->languages, entries) {
 		struct url_entry *url;
 		TAILQ_FOREACH(url, &lang->pages, entries) {
-			buffer_list_add_string(xml, "<url><loc>");
-			buffer_list_add_string(xml, url->url);
-			buffer_list_add_string(xml, "</loc><lastmod>");
-			char *isots = format_time(url->mtime);
-			buffer_list_add_string(xml, isots);
-			free(isots);
-			buffer_list_add_string(xml, "</lastmod></url>");
+			size_t urllen = strlen(url->url);
+			if (nurls == SITEMAP_MAX_URLS
+			    || (nurls && size + fixed + urllen > limit)) {
+				if (_o && part == _part)
+					return part;
+				part++;
+				nurls = 0;
+				size = 0;
+			}
+			nurls++;
+			size += fixed + urllen;
+			if (_newest && url->mtime > _newest[part - 1])
+				_newest[part - 1] = url->mtime;
+			if (_o == NULL || part != _part)
+				continue;
+			format_time(lastmod, sizeof(lastmod), url->mtime);
+			out_add(_o, url_head, sizeof(url_head) - 1);
+			out_add(_o, url->url, urllen);
+			out_add(_o, url_lastmod, sizeof(url_lastmod) - 1);
+			out_add(_o, lastmod, SITEMAP_TIME_LEN);
+			out_add(_o, url_tail, sizeof(url_tail) - 1);
 		}
 	}
-	buffer_list_add_string(xml, "</urlset>");
-	return xml;
+	return part;
 }
 
-char *
-sitemap_toxml(struct sitemap *_s)
+
+/*
+ * Returns the number of files the sitemap needs.
+ */
+size_t
+sitemap_parts(struct sitemap *_s)
 {
-	struct buffer_list *xml = create_xml_buffers(_s);
-	char *xml_string = buffer_list_concat_string(xml);
-	buffer_list_free(xml);
-	return xml_string;
+	return sitemap_run(_s, 0, NULL, NULL);
 }
 
 
-char *
-sitemap_toxmlgz(struct sitemap *_s, size_t *_size, const char *_filename,
-		uint32_t _mtime)
+/*
+ * Writes part _part, counted from 1, of the sitemap to _sink while it is
+ * generated.
+ */
+void
+sitemap_write(struct sitemap *_s, size_t _part, struct sitemap_sink *_sink)
 {
-	struct buffer_list *xml = create_xml_buffers(_s);
-	struct buffer_list *gz = buffer_list_gzip(xml, _filename, _mtime);
+	struct sitemap_out *o = malloc(sizeof(struct sitemap_out));
+	if (o == NULL)
+		err(1, NULL);
+	o->sink = _sink;
+	o->len = 0;
+
+	out_add(o, sitemap_head, sizeof(sitemap_head) - 1);
+	sitemap_run(_s, _part, o, NULL);
+	out_add(o, sitemap_tail, sizeof(sitemap_tail) - 1);
+	out_flush(o);
+	free(o);
+}
 
-	char *result = buffer_list_concat(gz);
-	*_size = gz->size;
 
-	buffer_list_free(gz);
-	buffer_list_free(xml);
+/*
+ * Writes the sitemap index listing the parts of the sitemap. The URL of a
+ * part is _base, its number and _suffix.
+ */
+void
+sitemap_write_index(struct sitemap *_s, const char *_base,
+    const char *_suffix, struct sitemap_sink *_sink)
+{
+	char lastmod[SITEMAP_TIME_LEN + 1];
+	char *entry;
 
-	return result;
-}
+	size_t nparts = sitemap_parts(_s);
+	time_t *newest = calloc(nparts, sizeof(time_t));
+	if (newest == NULL)
+		err(1, NULL);
+	sitemap_run(_s, 0, NULL, newest);
 
+	struct sitemap_out *o = malloc(sizeof(struct sitemap_out));
+	if (o == NULL)
+		err(1, NULL);
+	o->sink = _sink;
+	o->len = 0;
+	out_add(o, index_head, sizeof(index_head) - 1);
+	for (size_t i = 0; i < nparts; i++) {
+		format_time(lastmod, sizeof(lastmod), newest[i]);
+		int len = asprintf(&entry, "<sitemap><loc>%s%zu%s</loc>"
+		    "<lastmod>%s</lastmod></sitemap>\n", _base, i + 1,
+		    _suffix, lastmod);
+		if (len == -1)
+			err(1, NULL);
+		out_add(o, entry, len);
+		free(entry);
+	}
+	out_add(o, index_tail, sizeof(index_tail) - 1);
+	out_flush(o);
+	free(o);
+	free(newest);
+}
 
 
 char *
@@ -249,20 +428,17 @@ concat_path(const char *_path1, const char *_path2)
 }
 
 
-char *
-format_time(time_t _datetime)
+/*
+ * Writes _datetime as W3C date and time, _buf takes SITEMAP_TIME_LEN + 1
+ * bytes.
+ */
+void
+format_time(char *_buf, size_t _size, time_t _datetime)
 {
-	char *result;
 	struct tm *tm;
 	if ((tm = gmtime(&_datetime)) == NULL)
 		err(1, NULL);
-
-	if (asprintf(&result, "%04d-%02d-%02dT%02d:%02d:%02dZ",
-				tm->tm_year + 1900, tm->tm_mon, tm->tm_mday,
-				tm->tm_hour, tm->tm_min, tm->tm_sec) == -1)
-		err(1, NULL);
-
-	return result;
+	strftime(_buf, _size, "%Y-%m-%dT%H:%M:%SZ", tm);
 }
 
 
@@ -287,15 +463,177 @@ sitemap_newest(struct sitemap *_sitemap, const char *_lang)
 	struct lang_entry *lang;
 	TAILQ_FOREACH(lang, &_sitemap->languages, entries) {
 		if (!_lang || (strcmp(_lang, lang->lang) == 0)) {
-			if (lang->dir->newest > result)
-				result = lang->dir->newest;
+			if (lang->newest > result)
+				result = lang->newest;
 			struct url_entry *url;
 			TAILQ_FOREACH(url, &lang->pages, entries) {
-				if (url->dir->newest > result)
-					result = url->dir->newest;
+				if (url->mtime > result)
+					result = url->mtime;
 			}
 		}
 	}
 
 	return result;
 }
+
+
+/*
+ * Hashes the identity and modification time of a file.
+ */
+uint64_t
+stat_validator(const struct stat *_sb)
+{
+	uint64_t v = HASH_FNV1A_INIT;
+
+	v = hash_fnv1a(v, &_sb->st_ino, sizeof(_sb->st_ino));
+	v = hash_fnv1a(v, &_sb->st_mtim, sizeof(_sb->st_mtim));
+	v = hash_fnv1a(v, &_sb->st_size, sizeof(_sb->st_size));
+	return (v != 0) ? v : 1;
+}
+
+
+/*
+ * Returns the validator of the content catalog if it still lists every
+ * page of the content directory. The last modification of a page edited
+ * in place only shows up once cms-index writes the catalog anew.
+ */
+uint64_t
+catalog_validator(const char *_content_dir, const char *_catalog_file)
+{
+	uint64_t v = 0;
+
+	struct catalog *c = catalog_open(_catalog_file);
+	if (c == NULL)
+		return 0;
+	int fd = open(_content_dir, O_RDONLY | O_DIRECTORY);
+	if (fd != -1) {
+		if (catalog_langs_fresh(c, fd))
+			v = stat_validator(&c->sb);
+		close(fd);
+	}
+	catalog_close(c);
+	return v;
+}
+
+
+/*
+ * Returns a validator for the sitemap that needs no page to be read, or 0
+ * if there is none. It comes from the stat data of the content pack, from
+ * the generations cms-watch publishes for every language or, as long as
+ * no page was added or removed since, from the stat data of the content
+ * catalog.
+ */
+uint64_t
+sitemap_validator(const char *_content_dir, struct pack *_pack,
+    const char *_generation_file, const char *_catalog_file)
+{
+	if (_pack)
+		return stat_validator(&_pack->sb);
+
+	struct generation *g = generation_open(_generation_file);
+	if (g == NULL)
+		return catalog_validator(_content_dir, _catalog_file);
+	uint64_t v = HASH_FNV1A_INIT;
+	struct dir_list *dir = get_dir_entries(_content_dir, DIR_LIST_TYPE);
+	if (dir == NULL) {
+		generation_close(g);
+		return 0;
+	}
+	uint64_t gen = generation_get(g, "", NULL);
+	v = hash_fnv1a(v, &gen, sizeof(gen));
+	struct dir_entry *e;
+	TAILQ_FOREACH(e, &dir->entries, entries) {
+		if (! dir_entry_is_dir(e))
+			continue;
+		char *key = generation_key(e->filename, "");
+		gen = generation_get(g, key, NULL);
+		free(key);
+		v = hash_fnv1a(v, e->filename, strlen(e->filename) + 1);
+		v = hash_fnv1a(v, &gen, sizeof(gen));
+	}
+	dir_list_free(dir);
+	generation_close(g);
+	return (v != 0) ? v : 1;
+}
+
+
+/*
+ * Opens the cached sitemap _path if it was stored for _validator. The
+ * body follows the header read into _h.
+ */
+int
+sitemap_cache_open(const char *_path, uint64_t _validator,
+    struct sitemap_cache_header *_h)
+{
+	struct stat sb;
+
+	int fd = open(_path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	if (pread(fd, _h, sizeof(*_h), 0) != sizeof(*_h)
+	    || fstat(fd, &sb) == -1
+	    || _h->magic != SITEMAP_CACHE_MAGIC
+	    || _h->version != SITEMAP_CACHE_VERSION
+	    || _h->validator != _validator
+	    || (uint64_t)sb.st_size != sizeof(*_h) + _h->size) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+/*
+ * Creates a temporary file next to the cached sitemap _path, the body is
+ * written after a header. Returns the file, its name is put into _tmp.
+ */
+int
+sitemap_cache_create(const char *_path, char **_tmp)
+{
+	if (asprintf(_tmp, "%s.XXXXXXXXXX", _path) == -1)
+		err(1, NULL);
+	int fd = mkstemp(*_tmp);
+	if (fd == -1 || lseek(fd, sizeof(struct sitemap_cache_header),
+	    SEEK_SET) == -1) {
+		warn("%s", *_tmp);
+		if (fd != -1) {
+			close(fd);
+			unlink(*_tmp);
+		}
+		free(*_tmp);
+		*_tmp = NULL;
+		return -1;
+	}
+	return fd;
+}
+
+
+/*
+ * Completes the file from sitemap_cache_create() with a body of _size
+ * bytes and replaces the cached sitemap _path with it. Readers see either
+ * the old or the new file. _fd is closed and _tmp freed either way.
+ */
+bool
+sitemap_cache_commit(int _fd, char *_tmp, const char *_path,
+    uint64_t _validator, time_t _newest, size_t _size)
+{
+	struct sitemap_cache_header h;
+
+	memset(&h, 0, sizeof(h));
+	h.magic = SITEMAP_CACHE_MAGIC;
+	h.version = SITEMAP_CACHE_VERSION;
+	h.validator = _validator;
+	h.newest = _newest;
+	h.size = _size;
+	bool ok = (pwrite(_fd, &h, sizeof(h), 0) == sizeof(h));
+	if (close(_fd) == -1)
+		ok = false;
+	if (ok && rename(_tmp, _path) == -1) {
+		warn("%s", _path);
+		ok = false;
+	}
+	if (! ok)
+		unlink(_tmp);
+	free(_tmp);
+	return ok;
+}
@@ -18,6 +18,33 @@
 #define __SITEMAP_H__
 
 #include <sys/queue.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "pack.h"
+
+#define SITEMAP_CACHE_MAGIC	0x50414d53	// "SMAP"
+#define SITEMAP_CACHE_VERSION	1
+
+// Limits of a single sitemap file, larger sitemaps are split into parts
+#define SITEMAP_MAX_URLS	50000
+#define SITEMAP_MAX_SIZE	(50 * 1024 * 1024)
+
+// Receives the sitemap in pieces while it is generated
+struct sitemap_sink {
+	void	(*write)(struct sitemap_sink *, const void *, size_t);
+	void	*arg;
+};
+
+// A cached sitemap file starts with this header, the body follows
+struct sitemap_cache_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	validator;
+	int64_t		newest;
+	uint64_t	size;
+};
 
 struct url_entry {
 	TAILQ_ENTRY(url_entry)	 entries;
@@ -31,11 +58,13 @@ struct lang_entry {
 	TAILQ_HEAD(, url_entry)	 pages;
 	struct dir_list		*dir;
 	char			*lang;
+	time_t			 newest;
 };
 
 struct sitemap {
 	TAILQ_HEAD(, lang_entry)	 languages;
 	struct dir_list			*dir;
+	struct pack			*pack;
 	char				*hostname;
 };
 
@@ -44,11 +73,21 @@ struct url_entry	*url_entry_new(char *, time_t);
 void			 lang_entry_free(struct lang_entry *);
 void			 url_entry_free(struct url_entry *);
 struct sitemap		*sitemap_new(const char *, const char *);
+struct sitemap		*sitemap_new_pack(struct pack *, const char *);
 void			 sitemap_free(struct sitemap *);
-char			*sitemap_toxml(struct sitemap *);
-char			*sitemap_toxmlgz(struct sitemap *, size_t *,
-    const char *, uint32_t);
+size_t			 sitemap_parts(struct sitemap *);
+void			 sitemap_write(struct sitemap *, size_t,
+    struct sitemap_sink *);
+void			 sitemap_write_index(struct sitemap *, const char *,
+    const char *, struct sitemap_sink *);
 uint32_t		 sitemap_newest(struct sitemap *, const char *);
+uint64_t		 sitemap_validator(const char *, struct pack *,
+    const char *, const char *);
+int			 sitemap_cache_open(const char *, uint64_t,
+    struct sitemap_cache_header *);
+int			 sitemap_cache_create(const char *, char **);
+bool			 sitemap_cache_commit(int, char *, const char *,
+    uint64_t, time_t, size_t);
 
 
 #endif //__SITEMAP_H__
@@ -15,16 +15,26 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include <err.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 
+#include "buffer.h"
 #include "filehelper.h"
+#include "helper.h"
 #include "sitemap.h"
 
 #ifndef CMS_CONTENT_DIR
@@ -33,20 +43,60 @@
 #ifndef CMS_HOSTNAME
 #error "Need CMS_HOSTNAME defined to compile"
 #endif
+#ifndef CMS_PACK_FILE
+#error "Need CMS_PACK_FILE defined to compile"
+#endif
+#ifndef CMS_CATALOG_FILE
+#error "Need CMS_CATALOG_FILE defined to compile"
+#endif
+#ifndef CMS_GENERATION_FILE
+#error "Need CMS_GENERATION_FILE defined to compile"
+#endif
+#ifndef CMS_CACHE_DIR
+#error "Need CMS_CACHE_DIR defined to compile"
+#endif
 
 enum page {
 	PAGE_SITEMAP,
-	PAGE_SITEMAP_GZ,
+	PAGE_INDEX,
+	PAGE_PART,
 	PAGE__MAX
 };
 
 
+// File names without the number of a part and the extension
 const char *const pages[PAGE__MAX] = {
-	"/sitemap.xml",    /* PAGE_SITEMAP */
-	"/sitemap.xml.gz", /* PAGE_SITEMAP_GZ */
+	"sitemap",       /* PAGE_SITEMAP */
+	"sitemap_index", /* PAGE_INDEX */
+	"sitemap-",      /* PAGE_PART */
+};
+
+// A requested file, file is its name without .gz
+struct sitemap_request {
+	enum page	 page;
+	size_t		 part;
+	bool		 gz;
+	char		 file[32];
+};
+
+// Passes the generated sitemap on to the client and to the cache
+struct output {
+	struct sitemap_sink	 sink;
+	struct buffer_gzip	*gzip;
+	int			 cache_fd;
+	char			*cache_tmp;
+	size_t			 cache_size;
 };
 
 static __dead void	usage(void);
+static __dead void	status_exit(const char *);
+static bool		parse_request(const char *, struct sitemap_request *);
+static void		output_headers(bool, int64_t, const char *, time_t);
+static void		check_modified(const char *, time_t);
+static void		send_file(int, int, off_t, size_t);
+static void		output_list(struct output *, struct buffer_list *);
+static void		output_write(struct sitemap_sink *, const void *,
+    size_t);
 
 __dead void
 usage(void)
@@ -58,14 +108,198 @@ usage(void)
 }
 
 
+__dead void
+status_exit(const char *_status)
+{
+	dprintf(STDOUT_FILENO, "Status: %s\r\n\r\n", _status);
+	exit(EXIT_SUCCESS);
+}
+
+
+/*
+ * Parses the file name in PATH_INFO, sitemap.xml, sitemap_index.xml or a
+ * part sitemap-N.xml counted from 1, each optionally with .gz.
+ */
+bool
+parse_request(const char *_path, struct sitemap_request *_r)
+{
+	const char *errstr;
+	char number[16];
+	size_t len = strlen(_path);
+
+	memset(_r, 0, sizeof(*_r));
+	if (*_path == '/') {
+		_path++;
+		len--;
+	}
+	_r->gz = (len > 3 && strcmp(_path + len - 3, ".gz") == 0);
+	if (_r->gz)
+		len -= 3;
+	if (len < 4 || strncmp(_path + len - 4, ".xml", 4) != 0)
+		return false;
+	len -= 4;
+
+	for (_r->page = 0; _r->page < PAGE__MAX; _r->page++) {
+		size_t plen = strlen(pages[_r->page]);
+		if (strncmp(_path, pages[_r->page], plen) != 0)
+			continue;
+		if (_r->page != PAGE_PART && len == plen)
+			break;
+		if (_r->page == PAGE_PART && len > plen
+		    && len - plen < sizeof(number)) {
+			memcpy(number, _path + plen, len - plen);
+			number[len - plen] = '\0';
+			_r->part = strtonum(number, 1, INT_MAX, &errstr);
+			if (errstr)
+				return false;
+			break;
+		}
+	}
+	if (_r->page == PAGE__MAX)
+		return false;
+	if (_r->page == PAGE_PART)
+		snprintf(_r->file, sizeof(_r->file), "%s%zu.xml",
+		    pages[_r->page], _r->part);
+	else
+		snprintf(_r->file, sizeof(_r->file), "%s.xml",
+		    pages[_r->page]);
+	return true;
+}
+
+
+/*
+ * Sends the headers, a negative _size leaves out the Content-length and
+ * the server sends the body chunked.
+ */
+void
+output_headers(bool _gz, int64_t _size, const char *_etag, time_t _newest)
+{
+	char last_modified[30];
+	int fd = STDOUT_FILENO;
+
+	strftime(last_modified, sizeof(last_modified), HTTP_DATE_FMT,
+	    gmtime(&_newest));
+	dprintf(fd, "Status: 200 OK\r\n");
+	if (_size >= 0)
+		dprintf(fd, "Content-length: %lld\r\n", (long long)_size);
+	dprintf(fd, "Content-type: application/xml\r\n");
+	if (_gz)
+		dprintf(fd, "Content-encoding: x-gzip\r\n");
+	if (_etag)
+		dprintf(fd, "ETag: %s\r\n", _etag);
+	dprintf(fd, "Last-Modified: %s\r\n", last_modified);
+	dprintf(fd, "\r\n");
+}
+
+
+/*
+ * Answers a conditional request for an unchanged sitemap with 304. The
+ * entity tag is NULL if the content has no validator.
+ */
+void
+check_modified(const char *_etag, time_t _newest)
+{
+	const char *if_none_match = getenv("HTTP_IF_NONE_MATCH");
+	const char *if_modified_since = getenv("HTTP_IF_MODIFIED_SINCE");
+	struct tm tm;
+
+	if (if_none_match) {
+		if (_etag == NULL || ! etag_match(if_none_match, _etag))
+			return;
+	} else if (if_modified_since) {
+		memset(&tm, 0, sizeof(tm));
+		if (strptime(if_modified_since, HTTP_DATE_FMT, &tm) == NULL
+		    || timegm(&tm) < _newest)
+			return;
+	} else
+		return;
+
+	dprintf(STDOUT_FILENO, "Status: 304 Not Modified\r\n");
+	if (_etag)
+		dprintf(STDOUT_FILENO, "ETag: %s\r\n", _etag);
+	dprintf(STDOUT_FILENO, "\r\n");
+	exit(EXIT_SUCCESS);
+}
+
+
+/*
+ * Copies _size bytes at _off of the file _in to _out, with sendfile(2)
+ * where there is one.
+ */
+void
+send_file(int _out, int _in, off_t _off, size_t _size)
+{
+#ifdef __linux__
+	while (_size > 0) {
+		ssize_t nw = sendfile(_out, _in, &_off, _size);
+		if (nw == -1 && errno == EINTR)
+			continue;
+		if (nw <= 0)
+			break;
+		_size -= nw;
+	}
+	if (_size == 0)
+		return;
+#endif
+	char *map = mmap(NULL, _off + _size, PROT_READ, MAP_PRIVATE, _in, 0);
+	if (map == MAP_FAILED) {
+		warn("mmap");
+		return;
+	}
+	struct buffer *b = buffer_ref_new(map + _off, _size);
+	buffer_write(b, _out);
+	free(b);
+	munmap(map, _off + _size);
+}
+
+
+/*
+ * Writes _bl to the client and to the cache file and frees it. A failed
+ * cache file is dropped.
+ */
+void
+output_list(struct output *_o, struct buffer_list *_bl)
+{
+	if (_bl->size) {
+		buffer_list_writev(_bl, STDOUT_FILENO);
+		if (_o->cache_fd != -1
+		    && buffer_list_writev(_bl, _o->cache_fd) == -1) {
+			close(_o->cache_fd);
+			unlink(_o->cache_tmp);
+			free(_o->cache_tmp);
+			_o->cache_fd = -1;
+		}
+		_o->cache_size += _bl->size;
+	}
+	buffer_list_free(_bl);
+	free(_bl);
+}
+
+
+void
+output_write(struct sitemap_sink *_sink, const void *_data, size_t _size)
+{
+	struct output *o = _sink->arg;
+	struct buffer_list *bl = buffer_list_new();
+
+	if (o->gzip)
+		buffer_gzip_add(o->gzip, _data, _size, bl);
+	else
+		buffer_list_add_ref(bl, _data, _size);
+	output_list(o, bl);
+}
+
+
 int
 main(int argc, char **argv)
 {
-	size_t size;
-	char *out;
-	size_t page = PAGE__MAX;
 	int fd = STDOUT_FILENO;
 	char *cms_root = CMS_CONTENT_DIR;
+	struct pack *pack = NULL;
+	struct sitemap_request req;
+	uint64_t validator = 0;
+	char etag[ETAG_LEN];
+	char *cache_file;
 
 	if (argc > 2)
 		usage();
@@ -73,39 +307,90 @@ main(int argc, char **argv)
 		if (argv[1][0] == '\0')
 			errx(1, "Require abolute path as argument");
 		cms_root = argv[1];
+	} else
+		pack = pack_open(CMS_PACK_FILE);
+	// Edits made after the pack was built are read from the content
+	if (pack && pack_outdated(pack, CMS_CATALOG_FILE)) {
+		pack_close(pack);
+		pack = NULL;
 	}
 
 	char *path_info = getenv("PATH_INFO");
-	if (path_info == NULL || strlen(path_info) == 0) {
-		page = 0;
-	} else {
-		for (page = 0; page < PAGE__MAX; ++page)
-			if (strcmp(pages[page], path_info) == 0)
-				break;
+	if (path_info == NULL || ! parse_request(path_info, &req))
+		parse_request("sitemap.xml", &req);
+
+	// The index holds absolute URLs of the parts
+	const char *https = getenv("HTTPS");
+	bool ssl = (https && strcmp(https, "on") == 0);
+	if (asprintf(&cache_file, "%s/%s%s%s", CMS_CACHE_DIR,
+	    (ssl && req.page != PAGE_PART) ? "ssl-" : "", req.file,
+	    (req.gz) ? ".gz" : "") == -1)
+		err(1, NULL);
+
+	// A cached sitemap is answered without reading any page
+	if (argc != 2)
+		validator = sitemap_validator(cms_root, pack,
+		    CMS_GENERATION_FILE, CMS_CATALOG_FILE);
+	if (validator) {
+		struct sitemap_cache_header h;
+		format_etag(etag, sizeof(etag), hash_fnv1a(validator,
+		    cache_file, strlen(cache_file)), NULL);
+		int cfd = sitemap_cache_open(cache_file, validator, &h);
+		if (cfd != -1) {
+			check_modified(etag, h.newest);
+			output_headers(req.gz, h.size, etag, h.newest);
+			send_file(fd, cfd, sizeof(h), h.size);
+			close(cfd);
+			pack_close(pack);
+			return EXIT_SUCCESS;
+		}
 	}
 
-	struct sitemap *sitemap = sitemap_new(cms_root, CMS_HOSTNAME);
+	struct sitemap *sitemap = (pack) ? sitemap_new_pack(pack, CMS_HOSTNAME)
+		: sitemap_new(cms_root, CMS_HOSTNAME);
+	if (sitemap == NULL)
+		status_exit("500 Internal Server Error");
 	uint32_t mtime = sitemap_newest(sitemap, NULL);
+	check_modified((validator) ? etag : NULL, mtime);
 
-	switch (page) {
-	default:
-	case PAGE_SITEMAP:
-		out = sitemap_toxml(sitemap);
-		size = strlen(out);
-		break;
-	case PAGE_SITEMAP_GZ:
-		out = sitemap_toxmlgz(sitemap, &size, "sitemap.xml", mtime);
-		break;
-	}
+	size_t nparts = sitemap_parts(sitemap);
+	if (req.page == PAGE_PART && req.part > nparts)
+		status_exit("404 Not Found");
+	// A sitemap too large for one file is answered with its index
+	if (req.page == PAGE_SITEMAP && nparts > 1)
+		req.page = PAGE_INDEX;
 
-	dprintf(fd, "Status: 200 OK\r\n");
-	dprintf(fd, "Content-length: %zu\r\n", size);
-	dprintf(fd, "Content-type: application/xml\r\n");
-	if (page == PAGE_SITEMAP_GZ)
-		dprintf(fd, "Content-encoding: x-gzip\r\n");
-	dprintf(fd, "\r\n");
-	write(fd, out, size);
+	struct output o;
+	o.sink.write = output_write;
+	o.sink.arg = &o;
+	o.gzip = (req.gz) ? buffer_gzip_new(req.file, mtime) : NULL;
+	o.cache_size = 0;
+	o.cache_fd = (validator) ? sitemap_cache_create(cache_file,
+	    &o.cache_tmp) : -1;
+
+	output_headers(req.gz, -1, (validator) ? etag : NULL, mtime);
+	if (req.page == PAGE_INDEX) {
+		char *base;
+		if (asprintf(&base, "%s://%s/%s", (ssl) ? "https" : "http",
+		    CMS_HOSTNAME, pages[PAGE_PART]) == -1)
+			err(1, NULL);
+		sitemap_write_index(sitemap, base, (req.gz) ? ".xml.gz"
+		    : ".xml", &o.sink);
+		free(base);
+	} else
+		sitemap_write(sitemap, (req.page == PAGE_PART) ? req.part : 1,
+		    &o.sink);
+	if (o.gzip) {
+		struct buffer_list *bl = buffer_list_new();
+		buffer_gzip_finish(o.gzip, bl);
+		output_list(&o, bl);
+		buffer_gzip_free(o.gzip);
+	}
+	if (o.cache_fd != -1)
+		sitemap_cache_commit(o.cache_fd, o.cache_tmp, cache_file,
+		    validator, mtime, o.cache_size);
 
-	free(out);
+	sitemap_free(sitemap);
+	free(cache_file);
 	return EXIT_SUCCESS;
 }
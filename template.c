@@ -20,6 +20,8 @@
 
 #include "template.h"
 
+static void		 _tmpl_var_clear(struct tmpl_var *);
+
 
 void
 tmpl_name_free(struct tmpl_name *_entry)
@@ -28,11 +30,26 @@ tmpl_name_free(struct tmpl_name *_entry)
 }
 
 
+void
+_tmpl_var_clear(struct tmpl_var *_var)
+{
+	free(_var->value);
+	_var->value = NULL;
+	_var->ref = NULL;
+	_var->reflen = 0;
+	if (_var->list) {
+		buffer_list_free(_var->list);
+		free(_var->list);
+		_var->list = NULL;
+	}
+}
+
+
 void
 tmpl_var_free(struct tmpl_var *_var)
 {
 	tmpl_name_free(&_var->name);
-	free(_var->value);
+	_tmpl_var_clear(_var);
 	free(_var);
 }
 
@@ -45,6 +62,9 @@ tmpl_var_new(const char *_name)
 		err(1, NULL);
 	var->name.name = strdup(_name);
 	var->value = NULL;
+	var->list = NULL;
+	var->ref = NULL;
+	var->reflen = 0;
 
 	return var;
 }
@@ -53,22 +73,59 @@ tmpl_var_new(const char *_name)
 void
 tmpl_var_set(struct tmpl_var *_var, const char *_value)
 {
-	free(_var->value);
+	_tmpl_var_clear(_var);
 	if (_value)
 		_var->value = strdup(_value);
-	else
-		_var->value = NULL;
 }
 
 
 void
 tmpl_var_setn(struct tmpl_var *_var, const char *_value, size_t _len)
 {
-	free(_var->value);
+	_tmpl_var_clear(_var);
 	_var->value = strndup(_value, _len);
 }
 
 
+/*
+ * A variable is true unless it is empty or "0".
+ */
+bool
+tmpl_var_istrue(const struct tmpl_var *_var)
+{
+	struct buffer *b;
+
+	if (_var->ref)
+		return (_var->reflen > 1
+				|| (_var->reflen == 1 && _var->ref[0] != '0'));
+	if (_var->list == NULL)
+		return (_var->value && _var->value[0] != '\0'
+				&& strcmp(_var->value, "0") != 0);
+	if (_var->list->size != 1)
+		return (_var->list->size > 0);
+	TAILQ_FOREACH(b, &_var->list->buffers, entries)
+		if (b->size == 1)
+			return (b->data[0] != '0');
+	return true;
+}
+
+
+/*
+ * Appends the value to _out, borrowed data and the buffers of a list are
+ * referenced, not copied.
+ */
+void
+tmpl_var_output(const struct tmpl_var *_var, struct buffer_list *_out)
+{
+	if (_var->ref)
+		buffer_list_add_ref(_out, _var->ref, _var->reflen);
+	else if (_var->list)
+		buffer_list_add_list_ref(_out, _var->list);
+	else if (_var->value)
+		buffer_list_add_string(_out, _var->value);
+}
+
+
 struct tmpl_data *
 tmpl_data_new(void)
 {
@@ -138,12 +195,53 @@ tmpl_data_move_variable(struct tmpl_data *_data, const char *_name,
 		var = tmpl_var_new(_name);
 		TAILQ_INSERT_TAIL(&_data->variables, var, entry);
 	} else {
-		free(var->value);
+		_tmpl_var_clear(var);
 	}
 	var->value = _value;
 }
 
 
+/*
+ * Makes the list _value, which the data takes over, the value of _name.
+ * It is spliced into the output without being joined.
+ */
+void
+tmpl_data_move_list(struct tmpl_data *_data, const char *_name,
+		struct buffer_list *_value)
+{
+	struct tmpl_var *var = tmpl_data_get_variable(_data, _name);
+	if (var == NULL) {
+		var = tmpl_var_new(_name);
+		TAILQ_INSERT_TAIL(&_data->variables, var, entry);
+	} else {
+		_tmpl_var_clear(var);
+	}
+	var->list = _value;
+}
+
+
+/*
+ * Borrows _len bytes at _value as the value of _name, e.g. from a mapped
+ * file of the page. The data has to stay valid until the output of the
+ * template has been sent.
+ */
+void
+tmpl_data_set_variable_ref(struct tmpl_data *_data, const char *_name,
+		const char *_value, size_t _len)
+{
+	struct tmpl_var *var = tmpl_data_get_variable(_data, _name);
+	if (var == NULL) {
+		var = tmpl_var_new(_name);
+		TAILQ_INSERT_TAIL(&_data->variables, var, entry);
+	} else {
+		_tmpl_var_clear(var);
+	}
+	// An empty value must not look unset
+	var->ref = (_value) ? _value : "";
+	var->reflen = _len;
+}
+
+
 void
 tmpl_data_set_variablen(struct tmpl_data *_data, const char *_name,
 		const char *_value, size_t _len)
@@ -26,10 +26,17 @@ struct tmpl_name {
 	char					*name;
 };
 
+/*
+ * The value is either a string, a list of buffers spliced into the output
+ * or borrowed data that has to outlive the output of the template.
+ */
 struct tmpl_var {
 	TAILQ_ENTRY(tmpl_var)			 entry;
 	struct tmpl_name			 name;
 	char					*value;
+	struct buffer_list			*list;
+	const char				*ref;
+	size_t					 reflen;
 };
 
 struct tmpl_data;
@@ -45,11 +52,28 @@ struct tmpl_data {
 	TAILQ_ENTRY(tmpl_data)			 entry;
 };
 
+/*
+ * Receives the output of the outermost template while it is rendered. The
+ * parser calls flush after the text that closes the <head> of the page,
+ * whenever TMPL_SINK_CHUNK bytes are pending and at the end, each time
+ * with the whole output so far. A blocking write in flush holds the
+ * renderer back until the client has taken the data.
+ */
+#define TMPL_SINK_CHUNK		16384
+
+struct tmpl_sink {
+	void		(*flush)(struct tmpl_sink *, struct buffer_list *);
+	void		*arg;
+};
+
 void			 tmpl_name_free(struct tmpl_name *);
 void			 tmpl_var_free(struct tmpl_var *);
 struct tmpl_var		*tmpl_var_new(const char *);
 void			 tmpl_var_set(struct tmpl_var *, const char *);
 void			 tmpl_var_setn(struct tmpl_var *, const char *, size_t);
+bool			 tmpl_var_istrue(const struct tmpl_var *);
+void			 tmpl_var_output(const struct tmpl_var *,
+				struct buffer_list *);
 void			 tmpl_data_free(struct tmpl_data *);
 struct tmpl_data	*tmpl_data_new(void);
 struct tmpl_var		*tmpl_data_get_variable(struct tmpl_data *,
@@ -60,6 +84,10 @@ void			 tmpl_data_set_variablen(struct tmpl_data *,
 				const char *, const char *, size_t);
 void			 tmpl_data_move_variable(struct tmpl_data *,
 				const char *, char *);
+void			 tmpl_data_move_list(struct tmpl_data *,
+				const char *, struct buffer_list *);
+void			 tmpl_data_set_variable_ref(struct tmpl_data *,
+				const char *, const char *, size_t);
 struct tmpl_loop	*tmpl_data_get_loop(struct tmpl_data *, const char *);
 struct tmpl_loop	*tmpl_data_add_loop(struct tmpl_data *, const char *);
 void			 tmpl_data_set_loop(struct tmpl_data *, const char *,
@@ -72,6 +100,8 @@ void			 tmpl_loop_add_data(struct tmpl_loop *,
 
 struct buffer_list	*tmpl_parse(const char *, size_t _len,
 				struct tmpl_data *);
+struct buffer_list	*tmpl_parse_sink(const char *, size_t,
+				struct tmpl_data *, struct tmpl_sink *);
 struct buffer_list	*tmpl_parse_file(const char *, struct tmpl_data *);
 
 #endif // __TEMPLATE_H__
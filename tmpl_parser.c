@@ -26,6 +26,7 @@
 #endif
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 
 #include "buffer.h"
@@ -57,6 +58,9 @@ struct parser_state {
 	struct buffer_list		*output;
 	struct tmpl_data		*data;
 	TAILQ_HEAD(tag_head, tag_info)	 tags;
+	struct tmpl_sink		*sink;
+	size_t				 flushed;	// output size
+	bool				 head;		// </head> seen
 };
 
 
@@ -89,6 +93,8 @@ static void			 parser_init(void);
 static void			 parser_cleanup(void);
 static int			 parser_enumerate_tags(struct parser_state *);
 static struct tag_info		*parser_find_close_tag(struct tag_info *);
+static void			 parser_flush(struct parser_state *,
+		const char *, size_t);
 static struct tag_info		*tag_info_new(char *, regmatch_t *);
 static void			 tag_info_free(struct tag_info *);
 
@@ -234,6 +240,9 @@ parser_state_new(const char *_input, size_t _size, struct buffer_list *_out)
 	state->output = _out;
 	state->data   = NULL;
 	TAILQ_INIT(&state->tags);
+	state->sink   = NULL;
+	state->flushed = 0;
+	state->head   = false;
 
 	return state;
 }
@@ -314,8 +323,7 @@ tmpl_handle_if(struct parser_state *_p, struct tag_info *_info)
 	bool cond = false;
 	struct tmpl_var *var = tmpl_data_get_variable(_p->data, _info->name);
 	if (var) {
-		if ((var->value) && (strlen(var->value) > 0))
-			cond = (strcmp(var->value, "0") != 0);
+		cond = tmpl_var_istrue(var);
 	} else {
 		cond = !tmpl_loop_isempty(
 				tmpl_data_get_loop(_p->data, _info->name)
@@ -392,15 +400,50 @@ tmpl_handle_var(struct parser_state *_parser, struct tag_info *_info)
 	const struct tmpl_var *var = tmpl_data_get_variable(
 			_parser->data, _info->name
 		);
-	if (var) {
-		buffer_list_add_string(_parser->output, var->value);
-	}
+	if (var)
+		tmpl_var_output(var, _parser->output);
 	return _info->end;
 }
 
 
+/*
+ * Passes the output to the sink once the text _s closes the head of the
+ * page or enough output is pending.
+ */
+void
+parser_flush(struct parser_state *_state, const char *_s, size_t _len)
+{
+	bool flush = false;
+
+	if (_state->sink == NULL)
+		return;
+	if (! _state->head && _s) {
+		for (size_t i = 0; i + 7 <= _len && ! _state->head; i++)
+			_state->head = (strncasecmp(_s + i, "</head>", 7) == 0);
+		flush = _state->head;
+	}
+	if (flush || _state->output->size - _state->flushed
+			>= TMPL_SINK_CHUNK) {
+		_state->sink->flush(_state->sink, _state->output);
+		_state->flushed = _state->output->size;
+	}
+}
+
+
 struct buffer_list *
 tmpl_parse(const char *_tmpl, size_t _len, struct tmpl_data *_data)
+{
+	return tmpl_parse_sink(_tmpl, _len, _data, NULL);
+}
+
+
+/*
+ * Renders the template _tmpl, with a sink the output is passed on while it
+ * is produced. The returned list holds the whole output in either case.
+ */
+struct buffer_list *
+tmpl_parse_sink(const char *_tmpl, size_t _len, struct tmpl_data *_data,
+		struct tmpl_sink *_sink)
 {
 	struct tag_info *info;
 
@@ -408,6 +451,7 @@ tmpl_parse(const char *_tmpl, size_t _len, struct tmpl_data *_data)
 	struct buffer_list *out = buffer_list_new();
 	struct parser_state *state = parser_state_new(_tmpl, _len, out);
 	state->data = _data;
+	state->sink = _sink;
 
 	// Get all tags from the current template
 	parser_enumerate_tags(state);
@@ -452,13 +496,17 @@ tmpl_parse(const char *_tmpl, size_t _len, struct tmpl_data *_data)
 		if (s < info->start || info->close) {
 			// Copy the data block from s to the tags start
 			buffer_list_add_stringn(out, s, info->start - s);
+			parser_flush(state, s, info->start - s);
 			s = info->end;
 		}
 		s = (*tags[info->type].handle_func)(state, info);
+		parser_flush(state, NULL, 0);
 	}
 	char *end = state->input + state->size;
 	if (s < end)
 		buffer_list_add_stringn(out, s, end - s);
+	if (_sink)
+		_sink->flush(_sink, out);
 
 	parser_state_free(state);
 	parser_cleanup();
@@ -0,0 +1,787 @@
+/*
+ * Copyright (c) 2018 Markus Hennecke <markus-hennecke@markus-hennecke.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Watches the content and template directories and publishes generation
+ * numbers for the cms processes, see generation.c. On Linux inotify(7)
+ * reports the directory of a change and only the page or the language it
+ * belongs to is scanned again, elsewhere the directories are polled. The
+ * content catalog is rewritten before changed content generations are
+ * published.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "catalog.h"
+#include "filehelper.h"
+#include "generation.h"
+#include "helper.h"
+
+#ifndef CMS_CONTENT_DIR
+#error "Need CMS_CONTENT_DIR defined to compile"
+#endif
+#ifndef CMS_TEMPLATE_DIR
+#error "Need CMS_TEMPLATE_DIR defined to compile"
+#endif
+#ifndef CMS_CATALOG_FILE
+#error "Need CMS_CATALOG_FILE defined to compile"
+#endif
+#ifndef CMS_GENERATION_FILE
+#error "Need CMS_GENERATION_FILE defined to compile"
+#endif
+
+// Milliseconds without events before a rescan is started
+#define WATCH_SETTLE		100
+
+struct update {
+	char		*key;
+	uint64_t	 state;
+	time_t		 newest;
+};
+
+struct updates {
+	struct update	*v;
+	size_t		 n;
+	size_t		 size;
+};
+
+/*
+ * A watched language or page directory with the stat hashes last seen.
+ * The language directory itself has no page name.
+ */
+struct node {
+	char		*lang;
+	char		*page;
+	int		 wd;
+	bool		 dirty;
+	uint64_t	 files;		// all files of the page
+	uint64_t	 nav;		// files of the navigation entry
+	time_t		 newest;
+	time_t		 nav_newest;
+};
+
+struct nodes {
+	struct node	*v;
+	size_t		 n;
+	size_t		 size;
+};
+
+char *content_dir = CMS_CHROOT CMS_CONTENT_DIR;
+char *template_dir = CMS_CHROOT CMS_TEMPLATE_DIR;
+char *catalog_file = CMS_CHROOT CMS_CATALOG_FILE;
+char *generation_file = CMS_CHROOT CMS_GENERATION_FILE;
+bool watch_failed = false;
+struct nodes nodes = { NULL, 0, 0 };
+int content_wd = -1;
+int template_wd = -1;
+time_t content_dir_newest = 0;
+
+// Files of a page that make up its navigation entry
+static const char *nav_files[] = {
+	"DESCR", "DESCR.md", "LINK", "SORT", "SSL", "SUB", "TITLE", NULL
+};
+
+static __dead void	usage(void);
+static void		updates_add(struct updates *, char *, uint64_t,
+		time_t);
+static void		updates_free(struct updates *);
+static bool		updates_differ(struct generation *, struct updates *);
+static void		updates_apply(struct generation *, struct updates *);
+static int		update_cmp(const void *, const void *);
+static int		watch_dir(int, const char *);
+static DIR		*open_dir_at(int, const char *, int *);
+static void		scan_templates(struct generation *, int);
+static struct node	*node_add(const char *, const char *);
+static struct node	*node_find(const char *, const char *);
+static struct node	*node_find_wd(int);
+static void		nodes_remove(const char *);
+static bool		is_nav_file(const char *);
+static bool		scan_page(int, struct node *, int);
+static bool		scan_lang(int, const char *, int);
+static void		lang_updates(struct updates *, const char *, bool);
+static void		langs_updates(struct updates *);
+static void		scan_content(int);
+static void		publish(struct generation *, struct updates *);
+static void		scan(struct generation *, int);
+static void		mark_lang(struct updates *, const char *, bool);
+static void		scan_changed(struct generation *, int);
+#ifdef __linux__
+static bool		read_events(int, bool *);
+#endif
+
+__dead void
+usage(void)
+{
+	extern char *__progname;
+
+	dprintf(STDERR_FILENO, "usage: %s [-d] [-i seconds]\n", __progname);
+	exit(1);
+}
+
+
+void
+updates_add(struct updates *_u, char *_key, uint64_t _state, time_t _newest)
+{
+	if (_u->n == _u->size) {
+		_u->size = (_u->size) ? _u->size * 2 : 64;
+		_u->v = reallocarray(_u->v, _u->size, sizeof(struct update));
+		if (_u->v == NULL)
+			err(1, NULL);
+	}
+	_u->v[_u->n].key = _key;
+	_u->v[_u->n].state = _state;
+	_u->v[_u->n].newest = _newest;
+	_u->n++;
+}
+
+
+void
+updates_free(struct updates *_u)
+{
+	for (size_t i = 0; i < _u->n; i++)
+		free(_u->v[i].key);
+	free(_u->v);
+	memset(_u, 0, sizeof(*_u));
+}
+
+
+bool
+updates_differ(struct generation *_g, struct updates *_u)
+{
+	for (size_t i = 0; i < _u->n; i++)
+		if (generation_differs(_g, _u->v[i].key, _u->v[i].state))
+			return true;
+	return false;
+}
+
+
+void
+updates_apply(struct generation *_g, struct updates *_u)
+{
+	for (size_t i = 0; i < _u->n; i++)
+		generation_update(_g, _u->v[i].key, _u->v[i].state,
+				_u->v[i].newest);
+}
+
+
+int
+update_cmp(const void *_a, const void *_b)
+{
+	const struct update *a = _a, *b = _b;
+	return strcmp(a->key, b->key);
+}
+
+
+/*
+ * Returns the watch descriptor of the directory _path, -1 if it is not
+ * watched.
+ */
+int
+watch_dir(int _ifd, const char *_path)
+{
+#ifdef __linux__
+	if (_ifd == -1 || watch_failed)
+		return -1;
+	int wd = inotify_add_watch(_ifd, _path, IN_ATTRIB | IN_CLOSE_WRITE
+			| IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVE);
+	if (wd == -1) {
+		// Changes are found by rescanning every interval then
+		warn("inotify_add_watch %s", _path);
+		watch_failed = true;
+	}
+	return wd;
+#else
+	return -1;
+#endif
+}
+
+
+DIR *
+open_dir_at(int _fd, const char *_name, int *_dirfd)
+{
+	*_dirfd = openat(_fd, _name, O_DIRECTORY | O_RDONLY);
+	if (*_dirfd == -1)
+		return NULL;
+	int fd = dir_reopen(*_dirfd);
+	DIR *dir = (fd == -1) ? NULL : fdopendir(fd);
+	if (dir == NULL) {
+		if (fd != -1)
+			close(fd);
+		close(*_dirfd);
+		*_dirfd = -1;
+	}
+	return dir;
+}
+
+
+/*
+ * Sums up the stat data of the files in the template directory.
+ */
+void
+scan_templates(struct generation *_g, int _ifd)
+{
+	struct dirent *dirent;
+	struct stat sb;
+	uint64_t state = 0;
+	time_t newest = 0;
+	int dirfd;
+
+	DIR *dir = open_dir_at(AT_FDCWD, template_dir, &dirfd);
+	if (dir == NULL) {
+		warn("%s", template_dir);
+		return;
+	}
+	template_wd = watch_dir(_ifd, template_dir);
+	while ((dirent = readdir(dir)) != NULL) {
+		if (dirent->d_name[0] == '.')
+			continue;
+		if (fstatat(dirfd, dirent->d_name, &sb, 0) == 0) {
+			state += hash_stat(dirent->d_name, &sb);
+			if (sb.st_mtim.tv_sec > newest)
+				newest = sb.st_mtim.tv_sec;
+		}
+	}
+	closedir(dir);
+	close(dirfd);
+	generation_update(_g, GENERATION_TEMPLATES, state, newest);
+}
+
+
+struct node *
+node_add(const char *_lang, const char *_page)
+{
+	if (nodes.n == nodes.size) {
+		nodes.size = (nodes.size) ? nodes.size * 2 : 256;
+		nodes.v = reallocarray(nodes.v, nodes.size,
+				sizeof(struct node));
+		if (nodes.v == NULL)
+			err(1, NULL);
+	}
+	struct node *n = &nodes.v[nodes.n++];
+	memset(n, 0, sizeof(*n));
+	n->wd = -1;
+	n->lang = strdup(_lang);
+	n->page = (_page) ? strdup(_page) : NULL;
+	if (n->lang == NULL || (_page && n->page == NULL))
+		err(1, NULL);
+	return n;
+}
+
+
+/*
+ * Returns the node of a page, or of the language for a NULL _page.
+ */
+struct node *
+node_find(const char *_lang, const char *_page)
+{
+	for (size_t i = 0; i < nodes.n; i++) {
+		struct node *n = &nodes.v[i];
+		if (strcmp(n->lang, _lang) != 0)
+			continue;
+		if ((_page == NULL) ? n->page == NULL
+				: (n->page && strcmp(n->page, _page) == 0))
+			return n;
+	}
+	return NULL;
+}
+
+
+struct node *
+node_find_wd(int _wd)
+{
+	for (size_t i = 0; i < nodes.n; i++)
+		if (nodes.v[i].wd == _wd)
+			return &nodes.v[i];
+	return NULL;
+}
+
+
+/*
+ * Forgets the nodes of the language _lang, or of all languages for a
+ * NULL _lang.
+ */
+void
+nodes_remove(const char *_lang)
+{
+	size_t j = 0;
+	for (size_t i = 0; i < nodes.n; i++) {
+		struct node *n = &nodes.v[i];
+		if (_lang == NULL || strcmp(n->lang, _lang) == 0) {
+			free(n->lang);
+			free(n->page);
+		} else
+			nodes.v[j++] = *n;
+	}
+	nodes.n = j;
+}
+
+
+bool
+is_nav_file(const char *_name)
+{
+	for (const char **f = nav_files; *f; f++)
+		if (strcmp(*f, _name) == 0)
+			return true;
+	return false;
+}
+
+
+/*
+ * Sums up the stat data of the files of a page, _lfd is its language
+ * directory. The content belongs to the navigation entry of a page
+ * without LINK, it may carry a page header. Returns false if the page
+ * directory is gone.
+ */
+bool
+scan_page(int _lfd, struct node *_n, int _ifd)
+{
+	struct dirent *dirent;
+	struct stat sb;
+	char path[PATH_MAX];
+	uint64_t content = 0;
+	time_t content_newest = 0;
+	bool link = false;
+	int pfd;
+
+	DIR *dir = open_dir_at(_lfd, _n->page, &pfd);
+	if (dir == NULL)
+		return false;
+	snprintf(path, sizeof(path), "%s/%s/%s", content_dir, _n->lang,
+			_n->page);
+	_n->wd = watch_dir(_ifd, path);
+	_n->files = _n->nav = 0;
+	_n->newest = _n->nav_newest = 0;
+	if (fstat(pfd, &sb) == 0)
+		_n->newest = sb.st_mtim.tv_sec;
+	while ((dirent = readdir(dir)) != NULL) {
+		if (dirent->d_name[0] == '.'
+				|| fstatat(pfd, dirent->d_name, &sb, 0) == -1)
+			continue;
+		uint64_t h = hash_stat(dirent->d_name, &sb);
+		time_t mtime = sb.st_mtim.tv_sec;
+		_n->files += h;
+		if (mtime > _n->newest)
+			_n->newest = mtime;
+		if (strncmp(dirent->d_name, "CONTENT", 7) == 0) {
+			content += h;
+			if (mtime > content_newest)
+				content_newest = mtime;
+		}
+		if (! is_nav_file(dirent->d_name))
+			continue;
+		link |= (strcmp(dirent->d_name, "LINK") == 0);
+		_n->nav += h;
+		if (mtime > _n->nav_newest)
+			_n->nav_newest = mtime;
+	}
+	closedir(dir);
+	close(pfd);
+	if (! link) {
+		_n->nav += content;
+		if (content_newest > _n->nav_newest)
+			_n->nav_newest = content_newest;
+	}
+	return true;
+}
+
+
+/*
+ * Reads the pages of the language _lang again. Returns false if the
+ * language directory is gone.
+ */
+bool
+scan_lang(int _cfd, const char *_lang, int _ifd)
+{
+	struct dirent *dirent;
+	struct stat sb;
+	char path[PATH_MAX];
+	int lfd;
+
+	nodes_remove(_lang);
+	DIR *dir = open_dir_at(_cfd, _lang, &lfd);
+	if (dir == NULL)
+		return false;
+	struct node *l = node_add(_lang, NULL);
+	snprintf(path, sizeof(path), "%s/%s", content_dir, _lang);
+	l->wd = watch_dir(_ifd, path);
+	if (fstat(lfd, &sb) == 0)
+		l->newest = sb.st_mtim.tv_sec;
+	while ((dirent = readdir(dir)) != NULL) {
+		if (dirent->d_name[0] == '.'
+				|| fstatat(lfd, dirent->d_name, &sb, 0) == -1
+				|| ! S_ISDIR(sb.st_mode))
+			continue;
+		struct node *n = node_add(_lang, dirent->d_name);
+		if (! scan_page(lfd, n, _ifd)) {
+			free(n->lang);
+			free(n->page);
+			nodes.n--;
+		}
+	}
+	closedir(dir);
+	close(lfd);
+	return true;
+}
+
+
+/*
+ * Adds the navigation of the language _lang, everything below it and,
+ * with _pages, every one of its pages to the updates.
+ */
+void
+lang_updates(struct updates *_u, const char *_lang, bool _pages)
+{
+	struct node *l = node_find(_lang, NULL);
+	uint64_t nav = 0, all = 0;
+	time_t nav_newest = (l) ? l->newest : 0;
+	time_t newest = nav_newest;
+
+	for (size_t i = 0; i < nodes.n; i++) {
+		struct node *n = &nodes.v[i];
+		if (n->page == NULL || strcmp(n->lang, _lang) != 0)
+			continue;
+		uint64_t name = hash_fnv1a(HASH_FNV1A_INIT, n->page,
+				strlen(n->page) + 1);
+		nav += name + n->nav;
+		all += name + n->files;
+		if (n->nav_newest > nav_newest)
+			nav_newest = n->nav_newest;
+		if (n->newest > newest)
+			newest = n->newest;
+		if (_pages)
+			updates_add(_u, generation_key(_lang, n->page),
+					n->files, n->newest);
+	}
+	char *key = strdup(_lang);
+	if (key == NULL)
+		err(1, NULL);
+	updates_add(_u, key, nav, nav_newest);
+	updates_add(_u, generation_key(_lang, ""), all, newest);
+}
+
+
+/*
+ * Adds the set of languages and the languages every page exists in to
+ * the updates.
+ */
+void
+langs_updates(struct updates *_u)
+{
+	struct updates pages = { NULL, 0, 0 };
+	uint64_t root = 0;
+
+	for (size_t i = 0; i < nodes.n; i++) {
+		struct node *n = &nodes.v[i];
+		uint64_t lang = hash_fnv1a(HASH_FNV1A_INIT, n->lang,
+				strlen(n->lang) + 1);
+		if (n->page == NULL) {
+			root += lang;
+			continue;
+		}
+		struct node *l = node_find(n->lang, NULL);
+		updates_add(&pages, generation_page_key(n->page), lang,
+				(l) ? l->newest : 0);
+	}
+	char *key = strdup("");
+	if (key == NULL)
+		err(1, NULL);
+	updates_add(_u, key, root, content_dir_newest);
+
+	// Sum up the languages every page exists in
+	qsort(pages.v, pages.n, sizeof(struct update), update_cmp);
+	for (size_t i = 0; i < pages.n; ) {
+		size_t j = i;
+		uint64_t state = 0;
+		time_t newest = 0;
+		for (; j < pages.n && strcmp(pages.v[i].key, pages.v[j].key)
+				== 0; j++) {
+			state += pages.v[j].state;
+			if (pages.v[j].newest > newest)
+				newest = pages.v[j].newest;
+		}
+		char *page = strdup(pages.v[i].key);
+		if (page == NULL)
+			err(1, NULL);
+		updates_add(_u, page, state, newest);
+		i = j;
+	}
+	updates_free(&pages);
+}
+
+
+/*
+ * Reads the whole content directory again.
+ */
+void
+scan_content(int _ifd)
+{
+	struct dirent *dirent;
+	struct stat sb;
+	int cfd;
+
+	nodes_remove(NULL);
+	DIR *dir = open_dir_at(AT_FDCWD, content_dir, &cfd);
+	if (dir == NULL) {
+		warn("%s", content_dir);
+		return;
+	}
+	content_wd = watch_dir(_ifd, content_dir);
+	if (fstat(cfd, &sb) == 0)
+		content_dir_newest = sb.st_mtim.tv_sec;
+	while ((dirent = readdir(dir)) != NULL) {
+		if (dirent->d_name[0] == '.')
+			continue;
+		scan_lang(cfd, dirent->d_name, _ifd);
+	}
+	closedir(dir);
+	close(cfd);
+}
+
+
+void
+publish(struct generation *_g, struct updates *_u)
+{
+	// The cms processes must not read an outdated catalog with the new
+	// generations
+	if (updates_differ(_g, _u))
+		catalog_write(content_dir, catalog_file);
+	updates_apply(_g, _u);
+}
+
+
+/*
+ * Scans the content and the templates completely.
+ */
+void
+scan(struct generation *_g, int _ifd)
+{
+	struct updates u = { NULL, 0, 0 };
+
+	scan_content(_ifd);
+	for (size_t i = 0; i < nodes.n; i++)
+		if (nodes.v[i].page == NULL)
+			lang_updates(&u, nodes.v[i].lang, true);
+	langs_updates(&u);
+	publish(_g, &u);
+	updates_free(&u);
+	scan_templates(_g, _ifd);
+}
+
+
+/*
+ * Remembers a language whose navigation has to be updated, with _rescan
+ * its pages are read again.
+ */
+void
+mark_lang(struct updates *_langs, const char *_lang, bool _rescan)
+{
+	char *lang = strdup(_lang);
+	if (lang == NULL)
+		err(1, NULL);
+	updates_add(_langs, lang, _rescan, 0);
+}
+
+
+/*
+ * Scans the pages and languages marked dirty by the events. A changed
+ * page only updates its own generation and the navigation of its
+ * language, a changed language directory reads all of its pages again.
+ */
+void
+scan_changed(struct generation *_g, int _ifd)
+{
+	struct updates u = { NULL, 0, 0 };
+	struct updates langs = { NULL, 0, 0 };
+	bool structure = false;
+
+	int cfd = open(content_dir, O_DIRECTORY | O_RDONLY);
+	if (cfd == -1) {
+		warn("%s", content_dir);
+		return;
+	}
+	for (size_t i = 0; i < nodes.n; i++) {
+		struct node *n = &nodes.v[i];
+		if (! n->dirty)
+			continue;
+		n->dirty = false;
+		if (n->page == NULL) {
+			mark_lang(&langs, n->lang, true);
+			continue;
+		}
+		int lfd = openat(cfd, n->lang, O_DIRECTORY | O_RDONLY);
+		if (lfd != -1 && scan_page(lfd, n, _ifd)) {
+			updates_add(&u, generation_key(n->lang, n->page),
+					n->files, n->newest);
+			mark_lang(&langs, n->lang, false);
+		} else
+			mark_lang(&langs, n->lang, true);
+		if (lfd != -1)
+			close(lfd);
+	}
+
+	// scan_lang() moves the nodes, the languages are collected first
+	qsort(langs.v, langs.n, sizeof(struct update), update_cmp);
+	for (size_t i = 0, j; i < langs.n; i = j) {
+		bool rescan = false;
+		for (j = i; j < langs.n
+				&& strcmp(langs.v[i].key, langs.v[j].key) == 0;
+				j++)
+			rescan |= (langs.v[j].state != 0);
+		if (rescan) {
+			scan_lang(cfd, langs.v[i].key, _ifd);
+			structure = true;
+		}
+		lang_updates(&u, langs.v[i].key, rescan);
+	}
+	if (structure)
+		langs_updates(&u);
+	publish(_g, &u);
+	updates_free(&langs);
+	updates_free(&u);
+	close(cfd);
+}
+
+
+#ifdef __linux__
+/*
+ * Marks the directories named by the pending events, returns true if
+ * the content has to be scanned completely. _templates is set for a
+ * change of the templates.
+ */
+bool
+read_events(int _ifd, bool *_templates)
+{
+	char buf[8192]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool full = false;
+	ssize_t len;
+
+	while ((len = read(_ifd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + len; ) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			p += sizeof(struct inotify_event) + ev->len;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				full = true;
+				continue;
+			}
+			if (ev->mask & IN_IGNORED)
+				continue;
+			if (ev->wd == content_wd) {
+				full = true;
+				continue;
+			}
+			if (ev->wd == template_wd) {
+				*_templates = true;
+				continue;
+			}
+			struct node *n = node_find_wd(ev->wd);
+			if (n)
+				n->dirty = true;
+		}
+	}
+	return full;
+}
+#endif
+
+
+int
+main(int argc, char **argv)
+{
+	const char *errstr;
+	bool dflag = false;
+	int interval = 5;
+	int ch, ifd = -1;
+
+	while ((ch = getopt(argc, argv, "di:")) != -1) {
+		switch (ch) {
+		case 'd':
+			dflag = true;
+			break;
+		case 'i':
+			interval = strtonum(optarg, 1, 3600, &errstr);
+			if (errstr)
+				errx(1, "interval %s: %s", errstr, optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 0)
+		usage();
+
+	// The lock on the generation file is not inherited by the child
+	if (! dflag && daemon(0, 0) == -1)
+		err(1, "daemon");
+	struct generation *g = generation_create(generation_file);
+	if (g == NULL)
+		return EXIT_FAILURE;
+
+#ifdef __linux__
+	if ((ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+		warn("inotify_init1, polling every %d seconds", interval);
+#endif
+	// Catch up with the changes made while not running
+	scan(g, ifd);
+
+	for (;;) {
+		// Without a watch on every directory all of them are polled
+		if (ifd == -1 || watch_failed) {
+			sleep(interval);
+			scan(g, ifd);
+			continue;
+		}
+#ifdef __linux__
+		struct pollfd pfd = { ifd, POLLIN, 0 };
+		int n = poll(&pfd, 1, -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+		// An update touches several files, wait for it to finish
+		bool full = false, templates = false;
+		while (n > 0) {
+			full |= read_events(ifd, &templates);
+			n = poll(&pfd, 1, WATCH_SETTLE);
+		}
+		if (full) {
+			scan(g, ifd);
+			continue;
+		}
+		scan_changed(g, ifd);
+		if (templates)
+			scan_templates(g, ifd);
+#endif
+	}
+	/* NOTREACHED */
+}